@@ -4,36 +4,220 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../common/trace.h"
+
 Ast ast_create(Arena *a) {
     return (Ast){
         .arena = a,
         .root = NULL,
+        .node_count = 0,
+        .node_capacity = 0,
+        .nodes = NULL,
+        .child_ranges = NULL,
+        .by_kind = {{0}},
+        .stale = {0},
+        .detached_count = 0,
+        .dropped_children = 0,
+        .child_pool = {0},
+        .open_lists = {0},
+        .free_lists = {0},
+        .dfs_stack = {0},
         .tree_data = tree_data_create(a),
+        .parse_deferred = NULL,
+        .deferred_max_expr_depth = 0,
+        .source = NULL,
+        .pending_shifts = NULL,
     };
 }
 
-static DfsCtrl ast_node_delete(void *ctx, AstNode *node) {
-    (void)ctx;
-    if (node->children) {
-        children_delete(node->children);
+// Makes room in the tables indexed by node id for one more node
+static u32 node_id_create(Ast *ast, NodeKind kind) {
+    if (ast->node_count == ast->node_capacity) {
+        u32 cap = ast->node_capacity != 0 ? ast->node_capacity * 2 : 64;
+        ast->nodes = realloc(ast->nodes, cap * sizeof(*ast->nodes));
+        ast->child_ranges =
+            realloc(ast->child_ranges, cap * sizeof(*ast->child_ranges));
+        if (ast->nodes == NULL || ast->child_ranges == NULL) {
+            panic("out of memory");
+        }
+        ast->node_capacity = cap;
     }
-    return DFS_CTRL_KEEP_GOING;
+    ast->child_ranges[ast->node_count] = (ChildRange){0};
+    APPEND(&ast->by_kind[kind], ast->node_count);
+    return ast->node_count++;
+}
+
+// Appends to the pool, returns where the items went
+static u32 child_pool_append(Ast *ast, const Child *items, u32 len) {
+    ChildList *pool = &ast->child_pool;
+    if (len == 0) {
+        return 0;
+    }
+    if (pool->len + len > pool->cap) {
+        u32 cap = pool->cap != 0 ? pool->cap * 2 : 256;
+        while (cap < pool->len + len) {
+            cap *= 2;
+        }
+        pool->items = realloc(pool->items, cap * sizeof(Child));
+        if (pool->items == NULL) {
+            panic("out of memory");
+        }
+        pool->cap = cap;
+    }
+    u32 start = pool->len;
+    memcpy(pool->items + start, items, len * sizeof(Child));
+    pool->len += len;
+    return start;
+}
+
+// The list for adding children to `node`, copied out of the pool if it was
+// closed. The children it had in the pool are left there unused.
+static ChildList *open_list(Ast *ast, AstNode *node) {
+    ChildRange *range = &ast->child_ranges[node->id];
+    if (range->len == OPEN_CHILDREN) {
+        return &ast->open_lists.items[range->start];
+    }
+    u32 slot;
+    if (ast->free_lists.len != 0) {
+        slot = ast->free_lists.items[--ast->free_lists.len];
+    } else {
+        slot = ast->open_lists.len;
+        APPEND(&ast->open_lists, (ChildList){0});
+    }
+    ChildList *list = &ast->open_lists.items[slot];
+    for (u32 i = 0; i < range->len; i++) {
+        APPEND(list, ast->child_pool.items[range->start + i]);
+    }
+    *range = (ChildRange){.start = slot, .len = OPEN_CHILDREN};
+    return list;
+}
+
+// Keeps the memory of the list around for the next node opened
+static void release_list(Ast *ast, u32 slot) {
+    ast->open_lists.items[slot].len = 0;
+    APPEND(&ast->free_lists, slot);
+}
+
+void ast_node_close(Ast *ast, AstNode *node) {
+    ChildRange *range = &ast->child_ranges[node->id];
+    if (range->len != OPEN_CHILDREN) {
+        return;
+    }
+    u32 slot = range->start;
+    ChildList *list = &ast->open_lists.items[slot];
+    *range = (ChildRange){
+        .start = child_pool_append(ast, list->items, list->len),
+        .len = list->len,
+    };
+    release_list(ast, slot);
+}
+
+void ast_node_children_set(Ast *ast, AstNode *node, const Child *items,
+                           u32 len) {
+    ChildRange *range = &ast->child_ranges[node->id];
+    if (range->len == OPEN_CHILDREN) {
+        release_list(ast, range->start);
+    } else {
+        ast->dropped_children += range->len;
+    }
+    *range = (ChildRange){
+        .start = child_pool_append(ast, items, len),
+        .len = len,
+    };
+}
+
+void ast_subtree_adopt(Ast *ast, Ast *from, AstNode *node) {
+    // Stays put as nothing is added to `from`
+    Children children = ast_node_children(from, node);
+    node->id = node_id_create(ast, node->kind);
+    ast->nodes[node->id] = node;
+    ast_node_children_set(ast, node, children.items, children.len);
+    for (u32 i = 0; i < children.len; i++) {
+        if (children.items[i].t == CHILD_NODE) {
+            ast_subtree_adopt(ast, from, children.items[i].node);
+            children.items[i].node->parent = node->id;
+        }
+    }
+}
+
+void ast_node_ids_truncate(Ast *ast, u32 count) {
+    assert(count <= ast->node_count);
+    for (u32 k = 0; k < NODE_KIND_COUNT; k++) {
+        NodeIds *ids = &ast->by_kind[k];
+        while (ids->len != 0 && ids->items[ids->len - 1] >= count) {
+            ids->len--;
+        }
+    }
+    ast->node_count = count;
+}
+
+void ast_subtree_detach(Ast *ast, AstNode *node) {
+    // Frames above a traversal we may be nested in, see traverse_dfs
+    u32 base = ast->dfs_stack.len;
+    APPEND(&ast->dfs_stack, (DfsFrame){.node = node});
+    while (ast->dfs_stack.len != base) {
+        AstNode *n = ast->dfs_stack.items[--ast->dfs_stack.len].node;
+        if (n->detached) {
+            continue;
+        }
+        n->detached = true;
+        ast->stale[n->kind]++;
+        ast->detached_count++;
+        Children children = ast_node_children(ast, n);
+        for (u32 i = 0; i < children.len; i++) {
+            if (children.items[i].t == CHILD_NODE) {
+                APPEND(&ast->dfs_stack,
+                       (DfsFrame){.node = children.items[i].node});
+            }
+        }
+    }
+}
+
+NodeIds ast_nodes_of_kind(Ast *ast, NodeKind kind) {
+    NodeIds *ids = &ast->by_kind[kind];
+    if (ast->stale[kind] != 0) {
+        u32 len = 0;
+        for (u32 i = 0; i < ids->len; i++) {
+            if (!ast->nodes[ids->items[i]]->detached) {
+                ids->items[len++] = ids->items[i];
+            }
+        }
+        ids->len = len;
+        ast->stale[kind] = 0;
+    }
+    return *ids;
 }
 
 void ast_delete(Ast ast) {
-    ast_traverse_dfs(NULL, &ast,
-                     (EnterExitVTable){
-                         .exit = ast_node_delete,
-                     });
+    TRACE_BEGIN("ast_delete");
+    free(ast.nodes);
+    free(ast.child_ranges);
+    for (u32 k = 0; k < NODE_KIND_COUNT; k++) {
+        free(ast.by_kind[k].items);
+    }
+    free(ast.child_pool.items);
+    for (u32 i = 0; i < ast.open_lists.len; i++) {
+        free(ast.open_lists.items[i].items);
+    }
+    free(ast.open_lists.items);
+    free(ast.free_lists.items);
+    free(ast.dfs_stack.items);
     tree_data_delete(ast.tree_data);
+    if (ast.pending_shifts != NULL) {
+        shift_map_delete(ast.pending_shifts);
+    }
+    TRACE_END("ast_delete");
 }
 
 TreeData tree_data_create(Arena *a) {
     return (TreeData){
         .arena = a,
-        .scope = scope_map_create(128),
-        .resolves_to = resolves_to_map_create(128),
-        .type = type_map_create(128),
+        .scope = NULL,
+        .scope_capacity = 0,
+        .resolves_to = NULL,
+        .resolves_to_capacity = 0,
+        .type = NULL,
+        .type_capacity = 0,
         .builtin_type = calloc(TOK_KIND_COUNT, sizeof(TypeId)),
         .type_data = type_data_create(),
         .type_source = type_source_create(128),
@@ -41,29 +225,29 @@ TreeData tree_data_create(Arena *a) {
 }
 
 void tree_data_delete(TreeData td) {
-    MapCursor it = map_cursor_create(td.scope);
-    while (map_cursor_next(&it)) {
-        Scope **scope = it.current;
-        if ((*scope)->table) {
-            scope_entry_map_delete((*scope)->table);
-            (*scope)->table = NULL;
+    for (u32 id = 0; id < td.scope_capacity; id++) {
+        Scope *scope = td.scope[id];
+        if (scope != NULL && scope->table) {
+            scope_entry_map_delete(scope->table);
+            scope->table = NULL;
         }
     }
-    scope_map_delete(td.scope);
-    resolves_to_map_delete(td.resolves_to);
-    type_map_delete(td.type);
+    free(td.scope);
+    free(td.resolves_to);
+    free(td.type);
     type_data_delete(td.type_data);
     type_source_delete(td.type_source);
     free(td.builtin_type);
 }
 
 #define IMPL_CHILD_ACCESS(NODE, UPPER_NAME, lower_name)       \
-    NODE *child_##lower_name##_at(AstNode *n, size_t index) { \
-        assert(da_length(n->children) != 0);                  \
-        Child *ch = children_at(n->children, index);          \
-        assert(ch->t == CHILD_NODE);                          \
-        assert(ch->node->kind == NODE_##UPPER_NAME);          \
-        return (NODE *)ch->node;                              \
+    NODE *child_##lower_name##_at(Ast *ast, AstNode *n, size_t index) { \
+        Children children = ast_node_children(ast, n);                  \
+        assert(index < children.len);                                    \
+        Child *ch = &children.items[index];                              \
+        assert(ch->t == CHILD_NODE);                                     \
+        assert(ch->node->kind == NODE_##UPPER_NAME);                     \
+        return (NODE *)ch->node;                                         \
     }
 
 EACH_NODE(IMPL_CHILD_ACCESS)
@@ -120,17 +304,43 @@ Scope *ast_scope_create(Ast *ast) {
     return res;
 }
 
+// Makes room in a side table for `n`, and any node created so far
+static void *node_table_reserve(Ast *ast, void *table, u32 *capacity,
+                                AstNode *n, usize item_size) {
+    if (n->id < *capacity) {
+        return table;
+    }
+    u32 cap = *capacity * 2;
+    if (cap < ast->node_count) {
+        cap = ast->node_count;
+    }
+    if (cap <= n->id) {
+        cap = n->id + 1;
+    }
+    u8 *res = realloc(table, cap * item_size);
+    if (res == NULL) {
+        panic("out of memory");
+    }
+    memset(res + *capacity * item_size, 0, (cap - *capacity) * item_size);
+    *capacity = cap;
+    return res;
+}
+
 void ast_scope_set(Ast *ast, AstNode *n, Scope *scope) {
-    bool ins = false;
-    Scope **sr = scope_map_get_or_insert(&ast->tree_data.scope, n, &ins);
-    assert(ins && "probably tried to insert scope twice");
+    TreeData *td = &ast->tree_data;
+    td->scope = node_table_reserve(ast, td->scope, &td->scope_capacity, n,
+                                   sizeof(*td->scope));
+    assert(td->scope[n->id] == NULL &&
+           "probably tried to insert scope twice");
     scope->self = n;
-    *sr = scope;
+    td->scope[n->id] = scope;
 }
 
 Scope *ast_scope_get(Ast *ast, AstNode *n) {
-    Scope **res = scope_map_get(ast->tree_data.scope, n);
-    return res ? *res : NULL;
+    if (n == NULL || n->id >= ast->tree_data.scope_capacity) {
+        return NULL;
+    }
+    return ast->tree_data.scope[n->id];
 }
 
 void ast_scope_insert(Ast *ast, Scope *scope, string name, AstNode *n,
@@ -188,29 +398,108 @@ ScopeLookup scope_lookup(Scope *scope, string name, ScopeLookupMode mode) {
     return (ScopeLookup){NULL, NULL};
 }
 
-void ast_traverse_dfs(void *ctx, Ast *ast, EnterExitVTable vtable) {
-    DfsCtrl ctrl = DFS_CTRL_KEEP_GOING;
-    if (vtable.enter && !ast->root->has_error) {
-        ctrl = vtable.enter(ctx, ast->root);
-    }
-    if (ctrl == DFS_CTRL_KEEP_GOING) {
-        Child *children = ast->root->children;
-        for (size_t i = 0; i < da_length(children); i++) {
-            Child child = children[i];
-            switch (child.t) {
-                case CHILD_NODE: {
-                    Ast sub_tree = *ast;
-                    sub_tree.root = child.node;
-                    ast_traverse_dfs(ctx, &sub_tree, vtable);
-                    break;
+// The frames go on `ast->dfs_stack` above any left there by a traversal we
+// are nested in (a visitor can start one), they are only ever referred to by
+// index as a nested traversal can move the stack.
+static void traverse_dfs(Ast *ast, AstNode *node, const AstVisitor *visitors,
+                         u32 len) {
+    u32 base = ast->dfs_stack.len;
+    u32 active = len == AST_VISITORS_MAX ? UINT32_MAX : (1u << len) - 1;
+    while (node != NULL) {
+        if (node->unsettled) {
+            ast_node_settle(ast, node);
+        }
+        u32 descend = active;
+        if (!node->has_error) {
+            for (u32 i = 0; i < len; i++) {
+                EnterExitVTable vt = visitors[i].vtable;
+                if ((active & 1u << i) && vt.enter &&
+                    vt.enter(visitors[i].ctx, node) != DFS_CTRL_KEEP_GOING) {
+                    descend &= ~(1u << i);
                 }
-                default:
+            }
+        }
+        APPEND(&ast->dfs_stack, (DfsFrame){
+                                    .node = node,
+                                    .next = descend != 0 ? 0 : UINT32_MAX,
+                                    .entered = active,
+                                    .descend = descend,
+                                });
+
+        // Up until a node with a child left to enter
+        node = NULL;
+        while (node == NULL && ast->dfs_stack.len != base) {
+            DfsFrame *top = &ast->dfs_stack.items[ast->dfs_stack.len - 1];
+            // Looked up again each time, `enter` can add nodes and move the
+            // pool (see ast_materialize)
+            Children children = ast_node_children(ast, top->node);
+            while (top->next < children.len) {
+                Child child = children.items[top->next++];
+                if (child.t == CHILD_NODE) {
+                    node = child.node;
+                    active = top->descend;
                     break;
+                }
+            }
+            if (node == NULL) {
+                DfsFrame done = *top;
+                ast->dfs_stack.len--;
+                if (done.node->has_error) {
+                    continue;
+                }
+                for (u32 i = 0; i < len; i++) {
+                    EnterExitVTable vt = visitors[i].vtable;
+                    if ((done.entered & 1u << i) && vt.exit) {
+                        (void)vt.exit(visitors[i].ctx, done.node);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void ast_traverse_dfs(void *ctx, Ast *ast, EnterExitVTable vtable) {
+    ast_traverse_dfs_from(ctx, ast, ast->root, vtable);
+}
+
+void ast_traverse_dfs_from(void *ctx, Ast *ast, AstNode *node,
+                           EnterExitVTable vtable) {
+    const char *name = vtable.name ? vtable.name : "ast_traverse_dfs";
+    AstVisitor visitor = {.ctx = ctx, .vtable = vtable};
+    TRACE_BEGIN(name);
+    traverse_dfs(ast, node, &visitor, 1);
+    TRACE_END(name);
+}
+
+void ast_traverse_fused(Ast *ast, const AstVisitor *visitors, u32 len) {
+    assert(len <= AST_VISITORS_MAX);
+    // Each visitor goes in the walk after the last one it has to wait for
+    u32 walk_of[AST_VISITORS_MAX];
+    u32 walks = 0;
+    for (u32 i = 0; i < len; i++) {
+        assert((visitors[i].after >> i) == 0 && "can only wait for earlier");
+        walk_of[i] = 0;
+        for (u32 j = 0; j < i; j++) {
+            if ((visitors[i].after & 1u << j) && walk_of[j] >= walk_of[i]) {
+                walk_of[i] = walk_of[j] + 1;
             }
         }
+        if (walk_of[i] + 1 > walks) {
+            walks = walk_of[i] + 1;
+        }
     }
-    if (vtable.exit && !ast->root->has_error) {
-        (void)vtable.exit(ctx, ast->root);
+
+    AstVisitor walk[AST_VISITORS_MAX];
+    for (u32 w = 0; w < walks; w++) {
+        u32 n = 0;
+        for (u32 i = 0; i < len; i++) {
+            if (walk_of[i] == w) {
+                walk[n++] = visitors[i];
+            }
+        }
+        TRACE_BEGIN("ast_traverse_fused");
+        traverse_dfs(ast, ast->root, walk, n);
+        TRACE_END("ast_traverse_fused");
     }
 }
 
@@ -224,57 +513,269 @@ const char *node_kind_to_string(NodeKind kind) {
     return node_descriptors[kind].name;
 }
 
+usize node_kind_size(NodeKind kind) {
+    return node_descriptors[kind].layout.size;
+}
+
 AstNode *ast_node_create(Ast *ast, NodeKind kind) {
     Layout layout = node_descriptors[kind].layout;
     AstNode *res = arena_alloc(ast->arena, layout.size, layout.align);
     res->kind = kind;
+    res->parent = NO_NODE;
+    res->id = node_id_create(ast, kind);
+    ast->nodes[res->id] = res;
     return res;
 }
 
-void ast_node_child_add(AstNode *node, Child child) {
-    if (!node->children) {
-        node->children = children_create();
-    }
-    children_append(&node->children, child);
+void ast_node_child_add(Ast *ast, AstNode *node, Child child) {
+    APPEND(open_list(ast, node), child);
 }
 
-void ast_node_reparent(AstNode *node, AstNode *new_parent) {
+void ast_node_reparent(Ast *ast, AstNode *node, AstNode *new_parent) {
     // If the node already has a parent, remove it from the
     // current parent's child list
-    if (node->parent.ptr != NULL) {
-        AstNode *p = node->parent.ptr;
+    AstNode *p = ast_node_parent(ast, node);
+    if (p != NULL) {
+        ChildList *children = open_list(ast, p);
         // Find the position of the node in the parent's child list
         size_t i = 0;
-        assert(da_length(p->children) != 0);
-        for (; i < da_length(p->children); i++) {
-            Child child = p->children[i];
+        assert(children->len != 0);
+        for (; i < children->len; i++) {
+            Child child = children->items[i];
             if (child.t == CHILD_NODE && child.node == node) {
                 break;
             }
         }
 
-        Child found = p->children[i];
+        Child found = children->items[i];
         assert(found.t == CHILD_NODE && found.node == node);
 
-        children_remove(p->children, i);
+        memmove(&children->items[i], &children->items[i + 1],
+                (children->len - i - 1) * sizeof(Child));
+        children->len--;
     }
 
-    ast_node_child_add(new_parent, child_node_create(node));
-    node->parent.ptr = new_parent;
+    ast_node_child_add(ast, new_parent, child_node_create(node));
+    ast_node_parent_set(node, new_parent);
+}
+
+void ast_node_shift(Ast *ast, AstNode *node, s32 delta) {
+    if (ast->pending_shifts == NULL) {
+        ast->pending_shifts = shift_map_create(128);
+    }
+    bool inserted = false;
+    s32 *shift =
+        shift_map_get_or_insert(&ast->pending_shifts, node, &inserted);
+    if (inserted || !node->unsettled) {
+        *shift = 0;
+    }
+    *shift += delta;
+    node->unsettled = true;
+}
+
+static s32 own_shift(Ast *ast, AstNode *node) {
+    if (!node->unsettled) {
+        return 0;
+    }
+    return *shift_map_get(ast->pending_shifts, node);
+}
+
+s32 ast_node_pending_shift(Ast *ast, AstNode *node) {
+    s32 shift = 0;
+    for (AstNode *it = node; it != NULL; it = ast_node_parent(ast, it)) {
+        shift += own_shift(ast, it);
+    }
+    return shift;
+}
+
+static void settle_tok(Tok *tok, s32 shift, string text) {
+    // Not set, or EOF
+    if (tok->text.data == NULL) {
+        return;
+    }
+    tok->offset += shift;
+    if (tok->t != T_EMPTY_STRING) {
+        tok->text.data = text.data + tok->offset;
+    }
+}
+
+// Everything in `node` except its child nodes
+static void settle_fields(Ast *ast, AstNode *node, s32 shift, string text) {
+    node->offset += shift;
+    Children children = ast_node_children(ast, node);
+    for (size_t i = 0; i < children.len; i++) {
+        if (children.items[i].t == CHILD_TOKEN) {
+            settle_tok(&children.items[i].token, shift, text);
+        }
+    }
+    switch (node->kind) {
+        case NODE_VAR_DECL:
+            settle_tok(&((VarDecl *)node)->assign_token, shift, text);
+            break;
+        case NODE_BINDING:
+            settle_tok(&((Binding *)node)->qualifier, shift, text);
+            break;
+        case NODE_TYPED_BINDING:
+            settle_tok(&((TypedBinding *)node)->qualifier, shift, text);
+            break;
+        case NODE_FN_MOD:
+            settle_tok(&((FnMod *)node)->mod, shift, text);
+            break;
+        case NODE_STRUCT_FIELD:
+            settle_tok(&((StructField *)node)->assign_token, shift, text);
+            break;
+        case NODE_CASE_PATT: {
+            CasePatt *patt = (CasePatt *)node;
+            if (patt->t == CASE_PATT_DEFAULT) {
+                settle_tok(&patt->default_, shift, text);
+            }
+            break;
+        }
+        case NODE_UNION_REDUCE_COND:
+            settle_tok(&((UnionReduceCond *)node)->assign_token, shift, text);
+            break;
+        case NODE_COMP_STMT: {
+            CompStmt *comp_stmt = (CompStmt *)node;
+            if (comp_stmt->end != 0) {
+                comp_stmt->end += shift;
+            }
+            if (comp_stmt->deferred_end != 0) {
+                comp_stmt->deferred_end += shift;
+            }
+            break;
+        }
+        case NODE_ASSIGN_OR_EXPR:
+            settle_tok(&((AssignOrExpr *)node)->assign_token, shift, text);
+            break;
+        case NODE_BUILTIN_TYPE:
+            settle_tok(&((BuiltinType *)node)->token, shift, text);
+            break;
+        case NODE_PTR_TYPE: {
+            PtrType *ptr_type = (PtrType *)node;
+            if (ptr_type->ro.ok) {
+                settle_tok(&ptr_type->ro.value, shift, text);
+            }
+            break;
+        }
+        case NODE_IDENT:
+            settle_tok(&((Ident *)node)->token, shift, text);
+            break;
+        case NODE_ATOM: {
+            // `token` and `builtin_type` share the same spot
+            Atom *atom = (Atom *)node;
+            if (atom->t != ATOM_SCOPED_IDENT) {
+                settle_tok(&atom->token, shift, text);
+            }
+            break;
+        }
+        case NODE_CALL_ARG:
+            settle_tok(&((CallArg *)node)->assign_token, shift, text);
+            break;
+        case NODE_POSTFIX_EXPR:
+            settle_tok(&((PostfixExpr *)node)->op, shift, text);
+            break;
+        case NODE_UNARY_EXPR:
+            settle_tok(&((UnaryExpr *)node)->op, shift, text);
+            break;
+        case NODE_BIN_EXPR:
+            settle_tok(&((BinExpr *)node)->op, shift, text);
+            break;
+        default:
+            break;
+    }
+}
+
+static void settle(Ast *ast, AstNode *node, s32 shift) {
+    settle_fields(ast, node, shift, ast->source->text);
+    Children children = ast_node_children(ast, node);
+    for (size_t i = 0; i < children.len; i++) {
+        Child child = children.items[i];
+        if (child.t != CHILD_NODE) {
+            continue;
+        }
+        if (child.node->unsettled) {
+            // Settled when we get to it
+            ast_node_shift(ast, child.node, shift);
+        } else {
+            settle(ast, child.node, shift);
+        }
+    }
+}
+
+static void settle_shallow(Ast *ast, AstNode *node) {
+    s32 shift = own_shift(ast, node);
+    node->unsettled = false;
+    settle_fields(ast, node, shift, ast->source->text);
+    Children children = ast_node_children(ast, node);
+    for (size_t i = 0; i < children.len; i++) {
+        if (children.items[i].t == CHILD_NODE) {
+            ast_node_shift(ast, children.items[i].node, shift);
+        }
+    }
+}
+
+// Pushes the shifts pending on the ancestors of `node` down to it
+static void settle_ancestors(Ast *ast, AstNode *node) {
+    AstNode *parent = ast_node_parent(ast, node);
+    if (parent == NULL) {
+        return;
+    }
+    settle_ancestors(ast, parent);
+    if (parent->unsettled) {
+        settle_shallow(ast, parent);
+    }
+}
+
+void ast_node_settle(Ast *ast, AstNode *node) {
+    settle_ancestors(ast, node);
+    if (!node->unsettled) {
+        return;
+    }
+    s32 shift = own_shift(ast, node);
+    node->unsettled = false;
+    settle(ast, node, shift);
+}
+
+void ast_node_settle_shallow(Ast *ast, AstNode *node) {
+    settle_ancestors(ast, node);
+    settle_shallow(ast, node);
+}
+
+bool ast_is_deferred(AstNode *n) {
+    return n->kind == NODE_COMP_STMT && ((CompStmt *)n)->deferred_end != 0;
+}
+
+void ast_materialize(Ast *ast, CompStmt *body) {
+    if (body->deferred_end == 0) {
+        return;
+    }
+    assert(ast->parse_deferred != NULL);
+    // Its offsets could be out of date after a reparse
+    ast_node_settle(ast, &body->head);
+    ast->parse_deferred(ast->source, ast, body);
+    assert(body->deferred_end == 0);
 }
 
 void ast_resolves_to_set(Ast *ast, Ident *ident, AstNode *to) {
-    resolves_to_map_put(&ast->tree_data.resolves_to, ident, to);
+    TreeData *td = &ast->tree_data;
+    td->resolves_to =
+        node_table_reserve(ast, td->resolves_to, &td->resolves_to_capacity,
+                           &ident->head, sizeof(*td->resolves_to));
+    td->resolves_to[ident->head.id] = to;
 }
 
 AstNode *ast_resolves_to_get(Ast *ast, Ident *ident) {
-    AstNode **res = resolves_to_map_get(ast->tree_data.resolves_to, ident);
-    return res ? *res : NULL;
+    if (ident == NULL ||
+        ident->head.id >= ast->tree_data.resolves_to_capacity) {
+        return NULL;
+    }
+    return ast->tree_data.resolves_to[ident->head.id];
 }
 
 AstNode *ast_resolves_to_get_scoped(Ast *ast, ScopedIdent *scoped_ident) {
     Ident *last_ident = child_ident_at(
-        &scoped_ident->head, da_length(scoped_ident->head.children) - 1);
+        ast, &scoped_ident->head,
+        ast_node_children(ast, &scoped_ident->head).len - 1);
     return ast_resolves_to_get(ast, last_ident);
 }
 
@@ -295,6 +796,7 @@ void ast_type_set(Ast *ast, AstNode *n, TypeId tid) {
         case NODE_UNARY_EXPR:
         case NODE_BIN_EXPR:
         case NODE_VAR_DECL:
+        case NODE_FN_PARAM:
         case NODE_TYPE_DECL:
         case NODE_STRUCT_TYPE:
         case NODE_ENUM_TYPE:
@@ -310,12 +812,17 @@ void ast_type_set(Ast *ast, AstNode *n, TypeId tid) {
                    "can only set type on concrete expression, declaration or "
                    "type");
     }
-    type_map_put(&ast->tree_data.type, n, tid);
+    TreeData *td = &ast->tree_data;
+    td->type = node_table_reserve(ast, td->type, &td->type_capacity, n,
+                                  sizeof(*td->type));
+    td->type[n->id] = tid;
 }
 
 TypeId ast_type_get(Ast *ast, AstNode *n) {
-    TypeId *res = type_map_get(ast->tree_data.type, n);
-    return res ? *res : INVALID_TYPE;
+    if (n == NULL || n->id >= ast->tree_data.type_capacity) {
+        return INVALID_TYPE;
+    }
+    return ast->tree_data.type[n->id];
 }
 
 TypeRepr *ast_type_repr(Ast *ast, TypeId id) {
@@ -106,15 +106,55 @@ typedef struct {
     NULLABLE_PTR(const char) name;
 } Child;
 
+// Parent of the root, or of a node not linked into the tree yet
+#define NO_NODE UINT32_MAX
+
+// Kept small as there is one per node, anything that isn't needed by every
+// node lives in tables in Ast indexed by `id` (see ast_node_children and
+// ast_node_parent)
 typedef struct AstNode {
-    NodeKind kind;
-    Child *children;
-    NULLABLE_PTR(struct AstNode) parent;
-    size_t offset;
-    bool has_error;
+    u8 kind;  // NodeKind
+    bool has_error : 1;
+    // Set on list elements (see parse_list_element) that parsed without
+    // errors and outside of panic mode, so reparsing them in the same spot
+    // gives back the same subtree
+    bool reusable : 1;
+    // The offsets and tokens in this subtree are out of date, see
+    // ast_node_settle
+    bool unsettled : 1;
+    // No longer in the tree, see ast_subtree_detach
+    bool detached : 1;
+    u32 offset;
+    u32 parent;  // Id of the parent or NO_NODE
+    // Dense, handed out in ast_node_create. Side tables in Ast and TreeData
+    // are indexed by it.
+    u32 id;
 } AstNode;
 
-DA_DEFINE(children, Child)
+_Static_assert(NODE_KIND_COUNT <= UINT8_MAX, "NodeKind must fit in a u8");
+
+// Children of a node that is still being built
+typedef struct {
+    Child *items;
+    u32 len;
+    u32 cap;
+} ChildList;
+
+// A node's children once it is done, `start` is an index into
+// Ast.child_pool. While the node is open `len` is OPEN_CHILDREN and `start`
+// is its slot in Ast.open_lists instead.
+typedef struct {
+    u32 start;
+    u32 len;
+} ChildRange;
+
+#define OPEN_CHILDREN UINT32_MAX
+
+// Only valid until the next child is added to any node
+typedef struct {
+    Child *items;
+    u32 len;
+} Children;
 
 struct SourceFile {
     AstNode head;
@@ -356,6 +396,12 @@ struct DeferStmt {
 
 struct CompStmt {
     AstNode head;
+    // Just past the closing brace, zero if there wasn't one
+    u32 end;
+    // Non-zero when the parser skipped over the body (see
+    // ParseCtx.lazy_bodies), it spans from `head.offset` up to here and is
+    // parsed by ast_materialize
+    u32 deferred_end;
 };
 
 struct AssignOrExpr {
@@ -581,6 +627,8 @@ EACH_NODE(TYPEDEF_NODE)
 
 EACH_NODE(CHECK_NODE)
 
+_Static_assert(sizeof(AstNode) == 16, "AstNode header grew");
+
 struct Scope;
 
 typedef struct ScopeEntry {
@@ -689,17 +737,19 @@ typedef struct TypeRepr {
 
 typedef struct {
     Arena *arena;
+    // Indexed by node id, each allocated on its first set and grown to fit
+    // every node created by then. Nodes past the capacity have nothing set.
     Scope **scope;
+    u32 scope_capacity;
     AstNode **resolves_to;
+    u32 resolves_to_capacity;
     TypeId *type;
+    u32 type_capacity;
     TypeId *builtin_type;
     Type **type_source;
     TypeRepr *type_data;
 } TreeData;
 
-MAP_DEFINE(scope_map, AstNode *, Scope *)
-MAP_DEFINE(resolves_to_map, Ident *, AstNode *)
-MAP_DEFINE(type_map, AstNode *, TypeId)
 MAP_DEFINE(builtin_type_map, TokKind, TypeId)
 MAP_DEFINE(type_source, TypeId, Type *)
 DA_DEFINE(type_data, TypeRepr)
@@ -707,27 +757,133 @@ DA_DEFINE(type_data, TypeRepr)
 TreeData tree_data_create(Arena *a);
 void tree_data_delete(TreeData td);
 
-#define FWD_DECL_CHILD_ACCESS(NODE, _UPPER_NAME, lower_name) \
-    NODE *child_##lower_name##_at(AstNode *n, size_t index);
-
-EACH_NODE(FWD_DECL_CHILD_ACCESS)
-
 Child child_token_create(Tok tok);
 Child child_token_named_create(const char *name, Tok tok);
 Child child_node_create(AstNode *n);
 Child child_node_named_create(const char *name, AstNode *n);
 
 const char *node_kind_to_string(NodeKind kind);
+// sizeof the struct for nodes of `kind`, head included
+usize node_kind_size(NodeKind kind);
+
+typedef struct {
+    u32 *items;
+    u32 len;
+    u32 cap;
+} NodeIds;
 
 typedef struct {
+    AstNode *node;
+    u32 next;     // Index of the child to look at next
+    u32 entered;  // Visitors that entered `node`, they get its exit
+    u32 descend;  // Visitors that go on to the children
+} DfsFrame;
+
+typedef struct Ast {
     Arena *arena;
     AstNode *root;
+    // Ids handed out so far
+    u32 node_count;
+    u32 node_capacity;
+    // Indexed by node id
+    AstNode **nodes;
+    ChildRange *child_ranges;
+    // Ids of the nodes of each kind, see ast_nodes_of_kind
+    NodeIds by_kind[NODE_KIND_COUNT];
+    // Number of detached nodes still in each of `by_kind`
+    u32 stale[NODE_KIND_COUNT];
+    // Garbage that is never given back (see reparse_source_file): nodes
+    // detached so far, and children left in `child_pool` when a node's
+    // children were replaced
+    u32 detached_count;
+    u32 dropped_children;
+    // The children of every closed node (see ast_node_close), each node's
+    // one after the other
+    ChildList child_pool;
+    // Children of the open nodes, slots on `free_lists` can be reused
+    struct {
+        ChildList *items;
+        u32 len;
+        u32 cap;
+    } open_lists;
+    struct {
+        u32 *items;
+        u32 len;
+        u32 cap;
+    } free_lists;
+    // Kept between traversals so they don't allocate, see ast_traverse_dfs
+    struct {
+        DfsFrame *items;
+        u32 len;
+        u32 cap;
+    } dfs_stack;
     TreeData tree_data;
+    // Set by the parser when it defers function bodies
+    void (*parse_deferred)(SourceCode *code, struct Ast *ast, CompStmt *body);
+    // The expression nesting limit it parses with, the one the tree was
+    // parsed with
+    u32 deferred_max_expr_depth;
+    // What the tree was last parsed from
+    SourceCode *source;
+    // Shifts not yet applied to the unsettled nodes
+    s32 *pending_shifts;
 } Ast;
 
+MAP_DEFINE(shift_map, AstNode *, s32)
+
+static inline Children ast_node_children(const Ast *ast, const AstNode *n) {
+    ChildRange range = ast->child_ranges[n->id];
+    if (range.len == OPEN_CHILDREN) {
+        ChildList *list = &ast->open_lists.items[range.start];
+        return (Children){list->items, list->len};
+    }
+    if (range.len == 0) {
+        return (Children){NULL, 0};
+    }
+    return (Children){ast->child_pool.items + range.start, range.len};
+}
+
+static inline AstNode *ast_node_parent(const Ast *ast, const AstNode *n) {
+    return n->parent != NO_NODE ? ast->nodes[n->parent] : NULL;
+}
+
+static inline void ast_node_parent_set(AstNode *n, AstNode *parent) {
+    n->parent = parent != NULL ? parent->id : NO_NODE;
+}
+
+// Ids of every node of `kind` in the tree, in the order they were handed out
+// (that is the order the nodes were created in, apart from subtrees adopted
+// from another Ast which get theirs in tree order). For passes that only care
+// about a few kinds and not where in the tree they are. Detached nodes are
+// dropped from the list here, so it is only valid until the tree changes.
+NodeIds ast_nodes_of_kind(Ast *ast, NodeKind kind);
+
+// `index` is into the list from ast_nodes_of_kind
+static inline AstNode *ast_node_of_kind_at(const Ast *ast, NodeKind kind,
+                                           u32 index) {
+    return ast->nodes[ast->by_kind[kind].items[index]];
+}
+
+#define FWD_DECL_CHILD_ACCESS(NODE, _UPPER_NAME, lower_name) \
+    NODE *child_##lower_name##_at(Ast *ast, AstNode *n, size_t index);
+
+EACH_NODE(FWD_DECL_CHILD_ACCESS)
+
 Ast ast_create(Arena *a);
 void ast_delete(Ast ast);
-
+// Moves `node` and everything under it over from `from`, giving them new ids
+// in `ast` (e.g. for nodes created by the parser threads)
+void ast_subtree_adopt(Ast *ast, Ast *from, AstNode *node);
+// Forgets the nodes with ids from `count` on so the ids get handed out again,
+// for when nothing points to those nodes anymore
+void ast_node_ids_truncate(Ast *ast, u32 count);
+// Marks `node` and everything under it as no longer in the tree (e.g. when
+// a reparse replaces it). The ids stay taken, but the nodes are left out of
+// ast_nodes_of_kind.
+void ast_subtree_detach(Ast *ast, AstNode *node);
+
+// The getters read a NULL node (e.g. a function body missing after a syntax
+// error) as unset
 void ast_scope_set(Ast *ast, AstNode *n, Scope *scope);
 Scope *ast_scope_get(Ast *ast, AstNode *n);
 
@@ -745,9 +901,33 @@ void ast_scope_insert(Ast *ast, Scope *s, string name, AstNode *n,
                       Scope *sub_scope);
 
 AstNode *ast_node_create(Ast *ast, NodeKind kind);
-void ast_node_child_add(AstNode *node, Child child);
-
-void ast_node_reparent(AstNode *child, AstNode *new_parent);
+// Adding to a closed node opens it again, its children are copied out of the
+// pool
+void ast_node_child_add(Ast *ast, AstNode *node, Child child);
+// Moves the children of `node` into the pool once it is done
+void ast_node_close(Ast *ast, AstNode *node);
+// Replaces the children of `node`, leaving it closed
+void ast_node_children_set(Ast *ast, AstNode *node, const Child *items,
+                           u32 len);
+
+void ast_node_reparent(Ast *ast, AstNode *child, AstNode *new_parent);
+
+// Reparsing (see syn/reparse.c) keeps subtrees from the previous parse
+// without going over them, they still have the offsets and token text of the
+// previous source. They are marked unsettled with the amount their offsets
+// are off by and get fixed up against `ast->source` when next walked, by
+// ast_traverse_dfs and dump_tree. Nested unsettled subtrees add up.
+void ast_node_shift(Ast *ast, AstNode *node, s32 delta);
+// Sum of the shifts pending on `node` and its ancestors
+s32 ast_node_pending_shift(Ast *ast, AstNode *node);
+void ast_node_settle(Ast *ast, AstNode *node);
+// Only settles `node` itself, its children are marked unsettled instead
+void ast_node_settle_shallow(Ast *ast, AstNode *node);
+
+bool ast_is_deferred(AstNode *n);
+// Parses a deferred function body in place, does nothing if `body` was
+// already parsed
+void ast_materialize(Ast *ast, CompStmt *body);
 
 typedef enum {
     LOOKUP_MODE_LEXICAL,
@@ -767,11 +947,40 @@ typedef enum {
 } DfsCtrl;
 
 typedef struct {
+    const char *name;  // Used to label the traversal when tracing
     DfsCtrl (*enter)(void *ctx, AstNode *node);
     DfsCtrl (*exit)(void *ctx, AstNode *node);
 } EnterExitVTable;
 
+// Calls `enter` on each node on the way down and `exit` on the way back up,
+// both are left out for nodes with errors. The children of a node aren't
+// visited if `enter` returns DFS_CTRL_SKIP_SUBTREE, `exit` is still called.
+// Done with an explicit stack, so deep trees don't use up the C stack.
 void ast_traverse_dfs(void *ctx, Ast *ast, EnterExitVTable vtable);
+// Same but only walks the subtree under `node`
+void ast_traverse_dfs_from(void *ctx, Ast *ast, AstNode *node,
+                           EnterExitVTable vtable);
+
+// A pass taking part in a fused traversal. `after` has a bit set for each
+// visitor earlier in the list (by index) that has to be done with the whole
+// tree before this one enters the root. That is the only ordering it can
+// express: there is no way to say a visitor only needs some nodes (say the
+// declarations) done by another, it waits for the whole walk or for
+// nothing beyond the order at each node.
+typedef struct {
+    void *ctx;
+    EnterExitVTable vtable;
+    u32 after;
+} AstVisitor;
+
+#define AST_VISITORS_MAX 32
+
+// Runs the visitors together, in as few walks of the tree as `after` allows.
+// Visitors sharing a walk are called in list order at each node, on enter
+// and on exit, so an earlier visitor is always done with a node before a
+// later one sees it. A visitor returning DFS_CTRL_SKIP_SUBTREE only skips
+// the subtree for itself, the children are still walked for the others.
+void ast_traverse_fused(Ast *ast, const AstVisitor *visitors, u32 len);
 
 typedef struct {
     FILE *fs;
@@ -784,7 +993,88 @@ void dump_tree(TreeDumpCtx *ctx, AstNode *n);
 void dump_symbols(Ast *ast, const SourceCode *code);
 void dump_types(Ast *ast);
 
-void fmt_type(char *buf, size_t size, Ast *ast, TypeRepr repr);
+// Binary images of a tree (see ast/image.c), for keeping a parse around on
+// disk. An image is only read by the same build that wrote it.
+
+#define AST_IMAGE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    u32 version;
+    // Hash of the node struct sizes, see layout_fingerprint
+    u32 layout;
+    u32 node_count;
+    u32 child_count;
+    // Length of the source text the tree was parsed from
+    u32 text_len;
+    u32 pad;
+    // Sections, as offsets from the start of the image
+    u64 nodes_at;
+    u64 children_at;
+    u64 payload_at;
+    u64 payload_len;
+    u64 names_at;
+    u64 names_len;
+    u64 len;
+} AstImageHeader;
+
+// Nodes and tokens refer to each other by index in the image, and to the
+// source by offset
+typedef struct {
+    u8 kind;
+    bool has_error;
+    bool reusable;
+    u8 pad;
+    u32 offset;
+    u32 parent;  // NO_NODE for the root
+    u32 first_child;
+    u32 child_count;
+    u32 payload;
+} AstImageNode;
+
+typedef struct {
+    u32 t;
+    u32 offset;
+    u32 len;
+    u32 has_text;
+    u64 value;
+} AstImageTok;
+
+typedef struct {
+    u32 t;
+    u32 name;  // Offset of the name plus one, zero if it has none
+    union {
+        u32 node;
+        AstImageTok token;
+    };
+} AstImageChild;
+
+// A checked view of an image, pointing into it
+typedef struct {
+    const AstImageHeader *header;
+    const AstImageNode *nodes;
+    const AstImageChild *children;
+    const u8 *payload;
+    const char *names;
+    u64 mapped_len;  // Non-zero if mapped by ast_image_map
+} AstImage;
+
+// Writes out `root` and everything under it. Token text has to point into
+// `ast->source`.
+bool ast_image_write(Ast *ast, AstNode *root, FILE *fs);
+// False if `data` isn't an image this build can read, `data` has to be 8
+// byte aligned and outlive `img`
+bool ast_image_open(AstImage *img, const void *data, u64 len);
+bool ast_image_map(AstImage *img, const char *path);
+void ast_image_unmap(AstImage *img);
+// Creates the nodes in `img` in `ast`, with token text pointing into
+// `source`. Returns the root, or NULL if the image doesn't fit `source` or is
+// corrupt. TreeData isn't part of an image, semantic analysis runs again.
+AstNode *ast_image_load(Ast *ast, const AstImage *img, SourceCode *source);
+
+// Same semantics as snprintf: writes at most `size` bytes (including the NUL)
+// and returns the length of the full type string.
+size_t fmt_type(char *buf, size_t size, Ast *ast, TypeRepr repr);
 
 #define NODE_GENERIC_CASE(NodeT, UPPER_NAME, _) NodeT * : NODE_##UPPER_NAME,
 
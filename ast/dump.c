@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "ast.h"
 
@@ -11,7 +13,10 @@ static void deindent(TreeDumpCtx *ctx) {
 }
 
 void dump_tree(TreeDumpCtx *ctx, AstNode *n) {
-    Child *children = n->children;
+    if (n->unsettled) {
+        ast_node_settle(ctx->ast, n);
+    }
+    Children children = ast_node_children(ctx->ast, n);
 
     if (n->has_error) {
         fprintf(ctx->fs, "%*s%s(error!) {",
@@ -21,12 +26,12 @@ void dump_tree(TreeDumpCtx *ctx, AstNode *n) {
         fprintf(ctx->fs, "%*s%s {", ctx->indent_level * ctx->indent_width, "",
                 node_kind_to_string(n->kind));
     }
-    if (da_length(children) != 0) {
+    if (children.len != 0) {
         fprintf(ctx->fs, "\n");
     }
 
-    for (u32 i = 0; i < da_length(children); i++) {
-        Child child = children[i];
+    for (u32 i = 0; i < children.len; i++) {
+        Child child = children.items[i];
         indent(ctx);
         switch (child.t) {
             case CHILD_NODE:
@@ -54,23 +59,23 @@ void dump_tree(TreeDumpCtx *ctx, AstNode *n) {
         deindent(ctx);
     }
 
-    if (da_length(children) != 0) {
+    if (children.len != 0) {
         fprintf(ctx->fs, "%*s", ctx->indent_level * ctx->indent_width, "");
     }
     fprintf(ctx->fs, "}\n");
 }
 
 void dump_symbols(Ast *ast, const SourceCode *code) {
-    MapCursor it = map_cursor_create(ast->tree_data.scope);
-    while (map_cursor_next(&it)) {
-        Scope **item = it.current;
-        // NodeID id = *(NodeID *)map_key_of(m->scope_allocs, item);
-        AstNode *self = (*item)->self;
+    for (u32 id = 0; id < ast->tree_data.scope_capacity; id++) {
+        Scope *scope = ast->tree_data.scope[id];
+        if (scope == NULL) {
+            continue;
+        }
+        AstNode *self = scope->self;
 
         printf("scope: [node_ptr = %p]\n", (void *)self);
         printf("  node_type: <%s>\n", node_kind_to_string(self->kind));
 
-        Scope *scope = *item;
         Scope *enclosing_scope = scope->enclosing_scope.ptr;
         if (enclosing_scope) {
             printf("  enclosing_scope: [node_ptr = %p]\n",
@@ -112,114 +117,119 @@ void dump_symbols(Ast *ast, const SourceCode *code) {
     }
 }
 
-#define FMT_IN(fmt, ...)                             \
-    do {                                             \
-        len = snprintf(buf, size, fmt, __VA_ARGS__); \
-        buf += len;                                  \
-        size -= len;                                 \
-    } while (0);
-
-#define PRINT_IN(fmt)                   \
-    do {                                \
-        len = snprintf(buf, size, fmt); \
-        buf += len;                     \
-        size -= len;                    \
-    } while (0);
-
-void fmt_type(char *buf, size_t size, Ast *ast, TypeRepr repr) {
-    int len = 0;
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+} TypeFmt;
+
+static void type_fmt_printf(TypeFmt *f, const char *fmt, ...)
+    PRINTF_CHECK(2, 3);
+
+static void type_fmt_printf(TypeFmt *f, const char *fmt, ...) {
+    // Keep counting once the buffer is full so the caller knows how much
+    // space the whole type needs
+    size_t avail = f->len < f->size ? f->size - f->len : 0;
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(avail ? &f->buf[f->len] : NULL, avail, fmt, args);
+    va_end(args);
+    assert(len >= 0);
+    f->len += len;
+}
+
+static void fmt_type_in(TypeFmt *f, Ast *ast, TypeRepr repr) {
     switch (repr.t) {
         case STORAGE_U8:
-            PRINT_IN("u8");
+            type_fmt_printf(f, "u8");
             break;
         case STORAGE_S8:
-            PRINT_IN("s8");
+            type_fmt_printf(f, "s8");
             break;
         case STORAGE_U16:
-            PRINT_IN("u16");
+            type_fmt_printf(f, "u16");
             break;
         case STORAGE_S16:
-            PRINT_IN("s16");
+            type_fmt_printf(f, "s16");
             break;
         case STORAGE_U32:
-            PRINT_IN("u16");
+            type_fmt_printf(f, "u32");
             break;
         case STORAGE_S32:
-            PRINT_IN("s16");
+            type_fmt_printf(f, "s32");
             break;
         case STORAGE_U64:
-            PRINT_IN("u16");
+            type_fmt_printf(f, "u64");
             break;
         case STORAGE_S64:
-            PRINT_IN("s16");
+            type_fmt_printf(f, "s64");
             break;
         case STORAGE_F32:
-            PRINT_IN("f32");
+            type_fmt_printf(f, "f32");
             break;
         case STORAGE_F64:
-            PRINT_IN("f64");
+            type_fmt_printf(f, "f64");
             break;
         case STORAGE_UNIT:
-            PRINT_IN("unit");
+            type_fmt_printf(f, "unit");
             break;
         case STORAGE_STRING:
-            PRINT_IN("string");
+            type_fmt_printf(f, "string");
             break;
         case STORAGE_PTR:
-            PRINT_IN("*");
-            fmt_type(buf, size, ast,
-                     *ast_type_repr(ast, repr.ptr_type.points_to));
+            type_fmt_printf(f, "*");
+            fmt_type_in(f, ast, *ast_type_repr(ast, repr.ptr_type.points_to));
             break;
         case STORAGE_TUPLE:
-            PRINT_IN("(");
+            type_fmt_printf(f, "(");
             for (size_t i = 0; i < da_length(repr.tuple_type.types); i++) {
-                fmt_type(buf, size, ast,
-                         *ast_type_repr(ast, repr.tuple_type.types[i]));
-                PRINT_IN(",");
+                fmt_type_in(f, ast,
+                            *ast_type_repr(ast, repr.tuple_type.types[i]));
+                type_fmt_printf(f, ",");
             }
-            PRINT_IN(")");
+            type_fmt_printf(f, ")");
             break;
         case STORAGE_STRUCT:
-            PRINT_IN("struct {");
+            type_fmt_printf(f, "struct {");
             for (size_t i = 0; i < da_length(repr.struct_type.fields); i++) {
                 if (i != 0) {
-                    PRINT_IN(" ");
+                    type_fmt_printf(f, " ");
                 }
-                TypeField f = repr.struct_type.fields[i];
-                FMT_IN("%.*s: ", SPLAT(f.name));
-                fmt_type(buf, size, ast, *ast_type_repr(ast, f.type));
-                PRINT_IN(",");
+                TypeField field = repr.struct_type.fields[i];
+                type_fmt_printf(f, "%.*s: ", SPLAT(field.name));
+                fmt_type_in(f, ast, *ast_type_repr(ast, field.type));
+                type_fmt_printf(f, ",");
             }
-            PRINT_IN("}");
+            type_fmt_printf(f, "}");
             break;
         case STORAGE_TAGGED_UNION:
-            PRINT_IN("(");
+            type_fmt_printf(f, "(");
             for (size_t i = 0; i < da_length(repr.tagged_union_type.types);
                  i++) {
-                fmt_type(buf, size, ast,
-                         *ast_type_repr(ast, repr.tagged_union_type.types[i]));
-                PRINT_IN("|");
+                TypeId alt = repr.tagged_union_type.types[i];
+                fmt_type_in(f, ast, *ast_type_repr(ast, alt));
+                type_fmt_printf(f, "|");
             }
-            PRINT_IN(")");
+            type_fmt_printf(f, ")");
             break;
         case STORAGE_ENUM:
-            PRINT_IN("enum { ");
+            type_fmt_printf(f, "enum { ");
             for (size_t i = 0; i < da_length(repr.enum_type.alts); i++) {
                 if (i != 0) {
-                    PRINT_IN(", ");
+                    type_fmt_printf(f, ", ");
                 }
                 string alt = repr.enum_type.alts[i];
-                FMT_IN("%.*s", SPLAT(alt));
+                type_fmt_printf(f, "%.*s", SPLAT(alt));
             }
-            PRINT_IN(" }");
+            type_fmt_printf(f, " }");
             break;
         case STORAGE_ALIAS: {
             string name = repr.alias_type.type_decl->name->token.text;
-            FMT_IN("%.*s", SPLAT(name));
+            type_fmt_printf(f, "%.*s", SPLAT(name));
             break;
         }
         case STORAGE_BOOL: {
-            PRINT_IN("bool");
+            type_fmt_printf(f, "bool");
             break;
         }
         case STORAGE_FN:
@@ -228,12 +238,23 @@ void fmt_type(char *buf, size_t size, Ast *ast, TypeRepr repr) {
     }
 }
 
-#define FMT_BUF_SZ 4096
+
+size_t fmt_type(char *buf, size_t size, Ast *ast, TypeRepr repr) {
+    TypeFmt f = {.buf = buf, .size = size, .len = 0};
+    if (size != 0) {
+        buf[0] = '\0';
+    }
+    fmt_type_in(&f, ast, repr);
+    return f.len;
+}
 
 static void dump_type(Ast *ast, FILE *fs, TypeRepr repr) {
-    static char buf[FMT_BUF_SZ];
-    fmt_type(buf, FMT_BUF_SZ, ast, repr);
+    size_t len = fmt_type(NULL, 0, ast, repr);
+    char *buf = malloc(len + 1);
+    assert(buf);
+    fmt_type(buf, len + 1, ast, repr);
     fprintf(fs, "%s", buf);
+    free(buf);
 }
 
 void dump_types(Ast *ast) {
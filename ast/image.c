@@ -0,0 +1,695 @@
+// For mmap
+#define _POSIX_C_SOURCE 200809L
+
+// Binary images of a parsed tree.
+//
+// An image holds the nodes reachable from a root in preorder, so a node's
+// index is its position in the walk and the root is always 0. Everything
+// that was a pointer is an index (nodes) or an offset (token text is always
+// the source text at the token's offset), so an image can be mapped in and
+// read as is, only ast_image_load turns it back into pointers.
+//
+// Past the header the image is made up of sections, each 8 byte aligned:
+//
+// * nodes:    AstImageNode per node
+// * children: AstImageChild, each node's one after the other
+// * payload:  the rest of each node struct (the fields past `head`) with
+//             pointers to nodes swapped for index + 1 (0 is NULL) and token
+//             text pointers for 1 if set and 0 if not
+// * names:    the child names, NUL terminated
+//
+// The payload is the node structs as laid out by this build, the header
+// carries a fingerprint of the layout so an image from a build with
+// different structs is turned down instead of misread.
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../common/trace.h"
+#include "ast.h"
+
+static const char image_magic[8] = "IOTAAST";
+
+// Where the pointers to other nodes and the tokens are in a node
+typedef struct {
+    u16 ptrs[6];
+    u16 toks[2];
+    u8 ptrs_len;
+    u8 toks_len;
+} NodeFields;
+
+#define PTR(T, field) fields.ptrs[fields.ptrs_len++] = offsetof(T, field)
+#define TOK(T, field) fields.toks[fields.toks_len++] = offsetof(T, field)
+
+// The unions are a single pointer, apart from the ones holding a token too
+// where the tag says which it is
+static NodeFields node_fields(const AstNode *node) {
+    NodeFields fields = {0};
+    switch ((NodeKind)node->kind) {
+        case NODE_SOURCE_FILE:
+            PTR(SourceFile, imports);
+            PTR(SourceFile, decls);
+            break;
+        case NODE_IMPORT:
+            PTR(Import, module);
+            break;
+        case NODE_DECL:
+            PTR(Decl, var_decl);
+            break;
+        case NODE_VAR_DECL:
+            PTR(VarDecl, binding);
+            TOK(VarDecl, assign_token);
+            PTR(VarDecl, init);
+            break;
+        case NODE_BINDING:
+            TOK(Binding, qualifier);
+            PTR(Binding, name);
+            PTR(Binding, type);
+            break;
+        case NODE_TYPED_BINDING:
+            TOK(TypedBinding, qualifier);
+            PTR(TypedBinding, name);
+            PTR(TypedBinding, type);
+            break;
+        case NODE_FN_DECL:
+            PTR(FnDecl, name);
+            PTR(FnDecl, type_params);
+            PTR(FnDecl, params);
+            PTR(FnDecl, mods);
+            PTR(FnDecl, return_type);
+            PTR(FnDecl, body);
+            break;
+        case NODE_FN_MOD:
+            TOK(FnMod, mod);
+            break;
+        case NODE_FN_PARAM:
+            PTR(FnParam, binding);
+            break;
+        case NODE_TUPLE_TYPE:
+            PTR(TupleType, types);
+            break;
+        case NODE_STRUCT_TYPE:
+            PTR(StructType, fields);
+            break;
+        case NODE_STRUCT_FIELD:
+            PTR(StructField, binding);
+            TOK(StructField, assign_token);
+            PTR(StructField, default_value);
+            break;
+        case NODE_STMT:
+            PTR(Stmt, decl);
+            break;
+        case NODE_IF_STMT:
+            PTR(IfStmt, cond);
+            PTR(IfStmt, true_branch);
+            PTR(IfStmt, else_branch);
+            break;
+        case NODE_WHILE_STMT:
+            PTR(WhileStmt, cond);
+            PTR(WhileStmt, true_branch);
+            break;
+        case NODE_CASE_PATT:
+            if (((CasePatt *)node)->t == CASE_PATT_DEFAULT) {
+                TOK(CasePatt, default_);
+            } else {
+                PTR(CasePatt, expr);
+            }
+            break;
+        case NODE_CASE_BRANCH:
+            PTR(CaseBranch, patt);
+            PTR(CaseBranch, action);
+            break;
+        case NODE_CASE_STMT:
+            PTR(CaseStmt, expr);
+            PTR(CaseStmt, branches);
+            break;
+        case NODE_COND:
+            PTR(Cond, expr);
+            break;
+        case NODE_UNION_REDUCE_COND:
+            PTR(UnionReduceCond, trigger);
+            TOK(UnionReduceCond, assign_token);
+            PTR(UnionReduceCond, expr);
+            break;
+        case NODE_RETURN_STMT:
+            PTR(ReturnStmt, expr);
+            break;
+        case NODE_DEFER_STATEMENT:
+            PTR(DeferStmt, stmt);
+            break;
+        case NODE_ELSE:
+            PTR(Else, if_stmt);
+            break;
+        case NODE_ASSIGN_OR_EXPR:
+            PTR(AssignOrExpr, lvalue);
+            TOK(AssignOrExpr, assign_token);
+            PTR(AssignOrExpr, rvalue);
+            break;
+        case NODE_TYPE_DECL:
+            PTR(TypeDecl, name);
+            PTR(TypeDecl, type);
+            break;
+        case NODE_TYPE:
+            PTR(Type, builtin_type);
+            break;
+        case NODE_BUILTIN_TYPE:
+            TOK(BuiltinType, token);
+            break;
+        case NODE_COLL_TYPE:
+            PTR(CollType, index_expr);
+            PTR(CollType, element_type);
+            break;
+        case NODE_TAGGED_UNION_TYPE:
+            PTR(TaggedUnionType, alts);
+            break;
+        case NODE_UNION_ALT:
+            PTR(UnionAlt, type);
+            break;
+        case NODE_ENUM_TYPE:
+            PTR(EnumType, alts);
+            break;
+        case NODE_ERR_TYPE:
+            PTR(ErrType, type);
+            break;
+        case NODE_PTR_TYPE:
+            if (((PtrType *)node)->ro.ok) {
+                TOK(PtrType, ro.value);
+            }
+            PTR(PtrType, points_to);
+            break;
+        case NODE_FN_TYPE:
+            PTR(FnType, params);
+            PTR(FnType, return_type);
+            break;
+        case NODE_IDENT:
+            TOK(Ident, token);
+            break;
+        case NODE_EXPR:
+            PTR(Expr, atom);
+            break;
+        case NODE_ATOM:
+            if (((Atom *)node)->t == ATOM_SCOPED_IDENT) {
+                PTR(Atom, scoped_ident);
+            } else {
+                TOK(Atom, token);
+            }
+            break;
+        case NODE_CALL:
+            PTR(Call, callable);
+            PTR(Call, args);
+            break;
+        case NODE_CALL_ARG:
+            PTR(CallArg, name);
+            TOK(CallArg, assign_token);
+            PTR(CallArg, value);
+            break;
+        case NODE_POSTFIX_EXPR:
+            PTR(PostfixExpr, sub_expr);
+            TOK(PostfixExpr, op);
+            break;
+        case NODE_FIELD_ACCESS:
+            PTR(FieldAccess, lvalue);
+            PTR(FieldAccess, field);
+            break;
+        case NODE_COLL_ACCESS:
+            PTR(CollAccess, lvalue);
+            PTR(CollAccess, index);
+            break;
+        case NODE_UNARY_EXPR:
+            TOK(UnaryExpr, op);
+            PTR(UnaryExpr, sub_expr);
+            break;
+        case NODE_BIN_EXPR:
+            TOK(BinExpr, op);
+            PTR(BinExpr, left);
+            PTR(BinExpr, right);
+            break;
+        case NODE_INDEX:
+            PTR(Index, start);
+            PTR(Index, end);
+            break;
+        default:
+            // Nothing but scalars, if anything
+            break;
+    }
+    return fields;
+}
+
+#undef PTR
+#undef TOK
+
+static u32 layout_fingerprint(void) {
+    u32 hash = 2166136261u;
+    u32 words[] = {NODE_KIND_COUNT, sizeof(Tok), sizeof(void *)};
+    for (u32 i = 0; i < sizeof(words) / sizeof(*words); i++) {
+        hash = (hash ^ words[i]) * 16777619u;
+    }
+    for (u32 k = 0; k < NODE_KIND_COUNT; k++) {
+        hash = (hash ^ (u32)node_kind_size(k)) * 16777619u;
+    }
+    return hash;
+}
+
+typedef struct {
+    u8 *items;
+    u32 len;
+    u32 cap;
+} ByteBuf;
+
+typedef struct {
+    AstImageNode *items;
+    u32 len;
+    u32 cap;
+} ImageNodes;
+
+typedef struct {
+    AstImageChild *items;
+    u32 len;
+    u32 cap;
+} ImageChildren;
+
+typedef struct {
+    Ast *ast;
+    string text;
+    // Image index of each node by id, UINT32_MAX if it isn't in the image
+    u32 *index_of;
+    // The other way around
+    struct {
+        AstNode **items;
+        u32 len;
+        u32 cap;
+    } order;
+    ImageNodes nodes;
+    ImageChildren children;
+    ByteBuf payload;
+    ByteBuf names;
+} ImageWriter;
+
+static void bytes_append(ByteBuf *buf, const void *data, u32 len) {
+    for (u32 i = 0; i < len; i++) {
+        APPEND(buf, ((const u8 *)data)[i]);
+    }
+}
+
+static void bytes_align(ByteBuf *buf) {
+    while (buf->len % 8 != 0) {
+        APPEND(buf, 0);
+    }
+}
+
+static AstImageTok image_tok(ImageWriter *w, Tok tok) {
+    if (tok.text.data != NULL && tok.t != T_EMPTY_STRING) {
+        assert(tok.text.data == w->text.data + tok.offset &&
+               "token text not from the source");
+    }
+    return (AstImageTok){
+        .t = tok.t,
+        .offset = tok.offset,
+        .len = tok.text.len,
+        .has_text = tok.text.data != NULL,
+        .value = tok.ival,
+    };
+}
+
+// Names are few and always the same string literals, so just search
+static u32 image_name(ImageWriter *w, const char *name) {
+    if (name == NULL) {
+        return 0;
+    }
+    for (u32 at = 0; at < w->names.len;) {
+        const char *it = (const char *)w->names.items + at;
+        if (strcmp(it, name) == 0) {
+            return at + 1;
+        }
+        at += strlen(it) + 1;
+    }
+    u32 at = w->names.len;
+    bytes_append(&w->names, name, strlen(name) + 1);
+    return at + 1;
+}
+
+static void write_payload(ImageWriter *w, AstNode *node) {
+    usize size = node_kind_size(node->kind) - sizeof(AstNode);
+    u32 at = w->payload.len;
+    bytes_append(&w->payload, node + 1, size);
+    bytes_align(&w->payload);
+
+    u8 *payload = w->payload.items + at;
+    NodeFields fields = node_fields(node);
+    for (u32 i = 0; i < fields.ptrs_len; i++) {
+        u32 field = fields.ptrs[i] - sizeof(AstNode);
+        AstNode *to;
+        memcpy(&to, payload + field, sizeof(to));
+        u64 slot = 0;
+        if (to != NULL) {
+            assert(w->index_of[to->id] != UINT32_MAX &&
+                   "field points out of the tree");
+            slot = (u64)w->index_of[to->id] + 1;
+        }
+        memcpy(payload + field, &slot, sizeof(slot));
+    }
+    for (u32 i = 0; i < fields.toks_len; i++) {
+        u32 field = fields.toks[i] - sizeof(AstNode);
+        Tok tok;
+        memcpy(&tok, payload + field, sizeof(tok));
+        (void)image_tok(w, tok);
+        tok.text.data = (char *)(uptr)(tok.text.data != NULL);
+        memcpy(payload + field, &tok, sizeof(tok));
+    }
+    w->nodes.items[w->index_of[node->id]].payload = at;
+}
+
+// The nodes get their index in preorder first, so the payloads can refer
+// to nodes further down
+static void number_nodes(ImageWriter *w, AstNode *root) {
+    // `next` is the index of the parent here
+    u32 base = w->ast->dfs_stack.len;
+    APPEND(&w->ast->dfs_stack, (DfsFrame){.node = root, .next = NO_NODE});
+    while (w->ast->dfs_stack.len != base) {
+        DfsFrame frame = w->ast->dfs_stack.items[--w->ast->dfs_stack.len];
+        AstNode *node = frame.node;
+        u32 index = w->nodes.len;
+        w->index_of[node->id] = index;
+        APPEND(&w->order, node);
+        APPEND(&w->nodes, (AstImageNode){
+                              .kind = node->kind,
+                              .has_error = node->has_error,
+                              .reusable = node->reusable,
+                              .offset = node->offset,
+                              .parent = frame.next,
+                          });
+        // Pushed backwards so they come off in order
+        Children children = ast_node_children(w->ast, node);
+        for (u32 i = children.len; i-- > 0;) {
+            if (children.items[i].t == CHILD_NODE) {
+                APPEND(&w->ast->dfs_stack,
+                       (DfsFrame){.node = children.items[i].node,
+                                  .next = index});
+            }
+        }
+    }
+}
+
+static void write_children(ImageWriter *w, AstNode *node) {
+    AstImageNode *image_node = &w->nodes.items[w->index_of[node->id]];
+    Children children = ast_node_children(w->ast, node);
+    image_node->first_child = w->children.len;
+    image_node->child_count = children.len;
+    for (u32 i = 0; i < children.len; i++) {
+        Child child = children.items[i];
+        AstImageChild out = {
+            .t = child.t,
+            .name = image_name(w, child.name.ptr),
+        };
+        if (child.t == CHILD_NODE) {
+            out.node = w->index_of[child.node->id];
+        } else {
+            out.token = image_tok(w, child.token);
+        }
+        APPEND(&w->children, out);
+    }
+}
+
+static bool write_section(FILE *fs, const void *data, u64 len) {
+    static const u8 zeros[8] = {0};
+    if (len != 0 && fwrite(data, 1, len, fs) != len) {
+        return false;
+    }
+    u64 pad = (8 - len % 8) % 8;
+    return fwrite(zeros, 1, pad, fs) == pad;
+}
+
+static u64 section_len(u64 len) { return (len + 7) / 8 * 8; }
+
+bool ast_image_write(Ast *ast, AstNode *root, FILE *fs) {
+    TRACE_BEGIN("ast_image_write");
+    // Offsets and token text have to be up to date with the source
+    if (ast->pending_shifts != NULL) {
+        ast_traverse_dfs_from(NULL, ast, root, (EnterExitVTable){0});
+    }
+
+    ImageWriter w = {
+        .ast = ast,
+        .text = ast->source->text,
+        .index_of = malloc(sizeof(u32) * (ast->node_count + 1)),
+    };
+    if (w.index_of == NULL) {
+        panic("out of memory");
+    }
+    memset(w.index_of, 0xff, sizeof(u32) * (ast->node_count + 1));
+
+    number_nodes(&w, root);
+    for (u32 i = 0; i < w.order.len; i++) {
+        write_children(&w, w.order.items[i]);
+        write_payload(&w, w.order.items[i]);
+    }
+
+    AstImageHeader header = {
+        .version = AST_IMAGE_VERSION,
+        .layout = layout_fingerprint(),
+        .node_count = w.nodes.len,
+        .child_count = w.children.len,
+        .text_len = w.text.len,
+    };
+    memcpy(header.magic, image_magic, sizeof(header.magic));
+    header.nodes_at = section_len(sizeof(header));
+    header.children_at =
+        header.nodes_at + section_len(sizeof(AstImageNode) * w.nodes.len);
+    header.payload_at = header.children_at +
+                        section_len(sizeof(AstImageChild) * w.children.len);
+    header.payload_len = w.payload.len;
+    header.names_at = header.payload_at + section_len(w.payload.len);
+    header.names_len = w.names.len;
+    header.len = header.names_at + section_len(w.names.len);
+
+    bool ok = write_section(fs, &header, sizeof(header)) &&
+              write_section(fs, w.nodes.items,
+                            sizeof(AstImageNode) * w.nodes.len) &&
+              write_section(fs, w.children.items,
+                            sizeof(AstImageChild) * w.children.len) &&
+              write_section(fs, w.payload.items, w.payload.len) &&
+              write_section(fs, w.names.items, w.names.len);
+
+    free(w.index_of);
+    free(w.order.items);
+    free(w.nodes.items);
+    free(w.children.items);
+    free(w.payload.items);
+    free(w.names.items);
+    TRACE_END("ast_image_write");
+    return ok;
+}
+
+static bool section_fits(const AstImageHeader *h, u64 at, u64 len) {
+    return at % 8 == 0 && at <= h->len && len <= h->len - at;
+}
+
+bool ast_image_open(AstImage *img, const void *data, u64 len) {
+    const AstImageHeader *h = data;
+    if (len < sizeof(*h) || (uptr)data % 8 != 0 ||
+        memcmp(h->magic, image_magic, sizeof(h->magic)) != 0 ||
+        h->version != AST_IMAGE_VERSION ||
+        h->layout != layout_fingerprint() || h->len > len) {
+        return false;
+    }
+    if (!section_fits(h, h->nodes_at, sizeof(AstImageNode) * h->node_count) ||
+        !section_fits(h, h->children_at,
+                      sizeof(AstImageChild) * h->child_count) ||
+        !section_fits(h, h->payload_at, h->payload_len) ||
+        !section_fits(h, h->names_at, h->names_len) ||
+        (h->names_len != 0 &&
+         ((const char *)data)[h->names_at + h->names_len - 1] != '\0')) {
+        return false;
+    }
+    const u8 *base = data;
+    *img = (AstImage){
+        .header = h,
+        .nodes = (const AstImageNode *)(base + h->nodes_at),
+        .children = (const AstImageChild *)(base + h->children_at),
+        .payload = base + h->payload_at,
+        .names = (const char *)(base + h->names_at),
+    };
+    return true;
+}
+
+bool ast_image_map(AstImage *img, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size != 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    if (!ast_image_open(img, data, st.st_size)) {
+        munmap(data, st.st_size);
+        return false;
+    }
+    img->mapped_len = st.st_size;
+    return true;
+}
+
+void ast_image_unmap(AstImage *img) {
+    if (img->mapped_len != 0) {
+        munmap((void *)img->header, img->mapped_len);
+    }
+    *img = (AstImage){0};
+}
+
+// Makes sure what load is about to follow stays inside the image
+static bool image_node_ok(const AstImage *img, u32 index, const string text) {
+    const AstImageHeader *h = img->header;
+    const AstImageNode *n = &img->nodes[index];
+    if (n->kind >= NODE_KIND_COUNT || n->offset > text.len ||
+        n->first_child > h->child_count ||
+        n->child_count > h->child_count - n->first_child) {
+        return false;
+    }
+    u64 size = node_kind_size(n->kind) - sizeof(AstNode);
+    return n->payload <= h->payload_len && size <= h->payload_len - n->payload;
+}
+
+// Only ever going down keeps a corrupt image from making a cycle
+static bool is_child_of(const AstImage *img, u32 index, u32 parent) {
+    return index > parent && index < img->header->node_count &&
+           img->nodes[index].parent == parent;
+}
+
+// Points the text of `tok` back into the source
+static bool tok_text_set(Tok *tok, bool has_text, string text) {
+    tok->text.data = NULL;
+    if (tok->offset > text.len || tok->text.len > text.len - tok->offset) {
+        return false;
+    }
+    if (has_text) {
+        tok->text.data =
+            tok->t == T_EMPTY_STRING ? "" : text.data + tok->offset;
+    }
+    return true;
+}
+
+// The tree can outlive the image, so names are copied into the arena, once
+// each
+static const char *load_name(Ast *ast, const AstImage *img,
+                             const char **names, u32 name) {
+    if (names[name] == NULL) {
+        const char *from = img->names + name - 1;
+        usize len = strlen(from) + 1;
+        char *to = arena_alloc(ast->arena, len, 1);
+        memcpy(to, from, len);
+        names[name] = to;
+    }
+    return names[name];
+}
+
+AstNode *ast_image_load(Ast *ast, const AstImage *img, SourceCode *source) {
+    TRACE_BEGIN("ast_image_load");
+    const AstImageHeader *h = img->header;
+    string text = source->text;
+    if (h->text_len != text.len || h->node_count == 0) {
+        TRACE_END("ast_image_load");
+        return NULL;
+    }
+
+    // All nodes are created first so the fields can point forward
+    u32 first = ast->node_count;
+    u32 pool_len = ast->child_pool.len;
+    bool ok = true;
+    for (u32 i = 0; ok && i < h->node_count; i++) {
+        ok = image_node_ok(img, i, text);
+        if (ok) {
+            const AstImageNode *in = &img->nodes[i];
+            AstNode *node = ast_node_create(ast, in->kind);
+            node->has_error = in->has_error;
+            node->reusable = in->reusable;
+            node->offset = in->offset;
+            ok = in->parent == NO_NODE ? i == 0 : in->parent < i;
+            if (ok && in->parent != NO_NODE) {
+                node->parent = first + in->parent;
+            }
+        }
+    }
+
+    ChildList children = {0};
+    const char **names = calloc(h->names_len + 1, sizeof(char *));
+    if (names == NULL) {
+        panic("out of memory");
+    }
+    for (u32 i = 0; ok && i < h->node_count; i++) {
+        const AstImageNode *in = &img->nodes[i];
+        AstNode *node = ast->nodes[first + i];
+
+        children.len = 0;
+        for (u32 c = 0; ok && c < in->child_count; c++) {
+            AstImageChild child = img->children[in->first_child + c];
+            Child out = {.t = child.t};
+            if (child.name != 0) {
+                ok = child.name <= h->names_len;
+                out.name.ptr = ok ? load_name(ast, img, names, child.name)
+                                  : NULL;
+            }
+            if (child.t == CHILD_NODE) {
+                ok = ok && is_child_of(img, child.node, i);
+                out.node = ok ? ast->nodes[first + child.node] : NULL;
+            } else {
+                out.token = (Tok){
+                    .t = child.token.t,
+                    .text.len = child.token.len,
+                    .offset = child.token.offset,
+                    .ival = child.token.value,
+                };
+                ok = ok && child.t == CHILD_TOKEN &&
+                     tok_text_set(&out.token, child.token.has_text, text);
+            }
+            APPEND(&children, out);
+        }
+        if (ok) {
+            ast_node_children_set(ast, node, children.items, children.len);
+        }
+
+        usize size = node_kind_size(in->kind) - sizeof(AstNode);
+        u8 *payload = (u8 *)(node + 1);
+        memcpy(payload, img->payload + in->payload, size);
+        NodeFields fields = node_fields(node);
+        for (u32 f = 0; ok && f < fields.ptrs_len; f++) {
+            u8 *field = payload + fields.ptrs[f] - sizeof(AstNode);
+            u64 slot;
+            memcpy(&slot, field, sizeof(slot));
+            ok = slot == 0 ||
+                 (slot <= h->node_count && is_child_of(img, slot - 1, i));
+            AstNode *to = ok && slot != 0 ? ast->nodes[first + slot - 1] : NULL;
+            memcpy(field, &to, sizeof(to));
+        }
+        for (u32 f = 0; ok && f < fields.toks_len; f++) {
+            u8 *field = payload + fields.toks[f] - sizeof(AstNode);
+            Tok tok;
+            memcpy(&tok, field, sizeof(tok));
+            ok = tok_text_set(&tok, tok.text.data != NULL, text);
+            memcpy(field, &tok, sizeof(tok));
+        }
+    }
+    free(children.items);
+    free(names);
+
+    if (!ok) {
+        // Half loaded nodes still have slots for pointers, drop their ids
+        // (and children) so nothing finds them. Their memory is left in the
+        // arena.
+        ast_node_ids_truncate(ast, first);
+        ast->child_pool.len = pool_len;
+        TRACE_END("ast_image_load");
+        return NULL;
+    }
+    ast->source = source;
+    TRACE_END("ast_image_load");
+    return ast->nodes[first];
+}
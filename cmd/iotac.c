@@ -1,7 +1,11 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../ast/ast.h"
+#include "../common/prof.h"
+#include "../common/trace.h"
 #include "../sem/sem.h"
 #include "../syn/syn.h"
 
@@ -47,35 +51,229 @@ static string read_file(char *path) {
     return ztos(buf);
 }
 
+#define DEFAULT_MAX_ERRORS 100
+#define DEFAULT_CACHE_SIZE 256
+
+typedef struct {
+    char *path;
+    u32 max_errors;
+    u32 max_line_errors;
+    u32 max_expr_depth;
+    bool time_passes;
+    PhaseReportFormat time_passes_format;
+    char *trace_path;
+    bool perf_counters;
+    u32 jobs;
+    bool lazy_bodies;
+    bool symbols_only;
+    bool syntax_only;
+    char *cache_dir;
+    u32 cache_size;  // MiB
+} Options;
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: iotac [options] <path to file to compile>\n"
+            "\n"
+            "  --max-errors=N       stop after N errors (0 means no limit, "
+            "default %d)\n"
+            "  --max-line-errors=N  keep at most N syntax errors per line "
+            "(0 means no limit, default 0)\n"
+            "  --max-expr-depth=N   reject expressions nested deeper than N "
+            "(0 means no limit, default %d)\n"
+            "  --time-passes[=json] print time and memory used by each "
+            "compiler pass\n"
+            "  --trace=FILE         write a Chrome trace of the compiler "
+            "passes to FILE\n"
+            "  --perf-counters      sample hardware counters for each pass "
+            "(implies --time-passes)\n"
+            "  -j N, --jobs=N       parse top-level declarations on N threads "
+            "(0 means one per CPU)\n"
+            "  --lazy-bodies        only parse function bodies once they "
+            "are needed\n"
+            "  --symbols-only       print the symbol table without checking "
+            "the program\n"
+            "  --syntax-only        only check the syntax, exits with 1 if "
+            "there are errors\n"
+            "  --cache-dir=DIR      reuse the parse of unchanged sources from "
+            "DIR\n"
+            "  --cache-size=N       keep the cache under N MiB (0 means no "
+            "limit, default %d)\n",
+            DEFAULT_MAX_ERRORS, DEFAULT_MAX_EXPR_DEPTH, DEFAULT_CACHE_SIZE);
+}
+
+static bool parse_u32_arg(const char *arg, const char *value, u32 *out) {
+    char *end = NULL;
+    long n = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || n < 0) {
+        fprintf(stderr, "iotac: invalid value for %s\n", arg);
+        return false;
+    }
+    *out = n;
+    return true;
+}
+
+static bool parse_args(int argc, char *argv[], Options *opts) {
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (strncmp(arg, "--max-errors=", 13) == 0) {
+            if (!parse_u32_arg(arg, arg + 13, &opts->max_errors)) {
+                return false;
+            }
+        } else if (strncmp(arg, "--max-line-errors=", 18) == 0) {
+            if (!parse_u32_arg(arg, arg + 18, &opts->max_line_errors)) {
+                return false;
+            }
+        } else if (strncmp(arg, "--max-expr-depth=", 17) == 0) {
+            if (!parse_u32_arg(arg, arg + 17, &opts->max_expr_depth)) {
+                return false;
+            }
+        } else if (strcmp(arg, "--time-passes") == 0) {
+            opts->time_passes = true;
+            opts->time_passes_format = PHASE_REPORT_TABLE;
+        } else if (strcmp(arg, "--time-passes=json") == 0) {
+            opts->time_passes = true;
+            opts->time_passes_format = PHASE_REPORT_JSON;
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            if (!parse_u32_arg(arg, arg + 7, &opts->jobs)) {
+                return false;
+            }
+        } else if (strcmp(arg, "-j") == 0 && i + 1 < argc) {
+            if (!parse_u32_arg(arg, argv[++i], &opts->jobs)) {
+                return false;
+            }
+        } else if (strncmp(arg, "-j", 2) == 0 && arg[2] != '\0') {
+            if (!parse_u32_arg(arg, arg + 2, &opts->jobs)) {
+                return false;
+            }
+        } else if (strcmp(arg, "--lazy-bodies") == 0) {
+            opts->lazy_bodies = true;
+        } else if (strcmp(arg, "--symbols-only") == 0) {
+            opts->symbols_only = true;
+        } else if (strcmp(arg, "--syntax-only") == 0) {
+            opts->syntax_only = true;
+        } else if (strcmp(arg, "--perf-counters") == 0) {
+            opts->perf_counters = true;
+        } else if (strncmp(arg, "--cache-dir=", 12) == 0 &&
+                   arg[12] != '\0') {
+            opts->cache_dir = arg + 12;
+        } else if (strncmp(arg, "--cache-size=", 13) == 0) {
+            if (!parse_u32_arg(arg, arg + 13, &opts->cache_size)) {
+                return false;
+            }
+        } else if (strncmp(arg, "--trace=", 8) == 0 && arg[8] != '\0') {
+            opts->trace_path = arg + 8;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "iotac: unknown option: %s\n", arg);
+            return false;
+        } else if (opts->path == NULL) {
+            opts->path = arg;
+        } else {
+            return false;
+        }
+    }
+    return opts->path != NULL;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "usage: iotac <path to file to compile>\n");
+    Options opts = {
+        .path = NULL,
+        .max_errors = DEFAULT_MAX_ERRORS,
+        .max_line_errors = 0,
+        .max_expr_depth = DEFAULT_MAX_EXPR_DEPTH,
+        .time_passes = false,
+        .trace_path = NULL,
+        .perf_counters = false,
+        .jobs = 1,
+        .lazy_bodies = false,
+        .symbols_only = false,
+        .syntax_only = false,
+        .cache_dir = NULL,
+        .cache_size = DEFAULT_CACHE_SIZE,
+    };
+    if (!parse_args(argc, argv, &opts)) {
+        usage();
         return 2;
     }
 
-    char *path = argv[1];
-    string source = read_file(path);
-
-    SourceCode code = new_source_code(ztos(path), source);
+    if (opts.trace_path != NULL) {
+        trace_start();
+    }
+    TRACE_BEGIN("iotac");
 
     Arena arena = new_arena();
+    PhaseTimer timer = phase_timer_create(&arena);
+
+    PerfCounters perf;
+    if (opts.perf_counters) {
+        const char *why = NULL;
+        if (perf_counters_open(&perf, &why)) {
+            timer.perf = &perf;
+        } else {
+            fprintf(stderr, "iotac: hardware counters unavailable: %s\n",
+                    why);
+        }
+        opts.time_passes = true;
+    }
+
+    phase_begin(&timer, "read");
+    string source = read_file(opts.path);
+    phase_end(&timer);
+
+    SourceCode code = new_source_code(ztos(opts.path), source);
+    code.max_errors = opts.max_errors;
+    code.max_line_errors = opts.max_line_errors;
+
     Ast ast = ast_create(&arena);
     ParseCtx parse_ctx = parse_ctx_create(&ast, &code);
+    parse_ctx.jobs = opts.jobs != 0 ? opts.jobs : parse_default_jobs();
+    parse_ctx.lazy_bodies = opts.lazy_bodies;
+    parse_ctx.syntax_only = opts.syntax_only;
+    parse_ctx.max_expr_depth = opts.max_expr_depth;
 
-    SourceFile *root = parse_source_file(&parse_ctx);
+    phase_begin(&timer, "parse");
+    SourceFile *root;
+    if (opts.cache_dir != NULL) {
+        ParseCache cache =
+            parse_cache_create(opts.cache_dir, (u64)opts.cache_size << 20);
+        root = parse_source_file_cached(&parse_ctx, &cache);
+    } else {
+        root = parse_source_file(&parse_ctx);
+    }
     (void)root;
+    phase_end(&timer);
 
     flush_errors(&code);
 
+    int status = 0;
+    if (opts.syntax_only) {
+        status = code.error_count != 0 ? 1 : 0;
+        goto fini;
+    }
+
+    if (error_budget_exhausted(&code)) {
+        goto fini;
+    }
+
+    phase_begin(&timer, "build_symbol_table");
     do_build_symbol_table(&ast);
-    do_resolve_names(&ast, &code);
+    phase_end(&timer);
 
-    if (code.errors.len != 0) {
-        flush_errors(&code);
+    // With --lazy-bodies the function bodies are still unparsed here, so
+    // this only has the declarations
+    if (opts.symbols_only) {
+        dump_symbols(&ast, &code);
         goto fini;
     }
 
-    do_check_types(&ast, &code);
+    phase_begin(&timer, "resolve_check_types");
+    bool resolved = do_resolve_and_check_types(&ast, &code);
+    phase_end(&timer);
+
+    if (!resolved) {
+        flush_errors(&code);
+        goto fini;
+    }
 
     // TreeDumpCtx dump_ctx = {
     //     .fs = stdout, .indent_level = 0, .indent_width = 2, .ast = &ast};
@@ -87,8 +285,25 @@ int main(int argc, char *argv[]) {
     // dump_types(&ast);
 
 fini:
+    if (opts.time_passes) {
+        phase_timer_report(&timer, stderr, opts.time_passes_format);
+    }
+    phase_timer_free(&timer);
+    if (timer.perf) {
+        perf_counters_close(&perf);
+    }
     ast_delete(ast);
     arena_free(&arena);
     source_code_free(&code);
     free(source.data);
+
+    TRACE_END("iotac");
+    if (opts.trace_path != NULL) {
+        if (!trace_write(opts.trace_path)) {
+            fprintf(stderr, "iotac: failed to write trace: %s\n",
+                    opts.trace_path);
+        }
+        trace_free();
+    }
+    return status;
 }
@@ -43,6 +43,56 @@ u64 atou64(string s) {
     return r;
 }
 
+static inline u64 rotl64(u64 x, u32 r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 fmix64(u64 k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccd;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53;
+    k ^= k >> 33;
+    return k;
+}
+
+void hash_bytes(const void *data, usize len, u64 seed, u64 *out) {
+    const u64 c1 = 0x87c37b91114253d5;
+    const u64 c2 = 0x4cf5ad432745937f;
+    const u8 *p = data;
+    u64 h1 = seed;
+    u64 h2 = seed;
+    usize n = len;
+    for (; n >= 16; p += 16, n -= 16) {
+        u64 k1, k2;
+        memcpy(&k1, p, sizeof(k1));
+        memcpy(&k2, p + 8, sizeof(k2));
+        h1 ^= rotl64(k1 * c1, 31) * c2;
+        h1 = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= rotl64(k2 * c2, 33) * c1;
+        h2 = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+    // The last few bytes, as if padded with zeros
+    u64 tail[2] = {0};
+    memcpy(tail, p, n);
+    if (n > 8) {
+        h2 ^= rotl64(tail[1] * c2, 33) * c1;
+    }
+    if (n != 0) {
+        h1 ^= rotl64(tail[0] * c1, 31) * c2;
+    }
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
 void panic(const char *msg) {
     fprintf(stderr, "panic: %s\n", msg);
     fflush(stderr);
@@ -161,18 +211,111 @@ void arena_own(Arena *a, void *alloc, u32 size) {
                                });
 }
 
-#define SCRATCH_CAP 4196
+usize arena_bytes_used(const Arena *a) {
+    usize used = 0;
+    for (u32 i = 0; i < a->blocks.len; i++) {
+        used += a->blocks.items[i].used;
+    }
+    for (u32 i = 0; i < a->adopted_blocks.len; i++) {
+        used += a->adopted_blocks.items[i].used;
+    }
+    return used;
+}
+
+void *arena_alloc_any(Arena *a, size_t size, uptr align) {
+    if (size + align <= a->block_size) {
+        return arena_alloc(a, size, align);
+    }
+    // malloc'd memory is suitably aligned for anything
+    assert(align <= _Alignof(max_align_t));
+    void *alloc = calloc(size, 1);
+    if (alloc == NULL) {
+        panic("out of memory");
+    }
+    arena_own(a, alloc, size);
+    return alloc;
+}
+
+static void blocks_move(Blocks *dst, Blocks *src) {
+    for (u32 i = 0; i < src->len; i++) {
+        APPEND(dst, src->items[i]);
+    }
+    if (src->items != NULL) {
+        free(src->items);
+    }
+    *src = (Blocks){.cap = 0, .len = 0, .items = NULL};
+}
+
+void arena_adopt(Arena *dst, Arena *src) {
+    blocks_move(&dst->adopted_blocks, &src->blocks);
+    blocks_move(&dst->adopted_blocks, &src->adopted_blocks);
+}
 
 char *allocf(Arena *a, const char *fmt, ...) {
-    static char scratch[SCRATCH_CAP];
     va_list vargs;
     va_start(vargs, fmt);
-    int len = vsnprintf(scratch, SCRATCH_CAP, fmt, vargs);
+    va_list measure;
+    va_copy(measure, vargs);
+    int len = vsnprintf(NULL, 0, fmt, measure);
+    va_end(measure);
+    assert(len >= 0);
+
+    char *buf = arena_alloc_any(a, len + 1, _Alignof(char));
+    vsnprintf(buf, len + 1, fmt, vargs);
     va_end(vargs);
 
+    return buf;
+}
+
+static void strbuf_reserve(StrBuf *b, u32 extra) {
+    if (b->len + extra <= b->cap) {
+        return;
+    }
+    u32 cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra) {
+        cap *= 2;
+    }
+    char *items = realloc(b->items, cap);
+    if (items == NULL) {
+        panic("out of memory");
+    }
+    b->items = items;
+    b->cap = cap;
+}
+
+void strbuf_vprintf(StrBuf *b, const char *fmt, va_list args) {
+    va_list measure;
+    va_copy(measure, args);
+    int len = vsnprintf(NULL, 0, fmt, measure);
+    va_end(measure);
     assert(len >= 0);
-    char *buf = arena_alloc(a, len + 1, _Alignof(char));
-    memcpy(buf, scratch, len + 1);
 
-    return buf;
+    // +1 as vsnprintf always writes the nul terminator
+    strbuf_reserve(b, len + 1);
+    vsnprintf(&b->items[b->len], len + 1, fmt, args);
+    b->len += len;
+}
+
+void strbuf_printf(StrBuf *b, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    strbuf_vprintf(b, fmt, args);
+    va_end(args);
+}
+
+void strbuf_append(StrBuf *b, string s) {
+    strbuf_reserve(b, s.len);
+    memcpy(&b->items[b->len], s.data, s.len);
+    b->len += s.len;
+}
+
+void strbuf_pad(StrBuf *b, char c, u32 n) {
+    strbuf_reserve(b, n);
+    memset(&b->items[b->len], c, n);
+    b->len += n;
+}
+
+void strbuf_free(StrBuf *b) {
+    free(b->items);
+    *b = (StrBuf){0};
 }
@@ -1,6 +1,7 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -48,6 +49,10 @@ string ztos(char *s);
 
 u64 atou64(string s);
 
+// MurmurHash3_x64_128 (with the seed going into both halves), for hashing
+// whole files. The 128 bit hash goes in `out[0]` and `out[1]`.
+void hash_bytes(const void *data, usize len, u64 seed, u64 *out);
+
 #define MIN(a, b) (a) < (b) ? (a) : (b)
 #define MAX(a, b) (a) > (b) ? (a) : (b)
 
@@ -110,6 +115,14 @@ void arena_free(Arena *a);
 // dynamic arrays separate to the arena (good idea) and you still want the
 // lifetime grouped with the arena.
 void arena_own(Arena *a, void *alloc, u32 size);
+// Bytes handed out by the arena (including padding and owned blocks)
+usize arena_bytes_used(const Arena *a);
+// Like arena_alloc but allocations too big for a block are malloc'd and owned
+// by the arena instead of panicking
+void *arena_alloc_any(Arena *a, size_t size, uptr align);
+// Moves all of the memory owned by `src` into `dst`, `src` is left empty and
+// can still be used. Useful for handing back arenas used on other threads.
+void arena_adopt(Arena *dst, Arena *src);
 
 typedef struct StackSegment {
     struct StackSegment *next;
@@ -150,6 +163,20 @@ void stack_pop(Stack *stack);
 
 char *allocf(Arena *a, const char *fmt, ...) PRINTF_CHECK(2, 3);
 
+// Growable character buffer. Used to build up output in memory so it can be
+// written out with a single call.
+typedef struct {
+    char *items;
+    u32 len;
+    u32 cap;
+} StrBuf;
+
+void strbuf_printf(StrBuf *b, const char *fmt, ...) PRINTF_CHECK(2, 3);
+void strbuf_vprintf(StrBuf *b, const char *fmt, va_list args);
+void strbuf_append(StrBuf *b, string s);
+void strbuf_pad(StrBuf *b, char c, u32 n);
+void strbuf_free(StrBuf *b);
+
 #define MAYBE(T) \
     struct {     \
         bool ok; \
@@ -0,0 +1,260 @@
+// For clock_gettime and syscall
+#define _DEFAULT_SOURCE
+
+#include "prof.h"
+
+#include <assert.h>
+#include <time.h>
+
+#include "trace.h"
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#define HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char *perf_counter_name[PERF_COUNTER_COUNT] = {
+#define PERF_COUNTER(NAME, STR) [PERF_##NAME] = STR,
+    EACH_PERF_COUNTER
+#undef PERF_COUNTER
+};
+
+#ifdef __linux__
+
+static const u64 perf_counter_config[PERF_COUNTER_COUNT] = {
+    [PERF_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+    [PERF_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [PERF_CACHE_MISSES] = PERF_COUNT_HW_CACHE_MISSES,
+    [PERF_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+bool perf_counters_open(PerfCounters *pc, const char **why) {
+    for (u32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        pc->fds[i] = -1;
+    }
+    for (u32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = perf_counter_config[i];
+        // Only count our own user space code so this works without
+        // privileges on the default perf_event_paranoid setting
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // Count the parser threads (-j N) too, they inherit the counters
+        // when created and reading one sums over all of them. That's also
+        // why the counters are read one by one below, the kernel doesn't
+        // allow PERF_FORMAT_GROUP reads on inherited counters.
+        attr.inherit = 1;
+        // The group leader starts disabled so all counters start together
+        attr.disabled = i == 0;
+        int group = i == 0 ? -1 : pc->fds[0];
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+        if (fd == -1) {
+            *why = strerror(errno);
+            perf_counters_close(pc);
+            return false;
+        }
+        pc->fds[i] = fd;
+    }
+    ioctl(pc->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(pc->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+void perf_counters_read(const PerfCounters *pc, u64 out[PERF_COUNTER_COUNT]) {
+    for (u32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (read(pc->fds[i], &out[i], sizeof(out[i])) != sizeof(out[i])) {
+            out[i] = 0;
+        }
+    }
+}
+
+void perf_counters_close(PerfCounters *pc) {
+    for (u32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (pc->fds[i] != -1) {
+            close(pc->fds[i]);
+            pc->fds[i] = -1;
+        }
+    }
+}
+
+#else
+
+bool perf_counters_open(PerfCounters *pc, const char **why) {
+    (void)pc;
+    *why = "not supported on this platform";
+    return false;
+}
+
+void perf_counters_read(const PerfCounters *pc, u64 out[PERF_COUNTER_COUNT]) {
+    (void)pc;
+    for (u32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+        out[i] = 0;
+    }
+}
+
+void perf_counters_close(PerfCounters *pc) { (void)pc; }
+
+#endif
+
+u64 monotonic_ns(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        panic("clock_gettime failed");
+    }
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+usize malloc_bytes_in_use(void) {
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    // Small blocks handed out by the main heap plus large mmap'd ones
+    return mi.uordblks + mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+PhaseTimer phase_timer_create(const Arena *arena) {
+    return (PhaseTimer){
+        .items = NULL,
+        .len = 0,
+        .cap = 0,
+        .arena = arena,
+        .perf = NULL,
+        .start_ns = 0,
+    };
+}
+
+void phase_timer_free(PhaseTimer *t) {
+    if (t->items != NULL) {
+        free(t->items);
+    }
+    t->items = NULL;
+    t->len = 0;
+    t->cap = 0;
+}
+
+void phase_begin(PhaseTimer *t, const char *name) {
+    assert(t->start_ns == 0 && "phase already running");
+    TRACE_BEGIN(name);
+    APPEND(t, (PhaseStat){.name = name});
+    t->start_arena_bytes = t->arena ? arena_bytes_used(t->arena) : 0;
+    t->start_malloc_bytes = malloc_bytes_in_use();
+    // Read the clock and counters last so the bookkeeping above is not
+    // measured
+    if (t->perf) {
+        perf_counters_read(t->perf, t->start_counters);
+    }
+    t->start_ns = monotonic_ns();
+}
+
+void phase_end(PhaseTimer *t) {
+    u64 end_ns = monotonic_ns();
+    assert(t->start_ns != 0 && "no phase running");
+    PhaseStat *stat = &t->items[t->len - 1];
+    stat->ns = end_ns - t->start_ns;
+    if (t->perf) {
+        u64 end_counters[PERF_COUNTER_COUNT];
+        perf_counters_read(t->perf, end_counters);
+        for (u32 i = 0; i < PERF_COUNTER_COUNT; i++) {
+            stat->counters[i] = end_counters[i] - t->start_counters[i];
+        }
+    }
+    if (t->arena) {
+        stat->arena_bytes =
+            (s64)arena_bytes_used(t->arena) - (s64)t->start_arena_bytes;
+    }
+    stat->malloc_bytes =
+        (s64)malloc_bytes_in_use() - (s64)t->start_malloc_bytes;
+    t->start_ns = 0;
+    TRACE_END(stat->name);
+}
+
+// Misses per thousand instructions
+static f64 per_kinstr(const PhaseStat *s, PerfCounterKind kind) {
+    u64 instrs = s->counters[PERF_INSTRUCTIONS];
+    return instrs ? 1000.0 * s->counters[kind] / instrs : 0;
+}
+
+static f64 ipc(const PhaseStat *s) {
+    u64 cycles = s->counters[PERF_CYCLES];
+    return cycles ? (f64)s->counters[PERF_INSTRUCTIONS] / cycles : 0;
+}
+
+static void report_table(const PhaseTimer *t, FILE *fs) {
+    PhaseStat total = {.name = "total"};
+    fprintf(fs, "%-20s %12s %8s %14s %14s", "phase", "time (ms)", "%",
+            "arena (B)", "malloc (B)");
+    if (t->perf) {
+        fprintf(fs, " %14s %6s %10s %10s", "instructions", "IPC",
+                "cache MPKI", "br MPKI");
+    }
+    fprintf(fs, "\n");
+    for (u32 i = 0; i < t->len; i++) {
+        total.ns += t->items[i].ns;
+        total.arena_bytes += t->items[i].arena_bytes;
+        total.malloc_bytes += t->items[i].malloc_bytes;
+        for (u32 j = 0; j < PERF_COUNTER_COUNT; j++) {
+            total.counters[j] += t->items[i].counters[j];
+        }
+    }
+    for (u32 i = 0; i <= t->len; i++) {
+        PhaseStat s = i < t->len ? t->items[i] : total;
+        f64 pct = total.ns ? 100.0 * s.ns / total.ns : 0;
+        fprintf(fs, "%-20s %12.3f %7.1f%% %14lld %14lld", s.name, s.ns / 1e6,
+                pct, (long long)s.arena_bytes, (long long)s.malloc_bytes);
+        if (t->perf) {
+            fprintf(fs, " %14llu %6.2f %10.2f %10.2f",
+                    (unsigned long long)s.counters[PERF_INSTRUCTIONS], ipc(&s),
+                    per_kinstr(&s, PERF_CACHE_MISSES),
+                    per_kinstr(&s, PERF_BRANCH_MISSES));
+        }
+        fprintf(fs, "\n");
+    }
+}
+
+static void report_json(const PhaseTimer *t, FILE *fs) {
+    fprintf(fs, "{\"phases\": [");
+    for (u32 i = 0; i < t->len; i++) {
+        PhaseStat s = t->items[i];
+        fprintf(fs,
+                "%s\n  {\"name\": \"%s\", \"ns\": %llu, \"arena_bytes\": "
+                "%lld, \"malloc_bytes\": %lld",
+                i ? "," : "", s.name, (unsigned long long)s.ns,
+                (long long)s.arena_bytes, (long long)s.malloc_bytes);
+        if (t->perf) {
+            for (u32 j = 0; j < PERF_COUNTER_COUNT; j++) {
+                fprintf(fs, ", \"%s\": %llu", perf_counter_name[j],
+                        (unsigned long long)s.counters[j]);
+            }
+            fprintf(fs, ", \"ipc\": %.3f", ipc(&s));
+        }
+        fprintf(fs, "}");
+    }
+    fprintf(fs, "\n]}\n");
+}
+
+void phase_timer_report(const PhaseTimer *t, FILE *fs,
+                        PhaseReportFormat format) {
+    assert(t->start_ns == 0 && "phase still running");
+    switch (format) {
+        case PHASE_REPORT_TABLE:
+            report_table(t, fs);
+            break;
+        case PHASE_REPORT_JSON:
+            report_json(t, fs);
+            break;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include "common.h"
+
+// Simple phase timer used for `iotac --time-passes`. Each phase records the
+// wall time it took along with how much the tracked arena and the malloc heap
+// grew while it ran. Phases also show up as trace scopes (see trace.h).
+
+// Hardware counters sampled around each phase when enabled
+#define EACH_PERF_COUNTER                      \
+    PERF_COUNTER(CYCLES, "cycles")             \
+    PERF_COUNTER(INSTRUCTIONS, "instructions") \
+    PERF_COUNTER(CACHE_MISSES, "cache_misses") \
+    PERF_COUNTER(BRANCH_MISSES, "branch_misses")
+
+typedef enum {
+#define PERF_COUNTER(NAME, ...) PERF_##NAME,
+    EACH_PERF_COUNTER
+#undef PERF_COUNTER
+        PERF_COUNTER_COUNT,
+} PerfCounterKind;
+
+typedef struct {
+    int fds[PERF_COUNTER_COUNT];
+} PerfCounters;
+
+// Returns false (and fills in `why`) if the counters can't be opened, e.g.
+// on non-Linux platforms or when perf_event_paranoid denies access.
+bool perf_counters_open(PerfCounters *pc, const char **why);
+void perf_counters_read(const PerfCounters *pc, u64 out[PERF_COUNTER_COUNT]);
+void perf_counters_close(PerfCounters *pc);
+
+extern const char *perf_counter_name[PERF_COUNTER_COUNT];
+
+typedef struct {
+    const char *name;
+    u64 ns;
+    s64 arena_bytes;
+    s64 malloc_bytes;
+    u64 counters[PERF_COUNTER_COUNT];
+} PhaseStat;
+
+typedef struct {
+    PhaseStat *items;
+    u32 len;
+    u32 cap;
+    const Arena *arena;  // Arena whose growth is attributed to phases
+    // NULL unless hardware counters should be sampled
+    const PerfCounters *perf;
+    // State of the phase currently running
+    u64 start_ns;
+    usize start_arena_bytes;
+    usize start_malloc_bytes;
+    u64 start_counters[PERF_COUNTER_COUNT];
+} PhaseTimer;
+
+typedef enum {
+    PHASE_REPORT_TABLE,
+    PHASE_REPORT_JSON,
+} PhaseReportFormat;
+
+u64 monotonic_ns(void);
+// Bytes currently allocated with malloc, 0 if this is not supported by the
+// platform's libc
+usize malloc_bytes_in_use(void);
+
+PhaseTimer phase_timer_create(const Arena *arena);
+void phase_timer_free(PhaseTimer *t);
+void phase_begin(PhaseTimer *t, const char *name);
+void phase_end(PhaseTimer *t);
+void phase_timer_report(const PhaseTimer *t, FILE *fs,
+                        PhaseReportFormat format);
+
+#endif
@@ -0,0 +1,117 @@
+#include "trace.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "prof.h"
+
+typedef struct {
+    const char *name;
+    u64 ts_ns;
+    char phase;
+} TraceEvent;
+
+// One per thread that emitted an event, linked together so `trace_write`
+// can find them all.
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;
+    u32 tid;
+    TraceEvent *items;
+    u32 len;
+    u32 cap;
+} TraceBuffer;
+
+bool trace_enabled = false;
+
+static u64 trace_start_ns = 0;
+static atomic_flag buffers_lock = ATOMIC_FLAG_INIT;
+static TraceBuffer *buffers = NULL;
+static u32 next_tid = 0;
+static _Thread_local TraceBuffer *thread_buffer = NULL;
+
+static void lock(void) {
+    while (atomic_flag_test_and_set_explicit(&buffers_lock,
+                                             memory_order_acquire)) {
+    }
+}
+
+static void unlock(void) {
+    atomic_flag_clear_explicit(&buffers_lock, memory_order_release);
+}
+
+void trace_start(void) {
+    trace_start_ns = monotonic_ns();
+    trace_enabled = true;
+}
+
+static TraceBuffer *get_thread_buffer(void) {
+    if (thread_buffer == NULL) {
+        thread_buffer = calloc(1, sizeof(TraceBuffer));
+        if (thread_buffer == NULL) {
+            panic("out of memory");
+        }
+        lock();
+        thread_buffer->tid = next_tid++;
+        thread_buffer->next = buffers;
+        buffers = thread_buffer;
+        unlock();
+    }
+    return thread_buffer;
+}
+
+void trace_event(const char *name, char phase) {
+    u64 now = monotonic_ns();
+    TraceBuffer *buf = get_thread_buffer();
+    APPEND(buf, (TraceEvent){
+                    .name = name,
+                    .ts_ns = now - trace_start_ns,
+                    .phase = phase,
+                });
+}
+
+bool trace_write(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return false;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    bool first = true;
+    lock();
+    for (TraceBuffer *buf = buffers; buf != NULL; buf = buf->next) {
+        for (u32 i = 0; i < buf->len; i++) {
+            TraceEvent ev = buf->items[i];
+            // Timestamps are in microseconds
+            fprintf(f,
+                    "%s\n  {\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, "
+                    "\"pid\": 1, \"tid\": %u}",
+                    first ? "" : ",", ev.name, ev.phase, ev.ts_ns / 1e3,
+                    buf->tid);
+            first = false;
+        }
+    }
+    unlock();
+    fprintf(f, "\n]}\n");
+
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+void trace_free(void) {
+    lock();
+    TraceBuffer *buf = buffers;
+    while (buf != NULL) {
+        TraceBuffer *next = buf->next;
+        if (buf->items != NULL) {
+            free(buf->items);
+        }
+        free(buf);
+        buf = next;
+    }
+    buffers = NULL;
+    unlock();
+    // Only clears the calling thread's pointer, other threads must not emit
+    // events after this.
+    thread_buffer = NULL;
+    trace_enabled = false;
+}
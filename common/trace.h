@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+// Begin/end scopes written out as Chrome trace-event JSON (load it in
+// chrome://tracing or ui.perfetto.dev). When tracing is off the macros only
+// test a global flag. Events are buffered in memory per thread and written
+// out once with `trace_write`.
+//
+// Scope names must be string literals (or otherwise outlive the trace) and
+// must not need JSON escaping.
+
+extern bool trace_enabled;
+
+void trace_start(void);
+void trace_event(const char *name, char phase);
+// Writes all of the buffered events to `path`, returns false if the file
+// could not be written.
+bool trace_write(const char *path);
+void trace_free(void);
+
+#define TRACE_BEGIN(name)             \
+    do {                              \
+        if (trace_enabled) {          \
+            trace_event((name), 'B'); \
+        }                             \
+    } while (0)
+
+#define TRACE_END(name)               \
+    do {                              \
+        if (trace_enabled) {          \
+            trace_event((name), 'E'); \
+        }                             \
+    } while (0)
+
+#endif
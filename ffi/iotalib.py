@@ -15,6 +15,10 @@ class IotaLib:
         self.lib = ctypes.cdll.LoadLibrary(sopath)
         self.lib.ffi_parse.restype = ctypes.c_void_p
         self.lib.ffi_parse.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_bool]
+        self.lib.ffi_dump_events.restype = ctypes.c_void_p
+        self.lib.ffi_dump_events.argtypes = [ctypes.c_char_p]
+        self.lib.ffi_check_syntax.restype = ctypes.c_bool
+        self.lib.ffi_check_syntax.argtypes = [ctypes.c_char_p]
         self.lib.free.restype = None
         self.lib.free.argtypes = [ctypes.c_void_p]
 
@@ -26,6 +30,17 @@ class IotaLib:
         self.lib.free(rbuf)
         return ast.decode()
 
+    def dump_events(self, src: str) -> str:
+        rbuf = self.lib.ffi_dump_events(src.encode("UTF-8"))
+        if not rbuf:
+            raise Exception("parser reported errors")
+        out = ctypes.cast(rbuf, ctypes.c_char_p).value
+        self.lib.free(rbuf)
+        return out.decode()
+
+    def check_syntax(self, src: str) -> bool:
+        return self.lib.ffi_check_syntax(src.encode("UTF-8"))
+
     def parse_as(self, t: Node, src: str) -> str:
         match t:
             case Node.SOURCE_FILE:
@@ -8,7 +8,7 @@
 #include "../syn/syn.h"
 
 typedef AstNode *(*ParseFn)(ParseCtx *);
-typedef AstNode *(*ParseFnDelim)(ParseCtx *, Toks toks);
+typedef AstNode *(*ParseFnDelim)(ParseCtx *, TokSet toks);
 
 char *ffi_parse(void (*parse_fn)(void), const char *srcz, bool delim) {
     string src = ztos((char *)srcz);
@@ -49,3 +49,43 @@ char *ffi_parse(void (*parse_fn)(void), const char *srcz, bool delim) {
 
     return buf;
 }
+
+bool ffi_check_syntax(const char *srcz) {
+    string src = ztos((char *)srcz);
+    SourceCode code = new_source_code(ztos("<string>"), src);
+    bool ok = check_syntax(&code);
+    if (!ok) {
+        report_all_errors(code);
+        fflush(code.error_stream);
+    }
+    source_code_free(&code);
+    return ok;
+}
+
+char *ffi_dump_events(const char *srcz) {
+    string src = ztos((char *)srcz);
+    SourceCode code = new_source_code(ztos("<string>"), src);
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+
+    char *buf = NULL;
+    usize len = 0;
+    FILE *memfs = open_memstream(&buf, &len);
+    EventDumper dumper = {.fs = memfs, .indent_width = 2};
+    parse_source_file_events(&ctx, event_dumper_sink(&dumper));
+    fclose(memfs);
+    event_dumper_free(&dumper);
+
+    if (code.errors.len != 0) {
+        report_all_errors(code);
+        fflush(code.error_stream);
+        free(buf);
+        buf = NULL;
+    }
+
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+    return buf;
+}
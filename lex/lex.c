@@ -135,6 +135,8 @@ Tok lex_peek(Lexer *l) {
             return new_tok(l, T_PIPE, 1);
         case '&':
             return new_tok(l, T_AMP, 1);
+        case '^':
+            return new_tok(l, T_CARET, 1);
         case '%':
             return new_tok(l, T_PERC, 1);
         case '.':
@@ -152,12 +154,18 @@ Tok lex_peek(Lexer *l) {
             if (ahead(l, '=')) {
                 return new_tok(l, T_LTEQ, 2);
             }
+            if (ahead(l, '<')) {
+                return new_tok(l, T_SHL, 2);
+            }
             return new_tok(l, T_LT, 1);
         }
         case '>': {
             if (ahead(l, '=')) {
                 return new_tok(l, T_GTEQ, 2);
             }
+            if (ahead(l, '>')) {
+                return new_tok(l, T_SHR, 2);
+            }
             return new_tok(l, T_GT, 1);
         }
         case '/': {
@@ -296,12 +304,21 @@ static size_t scan_id(const char *txt) {
     u32 n = 0, l = 0;
     rune r;
     while (*it) {
-        n = chartorune(&r, it);
-        if (n == 0) {
-            fprintf(stderr, "TODO: propagate utf8 decode error");
-            abort();
+        bool is_id;
+        unsigned char c = *it;
+        if (c < 0x80) {
+            // Same as below for ASCII without the unicode table lookup
+            n = 1;
+            is_id = ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+                    c == '_' || (it != txt && '0' <= c && c <= '9');
+        } else {
+            n = chartorune(&r, it);
+            if (n == 0) {
+                fprintf(stderr, "TODO: propagate utf8 decode error");
+                abort();
+            }
+            is_id = it == txt ? id_start(r) : id_continue(r);
         }
-        bool is_id = it == txt ? id_start(r) : id_continue(r);
         if (!is_id) {
             break;
         }
@@ -38,8 +38,11 @@
     TOKEN(LTEQ, "'<='")                       \
     TOKEN(GT, "'>'")                          \
     TOKEN(GTEQ, "'>='")                       \
+    TOKEN(SHL, "'<<'")                        \
+    TOKEN(SHR, "'>>'")                        \
     TOKEN(PIPE, "'|'")                        \
     TOKEN(AMP, "'&'")                         \
+    TOKEN(CARET, "'^'")                       \
     TOKEN(PERC, "'%'")                        \
     TOKEN(INC, "'++'")                        \
     TOKEN(DEC, "'--'")                        \
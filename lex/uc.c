@@ -91,7 +91,12 @@ const char *gctoa(uc_gcat cat) {
 
 size_t chartorune(rune *r, const char *s) {
     assert(s != NULL);
-    int len = strlen(s);
+    // Only need to know if there are enough bytes for the longest sequence,
+    // `s` is usually the rest of the file so don't strlen it
+    int len = 0;
+    while (len < 4 && s[len] != '\0') {
+        len++;
+    }
     rune c = (unsigned char)*s;
     if (c == '\0') return 0;
 
@@ -5,6 +5,10 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "../common/map.h"
+
+MAP_DEFINE(error_site_map, u32, u32)
+
 void errorf(SourceCode code, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -12,28 +16,50 @@ void errorf(SourceCode code, const char *fmt, ...) {
     va_end(args);
 }
 
-void reportf(SourceCode code, u32 at, const char *fmt, ...) {
-    Position pos = line_and_column(code.lines, at);
-    string path = code.file_path;
-    string line = line_of(code, at);
+// Renders a single diagnostic (header, source line and caret) into `out`.
+// `pos` and `line` are passed in so callers rendering many diagnostics can
+// compute them incrementally.
+static void render_diagnostic(StrBuf *out, SourceCode code, Position pos,
+                              string line, const char *fmt, va_list args) {
     // Trim '\n'
-    if (line.data[line.len - 1] == '\n') {
+    if (line.len != 0 && line.data[line.len - 1] == '\n') {
         line.len -= 1;
     }
-    fprintf(code.error_stream, "%.*s:%d:%d:", path.len, path.data, pos.line,
-            pos.column);
+    strbuf_printf(out, "%.*s:%d:%d: ", SPLAT(code.file_path), pos.line,
+                  pos.column);
+    strbuf_vprintf(out, fmt, args);
+
+    u32 gutter = out->len;
+    strbuf_printf(out, "\n %d |", pos.line);
+    // Don't count the newline
+    gutter = out->len - gutter - 1;
+    strbuf_printf(out, " %.*s\n", SPLAT(line));
+    strbuf_pad(out, ' ', gutter - 1);
+    strbuf_append(out, S("| "));
+    strbuf_pad(out, ' ', pos.column - 1);
+    strbuf_append(out, S("^\n"));
+}
+
+static void renderf(StrBuf *out, SourceCode code, Position pos, string line,
+                    const char *fmt, ...) PRINTF_CHECK(5, 6);
+
+static void renderf(StrBuf *out, SourceCode code, Position pos, string line,
+                    const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    fprintf(code.error_stream, " ");
-    vfprintf(code.error_stream, fmt, args);
-    fprintf(code.error_stream, "\n");
+    render_diagnostic(out, code, pos, line, fmt, args);
     va_end(args);
-    static char fbuf[1024];
-    snprintf(fbuf, sizeof(fbuf), " %d |", pos.line);
-    u32 flen = strlen(fbuf);
-    fprintf(code.error_stream, "%s %.*s\n", fbuf, line.len, line.data);
-    snprintf(fbuf, sizeof(fbuf), "%*s|", flen - 1, " ");
-    fprintf(code.error_stream, "%s %*s^\n", fbuf, pos.column - 1, "");
+}
+
+void reportf(SourceCode code, u32 at, const char *fmt, ...) {
+    StrBuf out = {0};
+    va_list args;
+    va_start(args, fmt);
+    render_diagnostic(&out, code, line_and_column(code.lines, at),
+                      line_of(code, at), fmt, args);
+    va_end(args);
+    fwrite(out.items, 1, out.len, code.error_stream);
+    strbuf_free(&out);
 }
 
 static Lines new_lines(string text) {
@@ -54,22 +80,28 @@ SourceCode new_source_code(string file_path, string text) {
         .text = text,
         .error_stream = stderr,
         .error_arena = new_arena(),
+        .max_errors = 0,
+        .max_line_errors = 0,
+        .error_sites = error_site_map_create(64),
+        .error_lines = error_site_map_create(64),
     };
 }
 
 Position line_and_column(Lines lines, u32 offset) {
-    for (u32 i = 0; i < lines.len - 1; i++) {
-        if (lines.items[i] <= offset && offset < lines.items[i + 1]) {
-            return (Position){
-                .line = i + 1,
-                .column = offset - lines.items[i] + 1,
-            };
+    // Find the last line starting at or before offset
+    u32 lo = 0;
+    u32 hi = lines.len;
+    while (hi - lo > 1) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (lines.items[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
     }
-    // Must be in the last line
     return (Position){
-        .line = lines.len,
-        .column = offset - lines.items[lines.len - 1] + 1,
+        .line = lo + 1,
+        .column = offset - lines.items[lo] + 1,
     };
 }
 
@@ -92,11 +124,75 @@ void source_code_free(SourceCode *code) {
     if (code->errors.items != NULL) {
         free(code->errors.items);
     }
-    memset(code, 0, sizeof(*code));
+    error_site_map_delete(code->error_sites);
+    error_site_map_delete(code->error_lines);
     arena_free(&code->error_arena);
+    memset(code, 0, sizeof(*code));
+}
+
+static u32 error_at(Error error) {
+    switch (error.t) {
+        case ERROR_SYNTAX:
+            return error.syntax_error.at;
+        case ERROR_LEXICAL:
+            return error.lexical_error.at;
+        case ERROR_SEMANTIC:
+            return error.semantic_error.at;
+    }
+    assert(false && "unreachable");
+}
+
+bool error_budget_exhausted(const SourceCode *code) {
+    return code->max_errors != 0 && code->error_count >= code->max_errors;
+}
+
+static _Thread_local DiagBuffer *current_diag_buffer = NULL;
+
+u32 errors_raised(const SourceCode *code) {
+    if (current_diag_buffer != NULL) {
+        return current_diag_buffer->errors.len;
+    }
+    return code->error_count + code->dropped_errors;
 }
 
 void raise_error(SourceCode *code, Error error) {
+    if (current_diag_buffer != NULL) {
+        APPEND(&current_diag_buffer->errors, error);
+        return;
+    }
+    if (code->log != NULL) {
+        APPEND(code->log, error);
+    }
+    if (error.t != ERROR_SEMANTIC) {
+        code->syntax_errors++;
+    }
+
+    if (error_budget_exhausted(code)) {
+        code->dropped_errors++;
+        return;
+    }
+
+    u32 at = error_at(error);
+    bool inserted = false;
+    (void)error_site_map_get_or_insert(&code->error_sites, at, &inserted);
+    if (!inserted) {
+        return;
+    }
+
+    if (code->max_line_errors != 0 && error.t != ERROR_SEMANTIC) {
+        u32 line = line_and_column(code->lines, at).line;
+        u32 *count = error_site_map_get_or_insert(&code->error_lines, line,
+                                                  &inserted);
+        if (inserted) {
+            *count = 0;
+        }
+        if (*count >= code->max_line_errors) {
+            return;
+        }
+        (*count)++;
+    }
+
+    code->error_count++;
     APPEND(&code->errors, error);
 #ifdef ERROR_IMMEDIATE
     report_error(*code, error);
@@ -124,11 +220,12 @@ void raise_semantic_error(SourceCode *code, SemanticError error) {
                       });
 }
 
-void report_error(SourceCode code, Error error) {
+static void render_error(StrBuf *out, SourceCode code, Error error,
+                         Position pos, string line) {
     switch (error.t) {
         case ERROR_SYNTAX: {
             SyntaxError syntax_error = error.syntax_error;
-            reportf(code, syntax_error.at,
+            renderf(out, code, pos, line,
                     "syntax error: expected %s, found %s",
                     syntax_error.expected, syntax_error.got);
             break;
@@ -137,11 +234,11 @@ void report_error(SourceCode code, Error error) {
             LexicalError lexical_error = error.lexical_error;
             switch (lexical_error.t) {
                 case LEXICAL_ERROR_INVALID_CHAR:
-                    reportf(code, lexical_error.at, "invalid character '%c'",
+                    renderf(out, code, pos, line, "invalid character '%c'",
                             lexical_error.invalid_char);
                     break;
                 case LEXICAL_ERROR_TEXT:
-                    reportf(code, lexical_error.at, "%s", lexical_error.text);
+                    renderf(out, code, pos, line, "%s", lexical_error.text);
                     break;
                 default:
                     break;
@@ -150,20 +247,186 @@ void report_error(SourceCode code, Error error) {
         }
         case ERROR_SEMANTIC: {
             SemanticError semantic_error = error.semantic_error;
-            reportf(code, semantic_error.at, "%s", semantic_error.message);
+            renderf(out, code, pos, line, "%s", semantic_error.message);
             break;
         }
     }
 }
 
+void report_error(SourceCode code, Error error) {
+    StrBuf out = {0};
+    u32 at = error_at(error);
+    render_error(&out, code, error, line_and_column(code.lines, at),
+                 line_of(code, at));
+    fwrite(out.items, 1, out.len, code.error_stream);
+    strbuf_free(&out);
+}
+
+typedef struct {
+    u32 at;
+    u32 index;
+} ErrorOrder;
+
+static int error_order_cmp(const void *a, const void *b) {
+    const ErrorOrder *ea = a;
+    const ErrorOrder *eb = b;
+    if (ea->at != eb->at) {
+        return ea->at < eb->at ? -1 : 1;
+    }
+    // Keep errors at the same location in the order they were raised
+    return ea->index < eb->index ? -1 : ea->index > eb->index;
+}
+
 void report_all_errors(SourceCode code) {
+    if (code.errors.len == 0) {
+        return;
+    }
+
+    ErrorOrder *order = malloc(code.errors.len * sizeof(ErrorOrder));
+    if (order == NULL) {
+        panic("out of memory");
+    }
     for (u32 i = 0; i < code.errors.len; i++) {
-        report_error(code, code.errors.items[i]);
+        order[i] = (ErrorOrder){error_at(code.errors.items[i]), i};
+    }
+    qsort(order, code.errors.len, sizeof(ErrorOrder), error_order_cmp);
+
+    // As the errors are sorted by offset, the line containing each error can
+    // be found by walking forward from the line of the previous one.
+    StrBuf out = {0};
+    u32 line = 0;
+    for (u32 i = 0; i < code.errors.len; i++) {
+        u32 at = order[i].at;
+        while (line + 1 < code.lines.len && code.lines.items[line + 1] <= at) {
+            line++;
+        }
+        u32 line_end = line + 1 < code.lines.len ? code.lines.items[line + 1]
+                                                 : code.text.len;
+        Position pos = {
+            .line = line + 1,
+            .column = at - code.lines.items[line] + 1,
+        };
+        string text = {
+            .data = &code.text.data[code.lines.items[line]],
+            .len = line_end - code.lines.items[line],
+        };
+        render_error(&out, code, code.errors.items[order[i].index], pos, text);
+    }
+
+    if (code.dropped_errors != 0) {
+        strbuf_printf(&out,
+                      "%.*s: too many errors (limit is %u), %u more not "
+                      "shown\n",
+                      SPLAT(code.file_path), code.max_errors,
+                      code.dropped_errors);
     }
+
+    fwrite(out.items, 1, out.len, code.error_stream);
+    strbuf_free(&out);
+    free(order);
 }
 
 void flush_errors(SourceCode *code) {
     report_all_errors(*code);
     code->errors.len = 0;
+    code->dropped_errors = 0;
     arena_reset(&code->error_arena);
+    error_site_map_delete(code->error_sites);
+    error_site_map_delete(code->error_lines);
+    code->error_sites = error_site_map_create(64);
+    code->error_lines = error_site_map_create(64);
+}
+
+DiagBuffer new_diag_buffer(void) {
+    return (DiagBuffer){
+        .errors = {0},
+        .arena = new_arena(),
+    };
+}
+
+void diag_buffer_free(DiagBuffer *buf) {
+    if (buf->errors.items != NULL) {
+        free(buf->errors.items);
+    }
+    arena_free(&buf->arena);
+    memset(buf, 0, sizeof(*buf));
+}
+
+DiagBuffer *diag_buffer_attach(DiagBuffer *buf) {
+    DiagBuffer *old = current_diag_buffer;
+    current_diag_buffer = buf;
+    return old;
+}
+
+Arena *diag_arena(SourceCode *code) {
+    if (current_diag_buffer != NULL) {
+        return &current_diag_buffer->arena;
+    }
+    return &code->error_arena;
+}
+
+typedef struct {
+    u32 at;
+    u32 buf;
+    u32 index;
+} DiagOrder;
+
+static int diag_order_cmp(const void *a, const void *b) {
+    const DiagOrder *x = a;
+    const DiagOrder *y = b;
+    if (x->at != y->at) {
+        return x->at < y->at ? -1 : 1;
+    }
+    if (x->buf != y->buf) {
+        return x->buf < y->buf ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+void diag_buffers_merge(SourceCode *code, DiagBuffer *bufs, u32 len) {
+    assert(current_diag_buffer == NULL && "merge on the owning thread");
+
+    u32 total = 0;
+    for (u32 i = 0; i < len; i++) {
+        total += bufs[i].errors.len;
+    }
+
+    // Sort by offset first so the errors kept (dedup and budget) do not
+    // depend on how work was split between threads.
+    DiagOrder *order = malloc(sizeof(*order) * (total ? total : 1));
+    if (order == NULL) {
+        panic("out of memory");
+    }
+    u32 n = 0;
+    for (u32 i = 0; i < len; i++) {
+        for (u32 j = 0; j < bufs[i].errors.len; j++) {
+            order[n++] = (DiagOrder){
+                .at = error_at(bufs[i].errors.items[j]),
+                .buf = i,
+                .index = j,
+            };
+        }
+    }
+    qsort(order, total, sizeof(*order), diag_order_cmp);
+
+    for (u32 i = 0; i < total; i++) {
+        raise_error(code, bufs[order[i].buf].errors.items[order[i].index]);
+    }
+    free(order);
+
+    // Messages still point into the buffer arenas, keep them alive for as
+    // long as the other error messages.
+    for (u32 i = 0; i < len; i++) {
+        bufs[i].errors.len = 0;
+        arena_adopt(&code->error_arena, &bufs[i].arena);
+    }
+}
+
+void diag_buffer_replay(SourceCode *code, DiagBuffer *buf) {
+    assert(current_diag_buffer == NULL && "replay on the owning thread");
+    for (u32 i = 0; i < buf->errors.len; i++) {
+        raise_error(code, buf->errors.items[i]);
+    }
+    buf->errors.len = 0;
+    arena_adopt(&code->error_arena, &buf->arena);
 }
@@ -63,6 +63,23 @@ typedef struct {
     FILE *error_stream;
     Arena error_arena;  // Used to store error message data
     Errors errors;
+    // Once `max_errors` errors have been raised any further errors are
+    // dropped and `error_budget_exhausted` returns true so callers can stop
+    // early (0 means no limit).
+    u32 max_errors;
+    // Maximum number of syntax or lexical errors kept per line, anything more
+    // is often a cascade of the first error (0, the default, means no limit).
+    u32 max_line_errors;
+    u32 error_count;     // Errors raised over the lifetime of the source
+    u32 dropped_errors;  // Errors dropped as the budget was exhausted
+    u32 syntax_errors;   // Syntax and lexical errors raised, kept or not
+    // Offsets that already have an error and the number of syntax/lexical
+    // errors kept per line, both since the last flush_errors
+    u32 *error_sites;
+    u32 *error_lines;
+    // If set every error passed to raise_error is added here as well, before
+    // any of the limits are applied (see syn/cache.c)
+    Errors *log;
 } SourceCode;
 
 typedef struct {
@@ -76,18 +93,48 @@ void source_code_free(SourceCode *code);
 Position line_and_column(Lines lines, u32 offset);
 string line_of(SourceCode code, u32 offset);
 
-// TODO: add some way to restrict the number of errors on the same line - this
-// is good to reduce spurious errors
 void errorf(SourceCode code, const char *fmt, ...) PRINTF_CHECK(2, 3);
 void reportf(SourceCode code, u32 at, const char *fmt, ...) PRINTF_CHECK(3, 4);
 
+// Only the first error at a given offset is kept, see also `max_errors` and
+// `max_line_errors` for the other limits applied here.
 void raise_error(SourceCode *code, Error error);
+bool error_budget_exhausted(const SourceCode *code);
+// Number of errors raised so far that were kept or dropped by the budget, or
+// added to the buffer if one is attached (see below)
+u32 errors_raised(const SourceCode *code);
 void raise_syntax_error(SourceCode *code, SyntaxError error);
 void raise_lexical_error(SourceCode *code, LexicalError error);
 void raise_semantic_error(SourceCode *code, SemanticError error);
 void report_error(SourceCode code, Error error);
 void report_all_errors(SourceCode code);
-// Like report_all_errors except it will also reset the list of errors
+// Like report_all_errors except it will also reset the list of errors, and
+// forget where they were raised
 void flush_errors(SourceCode *code);
 
+// Per thread error sink. While a buffer is attached to the current thread
+// `raise_error` appends to it instead of the SourceCode, so passes can raise
+// errors from worker threads without locking. Messages should be allocated
+// with `diag_arena` so they live in the buffer too. The buffers are merged
+// back (in offset order) with `diag_buffers_merge` once the workers are done,
+// which is also when deduplication and the error budget are applied.
+typedef struct {
+    Errors errors;
+    Arena arena;
+} DiagBuffer;
+
+DiagBuffer new_diag_buffer(void);
+void diag_buffer_free(DiagBuffer *buf);
+// Pass NULL to detach the current buffer. Returns the buffer that was
+// attached before, so it can be put back.
+DiagBuffer *diag_buffer_attach(DiagBuffer *buf);
+// Arena error messages for `code` should be allocated in on this thread
+Arena *diag_arena(SourceCode *code);
+// Moves the errors in `bufs` into `code`, the buffers are left empty but
+// still need to be freed.
+void diag_buffers_merge(SourceCode *code, DiagBuffer *bufs, u32 len);
+// Same as merging a single buffer but keeps the errors in the order they were
+// raised, for when the buffer was only used to be able to take errors back
+void diag_buffer_replay(SourceCode *code, DiagBuffer *buf);
+
 #endif
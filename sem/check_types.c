@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdarg.h>
 
+#include "../common/trace.h"
 #include "sem.h"
 
 // Canonicalizes all types apart from scoped idents which need to be resolved
@@ -27,6 +28,12 @@ typedef struct {
     TypeId *normalized_type;
     TypeId *type_memo;
     SourceCode *code;
+    // Name resolution, run ahead of us in the same walk
+    NameResCtx *names;
+    // Set once a type didn't resolve, the types using it can't be either
+    bool stuck;
+    // Our own errors, held back until names are known to have resolved
+    DiagBuffer diags;
 } TypeResCtx;
 
 static void seed_builtin_type(TypeResCtx *ctx, TokKind kind);
@@ -40,66 +47,142 @@ MAP_DEFINE(type_memo, TypeRepr, TypeId)
 static TypeHash type_hash_generic(void *repr);
 static bool type_is_identical_generic(void *ta, void *tb);
 
-void do_check_types(Ast *ast, SourceCode *code) {
-    TypeCheckCtx ctx = {
+static void type_res_begin(TypeResCtx *ctx, Ast *ast, SourceCode *code,
+                           NameResCtx *names) {
+    *ctx = (TypeResCtx){
         .ast = ast,
+        .current_type = current_type_create(),
+        .normalized_type = normalized_type_create(128),
+        .type_memo = type_memo_create_with_cfg(
+            128,
+            (MapConfig){
+                .cmp = type_is_identical_generic,
+                .hash = type_hash_generic,
+            }),
         .code = code,
-        .type_hint = type_hint_create(),
+        .names = names,
+        .diags = new_diag_buffer(),
     };
 
-    {
-        TypeResCtx ctx = {
-            .ast = ast,
-            .current_type = current_type_create(),
-            .normalized_type = normalized_type_create(128),
-            .type_memo =
-                type_memo_create_with_cfg(128,
-                                          (MapConfig){
-                                              .cmp = type_is_identical_generic,
-                                              .hash = type_hash_generic,
-                                          }),
-            .code = code,
-        };
-
-        seed_builtin_type(&ctx, T_U8);
-        seed_builtin_type(&ctx, T_S8);
-        seed_builtin_type(&ctx, T_U16);
-        seed_builtin_type(&ctx, T_S16);
-        seed_builtin_type(&ctx, T_U32);
-        seed_builtin_type(&ctx, T_S32);
-        seed_builtin_type(&ctx, T_U64);
-        seed_builtin_type(&ctx, T_S64);
-        seed_builtin_type(&ctx, T_F32);
-        seed_builtin_type(&ctx, T_F64);
-        seed_builtin_type(&ctx, T_UNIT);
-        seed_builtin_type(&ctx, T_STRING);
-        seed_builtin_type(&ctx, T_BOOL);
-
-        ast_traverse_dfs(&ctx, ast,
-                         (EnterExitVTable){
-                             .enter = type_resolution_enter,
-                             .exit = type_resolution_exit,
-                         });
-
-        MapCursor it = map_cursor_create(ctx.normalized_type);
-        while (map_cursor_next(&it)) {
-            Type *type = *(Type **)map_key_of(ctx.normalized_type, it.current);
-            TypeId id = *(TypeId *)it.current;
-            type_source_put(&ast->tree_data.type_source, id, type);
+    seed_builtin_type(ctx, T_U8);
+    seed_builtin_type(ctx, T_S8);
+    seed_builtin_type(ctx, T_U16);
+    seed_builtin_type(ctx, T_S16);
+    seed_builtin_type(ctx, T_U32);
+    seed_builtin_type(ctx, T_S32);
+    seed_builtin_type(ctx, T_U64);
+    seed_builtin_type(ctx, T_S64);
+    seed_builtin_type(ctx, T_F32);
+    seed_builtin_type(ctx, T_F64);
+    seed_builtin_type(ctx, T_UNIT);
+    seed_builtin_type(ctx, T_STRING);
+    seed_builtin_type(ctx, T_BOOL);
+}
+
+static bool names_failed(TypeResCtx *ctx) {
+    return ctx->names->failed;
+}
+
+static bool gave_up(TypeResCtx *ctx) {
+    return ctx->stuck || names_failed(ctx) || ctx->code->syntax_errors != 0;
+}
+
+// Type resolution needs the names under a node resolved by the time it exits
+// it, which name resolution (earlier in the same walk) does on enter. Once a
+// name or a type fails to resolve the types can't be made sense of, and where
+// the parser found an error (in a body parsed during the walk too) there are
+// nodes missing, so we only keep the type stack balanced from there on.
+static DfsCtrl type_res_fused_enter(void *_ctx, AstNode *node) {
+    TypeResCtx *ctx = _ctx;
+    (void)type_resolution_enter(ctx, node);
+    return gave_up(ctx) ? DFS_CTRL_SKIP_SUBTREE : DFS_CTRL_KEEP_GOING;
+}
+
+static DfsCtrl type_res_fused_exit(void *_ctx, AstNode *node) {
+    TypeResCtx *ctx = _ctx;
+    if (gave_up(ctx)) {
+        if (node->kind == NODE_TYPE) {
+            current_type_pop(ctx->current_type);
         }
+        return DFS_CTRL_KEEP_GOING;
+    }
+    diag_buffer_attach(&ctx->diags);
+    (void)type_resolution_exit(ctx, node);
+    diag_buffer_attach(NULL);
+    return DFS_CTRL_KEEP_GOING;
+}
 
-        current_type_delete(ctx.current_type);
-        normalized_type_delete(ctx.normalized_type);
-        type_memo_delete(ctx.type_memo);
+// Returns false if names or types failed to resolve. Our errors are only
+// kept if the names did.
+static bool type_res_end(TypeResCtx *ctx) {
+    assert(da_length(ctx->current_type) == 0);
+    bool ok = !names_failed(ctx);
+    if (ok) {
+        diag_buffer_replay(ctx->code, &ctx->diags);
+    }
+    diag_buffer_free(&ctx->diags);
+    ok = ok && !ctx->stuck;
+
+    MapCursor it = map_cursor_create(ctx->normalized_type);
+    while (map_cursor_next(&it)) {
+        Type *type = *(Type **)map_key_of(ctx->normalized_type, it.current);
+        TypeId id = *(TypeId *)it.current;
+        type_source_put(&ctx->ast->tree_data.type_source, id, type);
     }
 
+    current_type_delete(ctx->current_type);
+    normalized_type_delete(ctx->normalized_type);
+    type_memo_delete(ctx->type_memo);
+    return ok;
+}
+
+// Symbols have to be all in the table before any name is resolved, and types
+// all resolved before any is checked (both can be used before they are
+// declared), so those need walks of their own. Resolving names and types
+// can share one.
+bool do_resolve_and_check_types(Ast *ast, SourceCode *code) {
+    TRACE_BEGIN("resolve_and_check_types");
+    NameResCtx names = name_res_create(ast, code);
+    TypeResCtx types;
+    type_res_begin(&types, ast, code, &names);
+    AstVisitor visitors[] = {
+        name_res_visitor(&names),
+        {
+            .ctx = &types,
+            .vtable =
+                {
+                    .name = "type_resolution_dfs",
+                    .enter = type_res_fused_enter,
+                    .exit = type_res_fused_exit,
+                },
+        },
+    };
+    ast_traverse_fused(ast, visitors, 2);
+    name_res_finish(&names);
+    if (!type_res_end(&types)) {
+        TRACE_END("resolve_and_check_types");
+        return false;
+    }
+    // Same as for type resolution above, the checks assume a whole tree
+    if (code->syntax_errors != 0) {
+        TRACE_END("resolve_and_check_types");
+        return true;
+    }
+
+    TypeCheckCtx ctx = {
+        .ast = ast,
+        .code = code,
+        .type_hint = type_hint_create(),
+    };
     ast_traverse_dfs(&ctx, ast,
                      (EnterExitVTable){
+                         .name = "type_check_dfs",
                          .enter = check_types_enter,
                          .exit = check_types_exit,
                      });
-
     type_hint_delete(ctx.type_hint);
+    TRACE_END("resolve_and_check_types");
+    return true;
 }
 
 #define FNV1A_64_OFFSET_BASIS (uint64_t)0xcbf29ce484222325
@@ -318,8 +401,8 @@ static void type_res_enum_type(TypeResCtx *ctx, EnumType *enum_type) {
     string **names = &te->alts;
     *names = type_enum_alts_create();
 
-    for (u32 i = 0; i < da_length(hd->children); i++) {
-        Ident *alt = child_ident_at(hd, i);
+    for (u32 i = 0; i < ast_node_children(ctx->ast, hd).len; i++) {
+        Ident *alt = child_ident_at(ctx->ast, hd, i);
         type_enum_alts_append(names, alt->token.text);
     }
 
@@ -340,8 +423,8 @@ static void type_res_struct_type(TypeResCtx *ctx, StructType *struct_type) {
     TypeField **fields = &ts->fields;
     *fields = type_fields_create();
 
-    for (u32 i = 0; i < da_length(hd->children); i++) {
-        StructField *f = child_struct_field_at(hd, i);
+    for (u32 i = 0; i < ast_node_children(ctx->ast, hd).len; i++) {
+        StructField *f = child_struct_field_at(ctx->ast, hd, i);
         TypeId *ft =
             normalized_type_get(ctx->normalized_type, f->binding->type);
         assert(ft && "subtree type should be resolved");
@@ -368,8 +451,8 @@ static void type_res_tuple_type(TypeResCtx *ctx, TupleType *tuple_type) {
     TypeId **types = &tt->types;
     *types = types_create();
 
-    for (u32 i = 0; i < da_length(hd->children); i++) {
-        Type *f = child_type_at(hd, i);
+    for (u32 i = 0; i < ast_node_children(ctx->ast, hd).len; i++) {
+        Type *f = child_type_at(ctx->ast, hd, i);
         TypeId *ft = normalized_type_get(ctx->normalized_type, f);
         assert(ft && "subtree type should be resolved");
         types_append(types, *ft);
@@ -402,8 +485,8 @@ static void type_res_tagged_union_type(TypeResCtx *ctx,
     TypeId **types = &tu->types;
     *types = types_create();
 
-    for (u32 i = 0; i < da_length(hd->children); i++) {
-        UnionAlt *alt = child_union_alt_at(hd, i);
+    for (u32 i = 0; i < ast_node_children(ctx->ast, hd).len; i++) {
+        UnionAlt *alt = child_union_alt_at(ctx->ast, hd, i);
         switch (alt->t) {
             case UNION_ALT_TYPE: {
                 // For now disallow nested tagged union types as the semantics
@@ -537,6 +620,7 @@ static void type_res_scoped_ident(TypeResCtx *ctx, ScopedIdent *scoped_ident) {
     if (res->kind != NODE_TYPE_DECL) {
         sem_raisef(ctx->ast, ctx->code, scoped_ident->head.offset,
                    "symbol mismatch: name must resolve to a type");
+        ctx->stuck = true;
         return;
     }
 
@@ -791,9 +875,9 @@ static bool type_is_arithmetic(const TypeRepr *repr) {
 }
 
 static TypeId type_of_expr(TypeCheckCtx *ctx, Expr *expr) {
-    Child *children = expr->head.children;
-    assert(da_length(children) != 0);
-    Child *child = children_at(children, 0);
+    Children children = ast_node_children(ctx->ast, &expr->head);
+    assert(children.len != 0);
+    Child *child = &children.items[0];
     assert(child->t == CHILD_NODE);
     return ast_type_get(ctx->ast, child->node);
 }
@@ -802,11 +886,12 @@ static TypeId get_builtin_type(TypeCheckCtx *ctx, TokKind kind) {
     return ctx->ast->tree_data.builtin_type[kind];
 }
 
-static AstNode *match_parent_chain(AstNode *node, size_t count, ...) {
+static AstNode *match_parent_chain(Ast *ast, AstNode *node, size_t count,
+                                   ...) {
     va_list args;
     va_start(args, count);
 
-    AstNode *it = node->parent.ptr;
+    AstNode *it = ast_node_parent(ast, node);
     AstNode *match = it;
 
     for (size_t i = 0; i < count; i++) {
@@ -815,7 +900,7 @@ static AstNode *match_parent_chain(AstNode *node, size_t count, ...) {
             return NULL;
         }
         match = it;
-        it = it->parent.ptr;
+        it = ast_node_parent(ast, it);
     }
 
     return match;
@@ -824,10 +909,10 @@ static AstNode *match_parent_chain(AstNode *node, size_t count, ...) {
 static TypeId type_of_imperative_ref(Ast *ast, AstNode *res) {
     if (res->kind == NODE_IDENT) {
         AstNode *enum_type =
-            match_parent_chain(res, 2, NODE_IDENTS, NODE_ENUM_TYPE);
+            match_parent_chain(ast, res, 2, NODE_IDENTS, NODE_ENUM_TYPE);
         if (enum_type) {
-            AstNode *type_decl =
-                match_parent_chain(enum_type, 3, NODE_TYPE, NODE_TYPE_DECL);
+            AstNode *type_decl = match_parent_chain(ast, enum_type, 3,
+                                                    NODE_TYPE, NODE_TYPE_DECL);
             if (type_decl) {
                 return ast_type_get(ast, type_decl);
             }
@@ -863,15 +948,17 @@ static void check_atom(TypeCheckCtx *ctx, Atom *atom) {
             ast_type_set(ctx->ast, &atom->head, ref_ty);
             break;
         }
-        case ATOM_BUILTIN_TYPE:
-            if (atom->head.parent.ptr != NULL) {
-                if (atom->head.parent.ptr->kind != NODE_CALL) {
+        case ATOM_BUILTIN_TYPE: {
+            AstNode *parent = ast_node_parent(ctx->ast, &atom->head);
+            if (parent != NULL) {
+                if (parent->kind != NODE_CALL) {
                     sem_raisef(ctx->ast, ctx->code, atom->head.offset,
                                "expression error: builtin type can only appear "
                                "as call expression");
                 }
             }
             break;
+        }
     }
 }
 
@@ -918,7 +1005,10 @@ static void check_bin_expr(TypeCheckCtx *ctx, BinExpr *bin_expr) {
             }
         }
         case T_AMP:
+        case T_CARET:
         case T_PIPE:
+        case T_SHL:
+        case T_SHR:
         case T_NEQ:
         case T_EQEQ:
         case T_LT:
@@ -1054,7 +1144,9 @@ static Scope *scope_hint(TypeCheckCtx *ctx) {
         return NULL;
     }
     Type *ty = *tr;
-    Child *child = children_at(ty->head.children, 0);
+    Children children = ast_node_children(ctx->ast, &ty->head);
+    assert(children.len != 0);
+    Child *child = &children.items[0];
     if (child->t == CHILD_NODE) {
         return ast_scope_get(ctx->ast, child->node);
     }
@@ -1062,9 +1154,10 @@ static Scope *scope_hint(TypeCheckCtx *ctx) {
 }
 
 static void check_scoped_ident(TypeCheckCtx *ctx, ScopedIdent *scoped_ident) {
-    assert(da_length(scoped_ident->head.children) != 0);
+    Children children = ast_node_children(ctx->ast, &scoped_ident->head);
+    assert(children.len != 0);
 
-    Tok first = child_ident_at(&scoped_ident->head, 0)->token;
+    Tok first = child_ident_at(ctx->ast, &scoped_ident->head, 0)->token;
     if (first.t != T_EMPTY_STRING) {
         // Skip non inferred reference
         return;
@@ -1089,13 +1182,14 @@ static void check_scoped_ident(TypeCheckCtx *ctx, ScopedIdent *scoped_ident) {
     }
 
     size_t start_i = 1;
-    for (size_t i = start_i; i < da_length(h->children); i++) {
-        Ident *ident = child_ident_at(&scoped_ident->head, i);
+    for (size_t i = start_i; i < children.len; i++) {
+        Ident *ident = child_ident_at(ctx->ast, &scoped_ident->head, i);
         u32 defined_at = ident->token.offset;
         string ident_text = ident->token.text;
 
         if (!scope) {
-            string supposed_scope = child_ident_at(h, i - 1)->token.text;
+            string supposed_scope =
+                child_ident_at(ctx->ast, h, i - 1)->token.text;
             sem_raisef(ctx->ast, ctx->code, defined_at,
                        "inferred lookup error: cannot resolve '{s}' in '{s}' "
                        "as '{s}' does "
@@ -1109,7 +1203,7 @@ static void check_scoped_ident(TypeCheckCtx *ctx, ScopedIdent *scoped_ident) {
                          i == 0 ? LOOKUP_MODE_LEXICAL : LOOKUP_MODE_DIRECT);
         if (!lookup.entry) {
             if (i != start_i) {
-                string parent = child_ident_at(h, i - 1)->token.text;
+                string parent = child_ident_at(ctx->ast, h, i - 1)->token.text;
                 sem_raisef(
                     ctx->ast, ctx->code, defined_at,
                     "inferred lookup error: '{s}' not found inside scope '{s}'",
@@ -6,33 +6,43 @@
 static DfsCtrl resolve_names_enter(void *_ctx, AstNode *node);
 static DfsCtrl resolve_names_exit(void *_ctx, AstNode *node);
 
-typedef struct {
-    Ast *ast;
-    Stack scopes;
-    Scope *global_scope;
-    SourceCode *code;
-    NULLABLE_PTR(FnDecl) curr_fn;
-    NULLABLE_PTR(VarDecl) curr_var_decl;
-} NameResCtx;
-
-void do_resolve_names(Ast *ast, SourceCode *code) {
-    NameResCtx ctx = {
+NameResCtx name_res_create(Ast *ast, SourceCode *code) {
+    return (NameResCtx){
         .scopes = stack_new(),
         .ast = ast,
         .code = code,
         .global_scope = NULL,
         .curr_fn.ptr = NULL,
         .curr_var_decl.ptr = NULL,
+        .failed = false,
+        .diags = new_diag_buffer(),
+    };
+}
+
+AstVisitor name_res_visitor(NameResCtx *ctx) {
+    return (AstVisitor){
+        .ctx = ctx,
+        .vtable =
+            {
+                .name = "resolve_names_dfs",
+                .enter = resolve_names_enter,
+                .exit = resolve_names_exit,
+            },
     };
-    ast_traverse_dfs(&ctx, ast,
-                     (EnterExitVTable){
-                         .enter = resolve_names_enter,
-                         .exit = resolve_names_exit,
-                     });
+}
+
+void name_res_finish(NameResCtx *ctx) {
     // Make sure traversal properly popped everything correctly.
     // NOTE: no cleanup is needed for the stack as segments are freed
     // once they are popped.
-    assert(ctx.scopes.top == NULL);
+    assert(ctx->scopes.top == NULL);
+    // Nothing was resolved from where the parser found an error, errors from
+    // before that (bodies can be parsed during the walk) would be all that's
+    // left of it
+    if (ctx->code->syntax_errors == 0) {
+        diag_buffer_replay(ctx->code, &ctx->diags);
+    }
+    diag_buffer_free(&ctx->diags);
 }
 
 static void manage_scopes_enter_hook(NameResCtx *ctx, AstNode *node);
@@ -53,7 +63,20 @@ static Scope *get_curr_scope(NameResCtx *ctx);
 
 static DfsCtrl resolve_names_enter(void *_ctx, AstNode *node) {
     NameResCtx *ctx = _ctx;
+    if (node->kind == NODE_COMP_STMT) {
+        do_materialize_body(ctx->ast, (CompStmt *)node);
+    }
     manage_scopes_enter_hook(ctx, node);
+    // Scopes are still pushed above so the exit hook stays balanced
+    if (error_budget_exhausted(ctx->code)) {
+        return DFS_CTRL_SKIP_SUBTREE;
+    }
+    // Where the parser found an error there are nodes missing. Still walked
+    // so the bodies left get parsed and report their errors.
+    if (ctx->code->syntax_errors != 0) {
+        return DFS_CTRL_KEEP_GOING;
+    }
+    DiagBuffer *outer = diag_buffer_attach(&ctx->diags);
     switch (node->kind) {
         case NODE_TYPE_DECL: {
             TypeDecl *td = (TypeDecl *)node;
@@ -87,6 +110,7 @@ static DfsCtrl resolve_names_enter(void *_ctx, AstNode *node) {
         default:
             break;
     }
+    diag_buffer_attach(outer);
     return DFS_CTRL_KEEP_GOING;
 }
 
@@ -123,9 +147,10 @@ static bool ref_can_resolve_to(NameResCtx *ctx, ScopeLookup lookup, Ident *ref,
 }
 
 static void resolve_ref(NameResCtx *ctx, ScopedIdent *scoped_ident) {
-    assert(da_length(scoped_ident->head.children) != 0);
+    Children children = ast_node_children(ctx->ast, &scoped_ident->head);
+    assert(children.len != 0);
 
-    Tok first = child_ident_at(&scoped_ident->head, 0)->token;
+    Tok first = child_ident_at(ctx->ast, &scoped_ident->head, 0)->token;
     if (first.t == T_EMPTY_STRING) {
         // Inferred reference
         return;
@@ -135,13 +160,15 @@ static void resolve_ref(NameResCtx *ctx, ScopedIdent *scoped_ident) {
     AstNode *h = &scoped_ident->head;
 
     Scope *scope = get_curr_scope(ctx);
-    for (u32 i = 0; i < da_length(h->children); i++) {
-        Ident *ident = child_ident_at(&scoped_ident->head, i);
+    for (u32 i = 0; i < children.len; i++) {
+        Ident *ident = child_ident_at(ctx->ast, &scoped_ident->head, i);
         u32 defined_at = ident->token.offset;
         string ident_text = ident->token.text;
 
         if (!scope) {
-            string supposed_scope = child_ident_at(h, i - 1)->token.text;
+            string supposed_scope =
+                child_ident_at(ctx->ast, h, i - 1)->token.text;
+            ctx->failed = true;
             sem_raisef(
                 ctx->ast, ctx->code, defined_at,
                 "lookup error: cannot resolve '{s}' in '{s}' as '{s}' does "
@@ -155,11 +182,13 @@ static void resolve_ref(NameResCtx *ctx, ScopedIdent *scoped_ident) {
                          i == 0 ? LOOKUP_MODE_LEXICAL : LOOKUP_MODE_DIRECT);
         if (!lookup.entry) {
             if (i != 0) {
-                string parent = child_ident_at(h, i - 1)->token.text;
+                string parent = child_ident_at(ctx->ast, h, i - 1)->token.text;
+                ctx->failed = true;
                 sem_raisef(ctx->ast, ctx->code, defined_at,
                            "lookup error: '{s}' not found inside scope '{s}'",
                            ident_text, parent);
             } else {
+                ctx->failed = true;
                 sem_raisef(ctx->ast, ctx->code, defined_at,
                            "lookup error: '{s}' not found in current scope",
                            ident_text);
@@ -170,10 +199,11 @@ static void resolve_ref(NameResCtx *ctx, ScopedIdent *scoped_ident) {
         // Prevent access to the identifiers inside of a function when
         // not inside its body
         if (lookup.entry->node->kind == NODE_FN_DECL &&
-            i != da_length(h->children) - 1) {
+            i != children.len - 1) {
             FnDecl *res_fn = (FnDecl *)lookup.entry->node;
             FnDecl *curr_fn = ctx->curr_fn.ptr;
             if (curr_fn == NULL || curr_fn != res_fn) {
+                ctx->failed = true;
                 sem_raisef(ctx->ast, ctx->code, defined_at, "access error",
                            "illegal access of scope '{s}'; cannot "
                            "access function scope outside of its body",
@@ -193,6 +223,7 @@ static void resolve_ref(NameResCtx *ctx, ScopedIdent *scoped_ident) {
         }
         if (!it) {
             // Reached the end, no candidate was valid.
+            ctx->failed = true;
             sem_raisef(ctx->ast, ctx->code, defined_at,
                        "error: could not resolve name");
         } else {
@@ -265,6 +296,7 @@ static void do_shadow_check(NameResCtx *ctx, DeclDesc decl_desc) {
     if (shadowed && shadowed->shadows == NULL) {
         u32 prev_decl_offset = shadowed->node->offset;
         Position pos = line_and_column(ctx->code->lines, prev_decl_offset);
+        ctx->failed = true;
         sem_raisef(
             ctx->ast, ctx->code, decl_desc.resolves_to->offset,
             "error: declaration shadows previous declaration at {s}:{i}:{i}",
@@ -4,15 +4,24 @@
 #include <stdio.h>
 #include <string.h>
 
-DA_DEFINE(toks, char)
+// Writes formatted output into `buf` while counting the total length, with a
+// NULL `buf` it only counts. This lets sem_raisef measure the message first
+// and then write it straight into the error arena.
+typedef struct {
+    char *buf;
+    size_t cap;  // Not including the NUL terminator
+    size_t len;
+} MsgWriter;
 
-void sem_raisef(Ast *ast, SourceCode *code, size_t offset, const char *fmt,
-                ...) {
-    char *toks = toks_create();
-
-    va_list args;
-    va_start(args, fmt);
+static void msg_write(MsgWriter *w, const char *s, size_t len) {
+    if (w->buf != NULL) {
+        memcpy(&w->buf[w->len], s, len);
+    }
+    w->len += len;
+}
 
+static void msg_vformat(MsgWriter *w, Ast *ast, const char *fmt,
+                        va_list args) {
     bool in_brc = false;
     const char *it = fmt;
     while (*it != '\0') {
@@ -38,36 +47,30 @@ void sem_raisef(Ast *ast, SourceCode *code, size_t offset, const char *fmt,
                             TypeId ty = va_arg(args, TypeId);
                             TypeRepr *tr = ast_type_repr(ast, ty);
                             assert(tr);
-                            static char type_txt[256];
-                            fmt_type(type_txt, 256, ast, *tr);
-                            size_t len = strlen(type_txt);
-                            for (size_t i = 0; i < len; i++) {
-                                toks_append(&toks, type_txt[i]);
+                            char *at = NULL;
+                            size_t size = 0;
+                            if (w->buf != NULL) {
+                                at = &w->buf[w->len];
+                                size = w->cap - w->len + 1;
                             }
+                            w->len += fmt_type(at, size, ast, *tr);
                             break;
                         }
                         case 's': {
                             string s = va_arg(args, string);
-                            for (size_t i = 0; i < s.len; i++) {
-                                toks_append(&toks, s.data[i]);
-                            }
+                            msg_write(w, s.data, s.len);
                             break;
                         }
                         case 'c': {
                             const char *s = va_arg(args, const char *);
-                            size_t len = strlen(s);
-                            for (size_t i = 0; i < len; i++) {
-                                toks_append(&toks, s[i]);
-                            }
+                            msg_write(w, s, strlen(s));
                             break;
                         }
                         case 'i': {
-                            static char buf[256];
-                            snprintf(buf, 256, "%ld", va_arg(args, u64));
-                            size_t len = strlen(buf);
-                            for (size_t i = 0; i < len; i++) {
-                                toks_append(&toks, buf[i]);
-                            }
+                            char buf[32];
+                            int len = snprintf(buf, sizeof(buf), "%ld",
+                                               va_arg(args, u64));
+                            msg_write(w, buf, len);
                             break;
                         }
                         default:
@@ -81,20 +84,31 @@ void sem_raisef(Ast *ast, SourceCode *code, size_t offset, const char *fmt,
                 break;
         }
 
-        toks_append(&toks, *it);
+        msg_write(w, it, 1);
         it++;
     }
+}
 
-    va_end(args);
+void sem_raisef(Ast *ast, SourceCode *code, size_t offset, const char *fmt,
+                ...) {
+    va_list args;
+    va_start(args, fmt);
+    va_list measure;
+    va_copy(measure, args);
+
+    MsgWriter w = {.buf = NULL, .cap = 0, .len = 0};
+    msg_vformat(&w, ast, fmt, measure);
+    va_end(measure);
 
-    size_t len = da_length(toks);
-    char *buf = arena_alloc(&code->error_arena, len, _Alignof(char));
-    memcpy(buf, toks, len);
+    // Arena memory is zeroed so the message is NUL terminated
+    w.cap = w.len;
+    w.buf = arena_alloc_any(diag_arena(code), w.cap + 1, _Alignof(char));
+    w.len = 0;
+    msg_vformat(&w, ast, fmt, args);
+    va_end(args);
 
     raise_semantic_error(code, (SemanticError){
                                    .at = offset,
-                                   .message = buf,
+                                   .message = w.buf,
                                });
-
-    toks_delete(toks);
 }
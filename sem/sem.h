@@ -1,9 +1,31 @@
 #include "../ast/ast.h"
 
 void do_build_symbol_table(Ast *ast);
-void do_resolve_names(Ast *ast, SourceCode *code);
-void do_check_types(Ast *ast, SourceCode *code);
+// Names and types are resolved together in one walk, then types are checked
+// in another. Returns false (nothing is checked) if a name or type didn't
+// resolve. Types aren't checked either if there were syntax errors.
+bool do_resolve_and_check_types(Ast *ast, SourceCode *code);
+// Parses a function body deferred by the parser and adds it to the symbol
+// table, called by the passes when they first reach it
+void do_materialize_body(Ast *ast, CompStmt *body);
 
 // Custom format strings using `{<char>}` format
 void sem_raisef(Ast *ast, SourceCode *code, size_t offset, const char *fmt,
                 ...);
+
+typedef struct {
+    Ast *ast;
+    Stack scopes;
+    Scope *global_scope;
+    SourceCode *code;
+    NULLABLE_PTR(FnDecl) curr_fn;
+    NULLABLE_PTR(VarDecl) curr_var_decl;
+    bool failed;  // Set once a name didn't resolve
+    // Our errors, only kept if the parser found none (see name_res_finish)
+    DiagBuffer diags;
+} NameResCtx;
+
+// Name resolution on its own, to be fused with the passes that follow it
+NameResCtx name_res_create(Ast *ast, SourceCode *code);
+AstVisitor name_res_visitor(NameResCtx *ctx);
+void name_res_finish(NameResCtx *ctx);
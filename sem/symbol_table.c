@@ -1,6 +1,7 @@
 #include <assert.h>
 
 #include "../ast/ast.h"
+#include "sem.h"
 
 static DfsCtrl build_symbol_table_enter(void *_ctx, AstNode *node);
 static DfsCtrl build_symbol_table_exit(void *_ctx, AstNode *node);
@@ -17,6 +18,7 @@ void do_build_symbol_table(Ast *ast) {
     };
     ast_traverse_dfs(&ctx, ast,
                      (EnterExitVTable){
+                         .name = "symbol_table_dfs",
                          .enter = build_symbol_table_enter,
                          .exit = build_symbol_table_exit,
                      });
@@ -26,6 +28,25 @@ void do_build_symbol_table(Ast *ast) {
     assert(ctx.scope_node_ctx.top == NULL);
 }
 
+void do_materialize_body(Ast *ast, CompStmt *body) {
+    if (!ast_is_deferred(&body->head)) {
+        return;
+    }
+    ast_materialize(ast, body);
+    // Fill in the scope created for the body when it was still empty
+    SymbolTableCtx ctx = {
+        .ast = ast,
+        .scope_node_ctx = stack_new(),
+    };
+    ast_traverse_dfs_from(&ctx, ast, &body->head,
+                          (EnterExitVTable){
+                              .name = "symbol_table_body_dfs",
+                              .enter = build_symbol_table_enter,
+                              .exit = build_symbol_table_exit,
+                          });
+    assert(ctx.scope_node_ctx.top == NULL);
+}
+
 // static void subscope_start(SymbolTableCtx *ctx, string symbol, AstNode
 // *node);
 static void enter_source_file(SymbolTableCtx *ctx, SourceFile *source_file);
@@ -214,8 +235,9 @@ static void exit_tagged_union_type(SymbolTableCtx *ctx,
 static void enter_enum_type(SymbolTableCtx *ctx, EnumType *en_type) {
     anon_subscope_start(ctx, &en_type->head);
     Idents *alts = en_type->alts;
-    for (size_t i = 0; i < da_length(alts->head.children); i++) {
-        Ident *id = child_ident_at(&alts->head, i);
+    Children children = ast_node_children(ctx->ast, &alts->head);
+    for (size_t i = 0; i < children.len; i++) {
+        Ident *id = child_ident_at(ctx->ast, &alts->head, i);
         scope_insert_enclosing(ctx, id->token.text, &id->head, NULL);
     }
 }
@@ -257,6 +279,13 @@ static void exit_if_stmt(SymbolTableCtx *ctx, IfStmt *if_stmt) {
 }
 
 static void enter_comp_stmt(SymbolTableCtx *ctx, CompStmt *comp_stmt) {
+    // A deferred body already got its scope the first time round
+    if (ast_scope_get(ctx->ast, &comp_stmt->head) != NULL) {
+        AstNode **entry = stack_push(&ctx->scope_node_ctx, sizeof(AstNode *),
+                                     _Alignof(AstNode *));
+        *entry = &comp_stmt->head;
+        return;
+    }
     anon_subscope_start(ctx, &comp_stmt->head);
 }
 
@@ -0,0 +1,413 @@
+// For mkdir, mmap, readdir and friends
+#define _POSIX_C_SOURCE 200809L
+
+// On disk cache of parsed trees.
+//
+// Entries are named after a 128 bit hash of the source text together with
+// everything else that changes what the parser produces: the options, the
+// entry and image formats, and the compiler binary itself (its size, inode
+// and mtime) so a rebuilt compiler never reads trees written by an old one.
+// A hit isn't checked against the source, the key is all there is to go on,
+// so it is a full 128 bit hash (MurmurHash3) of the text.
+//
+// An entry holds every error raised while parsing, from before raise_error
+// applies its limits, followed by the tree as an AstImage (see
+// ast/image.c). A hit replays the errors, so what is kept and reported is
+// the same as for a fresh parse, and loads the tree from the image instead of
+// lexing and parsing.
+//
+// Entries are written to a temporary file and renamed into place, so
+// compilers sharing a cache never see half an entry. Hits bump the mtime of
+// an entry, and when a new entry takes the cache over its size limit the
+// ones used least recently are removed. Reading the whole directory for that
+// is only done on the first store and when the running size says the cache
+// is over the limit (see ParseCache), not on every store.
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/trace.h"
+#include "syn.h"
+
+// Bump when the parser changes what it produces for the same input
+#define PARSE_CACHE_VERSION 1
+
+static const char entry_magic[8] = "IOTAPC";
+
+typedef struct {
+    char magic[8];
+    u32 version;
+    u32 error_count;
+    u64 key[2];
+    u64 errors_len;
+    // Where the image starts, it runs to the end of the entry
+    u64 image_at;
+} EntryHeader;
+
+// Followed by the strings of the error, see error_string_count
+typedef struct {
+    u32 t;
+    u32 lexical_t;
+    u32 at;
+    u32 invalid_char;
+    u32 lens[2];
+} EntryError;
+
+ParseCache parse_cache_create(const char *dir, u64 max_size) {
+    ParseCache cache = {.dir = dir, .max_size = max_size};
+    struct stat st;
+    if (stat("/proc/self/exe", &st) == 0) {
+        u64 id[] = {st.st_size, st.st_ino, st.st_mtim.tv_sec,
+                    st.st_mtim.tv_nsec};
+        u64 hash[2];
+        hash_bytes(id, sizeof(id), 0, hash);
+        cache.compiler_id = hash[0];
+    }
+    return cache;
+}
+
+static void cache_key(const ParseCtx *c, const ParseCache *cache, u64 *key) {
+    const SourceCode *code = c->lex.source;
+    u64 config[] = {
+        PARSE_CACHE_VERSION, AST_IMAGE_VERSION, cache->compiler_id,
+        code->max_errors,    code->max_line_errors,
+        c->max_expr_depth,
+    };
+    u64 seed[2];
+    hash_bytes(config, sizeof(config), 0, seed);
+    hash_bytes(code->text.data, code->text.len, seed[0], key);
+}
+
+static char *entry_path(Arena *a, const ParseCache *cache, const u64 *key) {
+    return allocf(a, "%s/%016llx%016llx.ast", cache->dir,
+                  (unsigned long long)key[0], (unsigned long long)key[1]);
+}
+
+static u32 error_string_count(ErrorKind t, LexicalErrorKind lexical_t) {
+    switch (t) {
+        case ERROR_SYNTAX:
+            return 2;
+        case ERROR_LEXICAL:
+            return lexical_t == LEXICAL_ERROR_TEXT ? 1 : 0;
+        case ERROR_SEMANTIC:
+            return 1;
+    }
+    return 0;
+}
+
+static void errors_encode(StrBuf *out, Errors errors) {
+    for (u32 i = 0; i < errors.len; i++) {
+        Error error = errors.items[i];
+        EntryError rec = {.t = error.t};
+        const char *strings[2] = {0};
+        switch (error.t) {
+            case ERROR_SYNTAX:
+                rec.at = error.syntax_error.at;
+                strings[0] = error.syntax_error.expected;
+                strings[1] = error.syntax_error.got;
+                break;
+            case ERROR_LEXICAL:
+                rec.at = error.lexical_error.at;
+                rec.lexical_t = error.lexical_error.t;
+                if (error.lexical_error.t == LEXICAL_ERROR_TEXT) {
+                    strings[0] = error.lexical_error.text;
+                } else {
+                    rec.invalid_char = (u8)error.lexical_error.invalid_char;
+                }
+                break;
+            case ERROR_SEMANTIC:
+                rec.at = error.semantic_error.at;
+                strings[0] = error.semantic_error.message;
+                break;
+        }
+        u32 count = error_string_count(rec.t, rec.lexical_t);
+        for (u32 s = 0; s < count; s++) {
+            rec.lens[s] = strings[s] != NULL ? strlen(strings[s]) : 0;
+        }
+        strbuf_append(out, STRING_REF(rec));
+        for (u32 s = 0; s < count; s++) {
+            strbuf_append(out, (string){(char *)strings[s], rec.lens[s]});
+        }
+    }
+}
+
+// Decodes the errors in `data` into `buf`, false if they don't decode
+static bool errors_decode(DiagBuffer *buf, const u8 *data, u64 len,
+                          u32 count, u32 text_len) {
+    u64 at = 0;
+    for (u32 i = 0; i < count; i++) {
+        EntryError rec;
+        if (len - at < sizeof(rec)) {
+            return false;
+        }
+        memcpy(&rec, data + at, sizeof(rec));
+        at += sizeof(rec);
+        if (rec.t > ERROR_SEMANTIC || rec.lexical_t > LEXICAL_ERROR_TEXT ||
+            rec.at > text_len) {
+            return false;
+        }
+
+        const char *strings[2] = {0};
+        for (u32 s = 0; s < error_string_count(rec.t, rec.lexical_t); s++) {
+            if (len - at < rec.lens[s]) {
+                return false;
+            }
+            char *copy = arena_alloc(&buf->arena, rec.lens[s] + 1, 1);
+            memcpy(copy, data + at, rec.lens[s]);
+            copy[rec.lens[s]] = '\0';
+            strings[s] = copy;
+            at += rec.lens[s];
+        }
+
+        Error error = {.t = rec.t};
+        switch (error.t) {
+            case ERROR_SYNTAX:
+                error.syntax_error = (SyntaxError){
+                    .at = rec.at,
+                    .expected = strings[0],
+                    .got = strings[1],
+                };
+                break;
+            case ERROR_LEXICAL:
+                error.lexical_error = (LexicalError){
+                    .at = rec.at,
+                    .t = rec.lexical_t,
+                };
+                if (rec.lexical_t == LEXICAL_ERROR_TEXT) {
+                    error.lexical_error.text = strings[0];
+                } else {
+                    error.lexical_error.invalid_char = (char)rec.invalid_char;
+                }
+                break;
+            case ERROR_SEMANTIC:
+                error.semantic_error = (SemanticError){
+                    .at = rec.at,
+                    .message = strings[0],
+                };
+                break;
+        }
+        APPEND(&buf->errors, error);
+    }
+    return at == len;
+}
+
+// Least recently used goes by mtime. The time the kernel stamps files with
+// is only as fine as the scheduler tick, too coarse to tell entries used one
+// after the other apart, so the time is set explicitly.
+static void touch(int fd) {
+    struct timespec now[2];
+    if (clock_gettime(CLOCK_REALTIME, &now[0]) == 0) {
+        now[1] = now[0];
+        (void)futimens(fd, now);
+    }
+}
+
+// Looks for the entry at `path`, on a hit its errors are raised and the
+// tree is loaded into `root` (unless `c->syntax_only` is set)
+static bool cache_load(ParseCtx *c, const char *path, const u64 *key,
+                       SourceFile **root) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (u64)st.st_size >= sizeof(EntryHeader)) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    touch(fd);
+    close(fd);
+
+    SourceCode *code = c->lex.source;
+    u64 len = st.st_size;
+    const EntryHeader *h = data;
+    AstImage img = {0};
+    DiagBuffer errors = new_diag_buffer();
+    bool ok = memcmp(h->magic, entry_magic, sizeof(h->magic)) == 0 &&
+              h->version == PARSE_CACHE_VERSION && h->key[0] == key[0] &&
+              h->key[1] == key[1] && h->errors_len <= len - sizeof(*h) &&
+              h->image_at >= sizeof(*h) + h->errors_len &&
+              h->image_at <= len &&
+              ast_image_open(&img, (u8 *)data + h->image_at,
+                             len - h->image_at) &&
+              errors_decode(&errors, (u8 *)data + sizeof(*h), h->errors_len,
+                            h->error_count, code->text.len);
+
+    *root = NULL;
+    if (ok && !c->syntax_only) {
+        *root = (SourceFile *)ast_image_load(c->ast, &img, code);
+        ok = *root != NULL && (*root)->head.kind == NODE_SOURCE_FILE;
+    }
+    munmap(data, len);
+
+    if (ok) {
+        for (u32 i = 0; i < errors.errors.len; i++) {
+            c->syntax_errors += errors.errors.items[i].t == ERROR_SYNTAX;
+        }
+        diag_buffer_replay(code, &errors);
+        if (*root != NULL && c->ast->root == NULL) {
+            c->ast->root = &(*root)->head;
+        }
+    }
+    diag_buffer_free(&errors);
+    return ok;
+}
+
+typedef struct {
+    char *path;
+    u64 size;
+    struct timespec used;
+} CacheFile;
+
+typedef struct {
+    CacheFile *items;
+    u32 len;
+    u32 cap;
+} CacheFiles;
+
+static int least_recent_first(const void *a, const void *b) {
+    const CacheFile *x = a;
+    const CacheFile *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    if (x->used.tv_nsec != y->used.tv_nsec) {
+        return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool is_entry(const char *name) {
+    usize len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".ast") == 0;
+}
+
+// Removes the least recently used entries (apart from `keep`) until the
+// cache fits in its limit, returns the size of what is left
+static u64 cache_evict(Arena *a, ParseCache *cache, const char *keep) {
+    cache->scans++;
+    DIR *dir = opendir(cache->dir);
+    if (dir == NULL) {
+        return 0;
+    }
+    CacheFiles files = {0};
+    u64 total = 0;
+    for (struct dirent *it = readdir(dir); it != NULL; it = readdir(dir)) {
+        if (!is_entry(it->d_name)) {
+            continue;
+        }
+        char *path = allocf(a, "%s/%s", cache->dir, it->d_name);
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            APPEND(&files, ((CacheFile){path, st.st_size, st.st_mtim}));
+            total += st.st_size;
+        }
+    }
+    closedir(dir);
+
+    qsort(files.items, files.len, sizeof(CacheFile), least_recent_first);
+    for (u32 i = 0; i < files.len && total > cache->max_size; i++) {
+        if (strcmp(files.items[i].path, keep) != 0 &&
+            (unlink(files.items[i].path) == 0 || errno == ENOENT)) {
+            total -= files.items[i].size;
+        }
+    }
+    if (files.items != NULL) {
+        free(files.items);
+    }
+    return total;
+}
+
+static void cache_store(ParseCtx *c, ParseCache *cache, SourceFile *root,
+                        Errors errors, const u64 *key, Arena *a) {
+    TRACE_BEGIN("cache_store");
+    StrBuf encoded = {0};
+    errors_encode(&encoded, errors);
+    EntryHeader h = {
+        .version = PARSE_CACHE_VERSION,
+        .error_count = errors.len,
+        .key = {key[0], key[1]},
+        .errors_len = encoded.len,
+        .image_at = (sizeof(h) + encoded.len + 7) / 8 * 8,
+    };
+    memcpy(h.magic, entry_magic, sizeof(h.magic));
+
+    (void)mkdir(cache->dir, 0777);
+    char *path = entry_path(a, cache, key);
+    char *tmp = allocf(a, "%s.%ld.tmp", path, (long)getpid());
+    FILE *fs = fopen(tmp, "wb");
+    bool ok = fs != NULL;
+    long size = 0;
+    if (ok) {
+        static const u8 zeros[8] = {0};
+        u64 pad = h.image_at - sizeof(h) - encoded.len;
+        ok = fwrite(&h, sizeof(h), 1, fs) == 1 &&
+             fwrite(encoded.items, 1, encoded.len, fs) == encoded.len &&
+             fwrite(zeros, 1, pad, fs) == pad &&
+             ast_image_write(c->ast, &root->head, fs) && fflush(fs) == 0;
+        if (ok) {
+            touch(fileno(fs));
+            size = ftell(fs);
+        }
+        ok = fclose(fs) == 0 && ok && size >= 0;
+    }
+    if (ok && rename(tmp, path) == 0) {
+        cache->size += size;
+        if (cache->max_size != 0 &&
+            (!cache->size_known || cache->size > cache->max_size)) {
+            cache->size = cache_evict(a, cache, path);
+            cache->size_known = true;
+        }
+    } else if (fs != NULL) {
+        (void)unlink(tmp);
+    }
+    strbuf_free(&encoded);
+    TRACE_END("cache_store");
+}
+
+SourceFile *parse_source_file_cached(ParseCtx *c, ParseCache *cache) {
+    if (c->lazy_bodies || c->events != NULL) {
+        return parse_source_file(c);
+    }
+    TRACE_BEGIN("parse_source_file_cached");
+    Arena scratch = new_arena();
+    u64 key[2];
+    cache_key(c, cache, key);
+
+    SourceFile *root = NULL;
+    if (cache_load(c, entry_path(&scratch, cache, key), key, &root)) {
+        cache->hits++;
+        arena_free(&scratch);
+        TRACE_END("parse_source_file_cached");
+        return root;
+    }
+
+    cache->misses++;
+    SourceCode *code = c->lex.source;
+    Errors log = {0};
+    code->log = &log;
+    root = parse_source_file(c);
+    code->log = NULL;
+    // Without a tree there's nothing to store
+    if (!c->syntax_only) {
+        cache_store(c, cache, root, log, key, &scratch);
+    }
+    if (log.items != NULL) {
+        free(log.items);
+    }
+    arena_free(&scratch);
+    TRACE_END("parse_source_file_cached");
+    return root;
+}
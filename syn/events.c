@@ -0,0 +1,241 @@
+// Event stream interface to the parser.
+//
+// In event mode the parser doesn't link nodes into a tree, instead every time
+// a node or token would be added as a child it gets recorded here. Once a
+// top-level declaration is parsed the records are turned into open/token/close
+// events in tree order. The events can't come straight from begin_node and
+// end_node as expressions get restructured while they are being parsed (see
+// expr_with_bpow), so they don't nest until the declaration is done.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "syn.h"
+
+static void emit(ParseEvents *events, ParseEvent event) {
+    events->sink.emit(events->sink.ctx, &event);
+}
+
+void parse_source_file_events(ParseCtx *c, ParseEventSink sink) {
+    ParseEvents events = {.sink = sink};
+    c->events = &events;
+    (void)parse_source_file(c);
+    c->events = NULL;
+    assert(events.pending.len == 0);
+    if (events.pending.items != NULL) {
+        free(events.pending.items);
+    }
+    if (events.order.items != NULL) {
+        free(events.order.items);
+    }
+}
+
+void parse_events_open(ParseEvents *events, AstNode *node) {
+    emit(events, (ParseEvent){.t = PARSE_EVENT_OPEN, .node = node});
+}
+
+void parse_events_close(ParseEvents *events, AstNode *node) {
+    // Drop the record of the node being added to its parent, it was already
+    // opened so it is not emitted again
+    u32 len = events->pending.len;
+    if (len != 0 && events->pending.items[len - 1].child.t == CHILD_NODE &&
+        events->pending.items[len - 1].child.node == node) {
+        events->pending.len--;
+    }
+    emit(events, (ParseEvent){.t = PARSE_EVENT_CLOSE, .node = node});
+}
+
+void parse_events_child(ParseEvents *events, AstNode *parent, Child child) {
+    APPEND(&events->pending, (PendingChild){.parent = parent, .child = child});
+}
+
+void parse_events_name_last(ParseEvents *events, AstNode *parent,
+                            const char *name) {
+    assert(events->pending.len != 0);
+    PendingChild *last = &events->pending.items[events->pending.len - 1];
+    assert(last->parent == parent);
+    last->child.name.ptr = name;
+}
+
+void parse_events_reparent(ParseEvents *events, AstNode *node,
+                           AstNode *new_parent) {
+    // The node was most likely just added, so search from the back
+    for (u32 i = events->pending.len; i-- > 0;) {
+        PendingChild *it = &events->pending.items[i];
+        if (it->parent != NULL && it->child.t == CHILD_NODE &&
+            it->child.node == node) {
+            it->parent = NULL;
+            break;
+        }
+    }
+    parse_events_child(events, new_parent, child_node_create(node));
+}
+
+static int order_cmp(const void *a, const void *b) {
+    const PendingOrder *x = a;
+    const PendingOrder *y = b;
+    if (x->parent != y->parent) {
+        return x->parent < y->parent ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void emit_children(ParseEvents *events, AstNode *parent) {
+    PendingOrder *order = events->order.items;
+    // Find the first child of `parent`, the children follow it in order
+    u32 lo = 0;
+    u32 hi = events->order.len;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        if (order[mid].parent < (uptr)parent) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (u32 i = lo; i < events->order.len && order[i].parent == (uptr)parent;
+         i++) {
+        Child child = events->pending.items[order[i].index].child;
+        switch (child.t) {
+            case CHILD_TOKEN:
+                emit(events, (ParseEvent){
+                                 .t = PARSE_EVENT_TOKEN,
+                                 .name = child.name.ptr,
+                                 .token = child.token,
+                             });
+                break;
+            case CHILD_NODE:
+                emit(events, (ParseEvent){
+                                 .t = PARSE_EVENT_OPEN,
+                                 .name = child.name.ptr,
+                                 .node = child.node,
+                             });
+                emit_children(events, child.node);
+                emit(events, (ParseEvent){
+                                 .t = PARSE_EVENT_CLOSE,
+                                 .node = child.node,
+                             });
+                break;
+        }
+    }
+}
+
+void parse_events_flush(ParseEvents *events, AstNode *root) {
+    // Group the children by parent, keeping the order they were added in
+    events->order.len = 0;
+    for (u32 i = 0; i < events->pending.len; i++) {
+        AstNode *parent = events->pending.items[i].parent;
+        if (parent != NULL) {
+            APPEND(&events->order,
+                   (PendingOrder){.parent = (uptr)parent, .index = i});
+        }
+    }
+    qsort(events->order.items, events->order.len, sizeof(PendingOrder),
+          order_cmp);
+    emit_children(events, root);
+    events->pending.len = 0;
+}
+
+static void ast_builder_emit(void *ctx, const ParseEvent *event) {
+    AstBuilder *b = ctx;
+    AstNode *top = b->open.len != 0 ? b->open.items[b->open.len - 1] : NULL;
+    switch (event->t) {
+        case PARSE_EVENT_OPEN:
+            if (top != NULL) {
+                ast_node_child_add(
+                    b->ast, top,
+                    child_node_named_create(event->name, event->node));
+                ast_node_parent_set(event->node, top);
+            }
+            APPEND(&b->open, event->node);
+            break;
+        case PARSE_EVENT_TOKEN:
+            assert(top != NULL);
+            ast_node_child_add(
+                b->ast, top,
+                child_token_named_create(event->name, event->token));
+            break;
+        case PARSE_EVENT_CLOSE:
+            assert(top == event->node);
+            ast_node_close(b->ast, top);
+            b->open.len--;
+            break;
+    }
+}
+
+ParseEventSink ast_builder_sink(AstBuilder *b) {
+    return (ParseEventSink){
+        .emit = ast_builder_emit,
+        .ctx = b,
+        .keep_nodes = true,
+    };
+}
+
+void ast_builder_free(AstBuilder *b) {
+    if (b->open.items != NULL) {
+        free(b->open.items);
+    }
+}
+
+static void event_dumper_emit(void *ctx, const ParseEvent *event) {
+    EventDumper *d = ctx;
+    // Children are indented one past their parent
+    u32 level = 0;
+    if (d->levels.len != 0) {
+        level = d->levels.items[d->levels.len - 1] + 1;
+    }
+    u32 width = d->indent_width;
+
+    if (event->t != PARSE_EVENT_CLOSE && d->open_brace) {
+        fprintf(d->fs, "\n");
+    }
+    switch (event->t) {
+        case PARSE_EVENT_OPEN: {
+            AstNode *n = event->node;
+            if (event->name != NULL) {
+                fprintf(d->fs, "%*s%s:\n", level * width, "", event->name);
+                level++;
+            }
+            fprintf(d->fs, "%*s%s%s {", level * width, "",
+                    node_kind_to_string(n->kind),
+                    n->has_error ? "(error!)" : "");
+            APPEND(&d->levels, level);
+            d->open_brace = true;
+            break;
+        }
+        case PARSE_EVENT_TOKEN:
+            fprintf(d->fs, "%*s", level * width, "");
+            if (event->name != NULL) {
+                fprintf(d->fs, "%s=", event->name);
+            }
+            fprintf(d->fs, "'%.*s'\n", event->token.text.len,
+                    event->token.text.data);
+            d->open_brace = false;
+            break;
+        case PARSE_EVENT_CLOSE:
+            assert(d->levels.len != 0);
+            level = d->levels.items[--d->levels.len];
+            if (d->open_brace) {
+                fprintf(d->fs, "}\n");
+            } else {
+                fprintf(d->fs, "%*s}\n", level * width, "");
+            }
+            d->open_brace = false;
+            break;
+    }
+}
+
+ParseEventSink event_dumper_sink(EventDumper *d) {
+    return (ParseEventSink){
+        .emit = event_dumper_emit,
+        .ctx = d,
+        .keep_nodes = false,
+    };
+}
+
+void event_dumper_free(EventDumper *d) {
+    if (d->levels.items != NULL) {
+        free(d->levels.items);
+    }
+}
@@ -0,0 +1,279 @@
+// For sysconf and pthreads
+#define _POSIX_C_SOURCE 200809L
+
+// Parallel parsing of top-level declarations.
+//
+// Top-level declarations are syntactically independent, so once we know where
+// each one starts they can be parsed on their own. A quick scan over the
+// tokens splits the input at every `let`, `var`, `fun` and `type` keyword at
+// bracket depth 0 that is first or right after a `;` or `}` at depth 0 (so
+// not the `fun` of a function type). Then each range is parsed by a worker
+// thread into its own arena and Ast with errors going to a per-thread
+// DiagBuffer.
+//
+// If anything looks off (unbalanced brackets, any error at all, a range not
+// parsing to exactly one declaration) the results are thrown away and the
+// caller falls back to the serial parser, which reports errors as usual.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "../common/trace.h"
+#include "syn.h"
+
+typedef struct {
+    u32 start;
+    u32 end;
+} DeclRange;
+
+typedef struct {
+    DeclRange *items;
+    u32 len;
+    u32 cap;
+} DeclRanges;
+
+typedef struct {
+    Decl *decl;
+    u32 worker;
+    bool ok;
+} DeclResult;
+
+typedef struct {
+    const ParseCtx *parent;
+    DeclRanges ranges;
+    DeclResult *results;
+    atomic_uint next;
+    atomic_bool failed;  // Set once any range fails, the rest are skipped
+} ParseJob;
+
+typedef struct {
+    ParseJob *job;
+    u32 index;
+    Arena arena;
+    Ast ast;  // Only holds the tables indexed by node id
+    DiagBuffer diags;
+    pthread_t thread;
+} Worker;
+
+// Below this many declarations threads are not worth it
+#define MIN_PARALLEL_DECLS 2
+
+static bool scan_decl_ranges(const ParseCtx *c, DeclRanges *ranges) {
+    // The lexer can raise errors, those are left to the serial parser
+    DiagBuffer scratch = new_diag_buffer();
+    DiagBuffer *outer = diag_buffer_attach(&scratch);
+
+    Lexer lex = c->lex;
+    s32 depth = 0;
+    // Where a declaration can start
+    bool at_start = true;
+    bool ok = true;
+    for (Tok tok = lex_peek(&lex); ok && tok.t != T_EOF; tok = lex_peek(&lex)) {
+        bool next_at_start = false;
+        switch (tok.t) {
+            case T_LPAR:
+            case T_LBRK:
+            case T_LBRC:
+                depth++;
+                break;
+            case T_RPAR:
+            case T_RBRK:
+                ok = --depth >= 0;
+                break;
+            case T_RBRC:
+                ok = --depth >= 0;
+                next_at_start = depth == 0;
+                break;
+            case T_SCLN:
+                next_at_start = depth == 0;
+                break;
+            case T_LET:
+            case T_VAR:
+            case T_FUN:
+            case T_TYPE:
+                if (depth != 0 || !at_start) {
+                    break;
+                }
+                if (ranges->len != 0) {
+                    ranges->items[ranges->len - 1].end = tok.offset;
+                }
+                APPEND(ranges, (DeclRange){.start = tok.offset});
+                break;
+            case T_CMNT:
+                next_at_start = at_start;
+                break;
+            default:
+                break;
+        }
+        // Anything but comments before the first declaration is an error
+        ok = ok && (ranges->len != 0 || tok.t == T_CMNT);
+        at_start = next_at_start;
+        lex_consume(&lex);
+    }
+    if (ranges->len != 0) {
+        ranges->items[ranges->len - 1].end = c->lex.source->text.len;
+    }
+
+    diag_buffer_attach(outer);
+    ok = ok && depth == 0 && scratch.errors.len == 0;
+    diag_buffer_free(&scratch);
+    return ok;
+}
+
+static DeclResult parse_range(Worker *w, DeclRange range) {
+    const ParseCtx *parent = w->job->parent;
+
+    // The worker sees the end of its range as EOF, offsets stay the same as
+    // the text is not moved
+    SourceCode source = *parent->lex.source;
+    source.text.len = range.end;
+    // Any error means we fall back to the serial parser, so mark the error
+    // budget as spent to make the parser give up on the first error instead
+    // of trying to recover.
+    source.max_errors = 1;
+    source.error_count = 1;
+
+    ParseCtx c = {
+        .lex =
+            {
+                .source = &source,
+                .cursor = range.start,
+                .lookahead = {.t = T_EMPTY},
+            },
+        .ast = &w->ast,
+        .current = NULL,
+        .panic_mode = false,
+        .jobs = 1,
+        .lazy_bodies = parent->lazy_bodies,
+        .max_expr_depth = parent->max_expr_depth,
+    };
+
+    u32 errors = w->diags.errors.len;
+    Decl *decl = parse_decl(&c);
+
+    // Only comments may be left over
+    Tok tok = lex_peek(&c.lex);
+    while (tok.t == T_CMNT) {
+        lex_consume(&c.lex);
+        tok = lex_peek(&c.lex);
+    }
+
+    return (DeclResult){
+        .decl = decl,
+        .worker = w->index,
+        .ok = tok.t == T_EOF && w->diags.errors.len == errors &&
+              !decl->head.has_error,
+    };
+}
+
+static void *worker_run(void *arg) {
+    Worker *w = arg;
+    ParseJob *job = w->job;
+    // Worker 0 is the calling thread, its buffer is put back after
+    DiagBuffer *outer = diag_buffer_attach(&w->diags);
+    TRACE_BEGIN("parse_decls_worker");
+    while (!atomic_load(&job->failed)) {
+        u32 i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->ranges.len) {
+            break;
+        }
+        job->results[i] = parse_range(w, job->ranges.items[i]);
+        if (!job->results[i].ok) {
+            atomic_store(&job->failed, true);
+        }
+    }
+    TRACE_END("parse_decls_worker");
+    diag_buffer_attach(outer);
+    return NULL;
+}
+
+bool parse_decls_parallel(ParseCtx *c, Decls *decls) {
+    DeclRanges ranges = {0};
+    if (!scan_decl_ranges(c, &ranges) || ranges.len < MIN_PARALLEL_DECLS) {
+        if (ranges.items != NULL) {
+            free(ranges.items);
+        }
+        return false;
+    }
+
+    TRACE_BEGIN("parse_decls_parallel");
+
+    ParseJob job = {
+        .parent = c,
+        .ranges = ranges,
+        .results = calloc(ranges.len, sizeof(DeclResult)),
+    };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+    if (job.results == NULL) {
+        panic("out of memory");
+    }
+
+    u32 nworkers = c->jobs < ranges.len ? c->jobs : ranges.len;
+    Worker *workers = calloc(nworkers, sizeof(Worker));
+    if (workers == NULL) {
+        panic("out of memory");
+    }
+    // Worker 0 is the calling thread
+    for (u32 i = 0; i < nworkers; i++) {
+        workers[i].job = &job;
+        workers[i].index = i;
+        workers[i].arena = new_arena();
+        workers[i].ast = ast_create(&workers[i].arena);
+        workers[i].ast.root = c->ast->root;
+        workers[i].ast.parse_deferred = c->ast->parse_deferred;
+        workers[i].ast.deferred_max_expr_depth =
+            c->ast->deferred_max_expr_depth;
+        workers[i].ast.source = c->ast->source;
+        workers[i].diags = new_diag_buffer();
+        if (i != 0 && pthread_create(&workers[i].thread, NULL, worker_run,
+                                     &workers[i]) != 0) {
+            panic("failed to create parser thread");
+        }
+    }
+    worker_run(&workers[0]);
+    for (u32 i = 1; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    bool ok = !atomic_load(&job.failed);
+
+    // Anything not adopted is freed along with the worker's Ast
+    for (u32 i = 0; ok && i < ranges.len; i++) {
+        Decl *decl = job.results[i].decl;
+        Ast *from = &workers[job.results[i].worker].ast;
+        // The threads handed out ids on their own
+        ast_subtree_adopt(c->ast, from, &decl->head);
+        ast_node_child_add(c->ast, &decls->head,
+                           child_node_create(&decl->head));
+        ast_node_parent_set(&decl->head, &decls->head);
+        // Only errorless declarations make it here
+        decl->head.reusable = true;
+    }
+
+    for (u32 i = 0; i < nworkers; i++) {
+        if (ok) {
+            arena_adopt(c->ast->arena, &workers[i].arena);
+        }
+        ast_delete(workers[i].ast);
+        arena_free(&workers[i].arena);
+        diag_buffer_free(&workers[i].diags);
+    }
+
+    if (ok) {
+        c->lex.cursor = c->lex.source->text.len;
+    }
+
+    free(workers);
+    free(job.results);
+    free(ranges.items);
+    TRACE_END("parse_decls_parallel");
+    return ok;
+}
+
+u32 parse_default_jobs(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
@@ -0,0 +1,325 @@
+// Incremental reparsing.
+//
+// An edit can only change the parse of the list elements (top-level
+// declarations, or statements in a block) it touches. Starting at the first of
+// those, elements are parsed again until the parser is back in step with the
+// previous tree: at the start of an old element past the edit, in the same
+// state. From there on the old elements are kept. If the edit is inside a
+// single function body this is done with the statements of the innermost
+// block around the edit instead, falling back to the enclosing list when the
+// block doesn't end where it did before.
+//
+// Old elements that had errors are always parsed again so their errors get
+// raised against the new source. Everything else that is kept isn't even
+// looked at, its offsets are fixed up once it is next walked (see
+// ast_node_shift), so the work done here depends on the size of the edit and
+// not the size of the file.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../common/trace.h"
+#include "syn.h"
+
+// So small trees aren't thrown away every few edits
+#define GARBAGE_SLACK 4096
+
+static bool too_much_garbage(Ast *ast) {
+    u32 live_nodes = ast->node_count - ast->detached_count;
+    u32 live_children = ast->child_pool.len - ast->dropped_children;
+    return ast->detached_count > live_nodes + GARBAGE_SLACK ||
+           ast->dropped_children > live_children + GARBAGE_SLACK;
+}
+
+typedef struct {
+    ParseCtx *c;
+    // Tokens in the old text from `from` up to `to` (inclusive) could lex
+    // differently now, they touch the edit
+    u32 from;
+    u32 to;
+    s32 delta;
+    DiagBuffer diags;
+} Reparse;
+
+typedef struct {
+    AstNode *node;
+    u32 offset;  // In the old text
+    bool dirty;  // Has to be parsed again
+    bool kept;
+} OldElement;
+
+// Where an offset in the old text not touching the edit is now
+static u32 moved(Reparse *r, u32 offset) {
+    return offset > r->to ? offset + r->delta : offset;
+}
+
+static u32 old_offset(Reparse *r, AstNode *node) {
+    return node->offset + ast_node_pending_shift(r->c->ast, node);
+}
+
+static Tok skip_comments(Lexer *lex) {
+    Tok tok = lex_peek(lex);
+    while (tok.t == T_CMNT) {
+        lex_consume(lex);
+        tok = lex_peek(lex);
+    }
+    return tok;
+}
+
+// The block at the end of `node` (e.g. a function body), if there is one and
+// the edit is inside of it
+static CompStmt *block_around_edit(Reparse *r, AstNode *node) {
+    while (node->kind != NODE_COMP_STMT) {
+        Children children = ast_node_children(r->c->ast, node);
+        u32 len = children.len;
+        if (len == 0 || children.items[len - 1].t != CHILD_NODE) {
+            return NULL;
+        }
+        node = children.items[len - 1].node;
+    }
+    CompStmt *block = (CompStmt *)node;
+    if (block->end == 0 || block->deferred_end != 0) {
+        return NULL;
+    }
+    s32 shift = ast_node_pending_shift(r->c->ast, node);
+    // Both braces are left alone
+    return node->offset + shift < r->from && r->to + 1 < block->end + shift
+               ? block
+               : NULL;
+}
+
+static bool reparse_list(Reparse *r, AstNode *list, u32 end, bool block);
+
+// Reparses just the statements in the block at the end of `elem`
+static bool reparse_block_of(Reparse *r, AstNode *elem, CompStmt *block) {
+    Ast *ast = r->c->ast;
+    // Offsets of the block and everything leading to it need to be right in
+    // the old text
+    for (AstNode *it = elem;;) {
+        ast_node_settle_shallow(ast, it);
+        if (it == &block->head) {
+            break;
+        }
+        Children children = ast_node_children(ast, it);
+        it = children.items[children.len - 1].node;
+    }
+    if (!reparse_list(r, &block->head, block->end - 1, true)) {
+        return false;
+    }
+    block->end += r->delta;
+    Children stmts = ast_node_children(ast, &block->head);
+    for (size_t i = 0; i < stmts.len; i++) {
+        elem->reusable &= stmts.items[i].node->reusable;
+    }
+    return true;
+}
+
+static bool reparse_list(Reparse *r, AstNode *list, u32 end, bool block) {
+    ParseCtx *c = r->c;
+    Ast *ast = c->ast;
+    Children old_children = ast_node_children(ast, list);
+    u32 len = old_children.len;
+    OldElement *old = calloc(len != 0 ? len : 1, sizeof(OldElement));
+    if (old == NULL) {
+        panic("out of memory");
+    }
+    for (u32 i = 0; i < len; i++) {
+        old[i].node = old_children.items[i].node;
+        old[i].offset = old_offset(r, old[i].node);
+    }
+    // Each element goes up to the start of the next one
+    u32 touched = 0;
+    u32 dirty = 0;
+    u32 first_touched = 0;
+    for (u32 i = 0; i < len; i++) {
+        u32 next = i + 1 != len ? old[i + 1].offset : end;
+        bool touches = old[i].offset <= r->to && next > r->from;
+        old[i].dirty = touches || !old[i].node->reusable;
+        if (touches && touched++ == 0) {
+            first_touched = i;
+        }
+        dirty += old[i].dirty;
+    }
+    // Text between the opening brace and the first statement
+    bool head_dirty = block && r->from < (len != 0 ? old[0].offset : end);
+
+    bool ok = true;
+    if (touched == 1 && dirty == 1 && !head_dirty &&
+        old[first_touched].node->reusable) {
+        AstNode *elem = old[first_touched].node;
+        CompStmt *inner = block_around_edit(r, elem);
+        u32 errors = r->diags.errors.len;
+        if (inner != NULL && reparse_block_of(r, elem, inner)) {
+            for (u32 i = 0; i < len; i++) {
+                if (i != first_touched) {
+                    ast_node_shift(ast, old[i].node,
+                                   moved(r, old[i].offset) - old[i].offset);
+                }
+            }
+            free(old);
+            return true;
+        }
+        r->diags.errors.len = errors;
+    }
+
+    // New elements are added to `holder` while they are parsed, then moved
+    // over in order with the old elements that are kept
+    ParseFn parse_fn = block ? (ParseFn)parse_stmt : (ParseFn)parse_decl;
+    AstNode *holder = ast_node_create(ast, list->kind);
+    ChildList children = {0};
+    u32 errors = r->diags.errors.len;
+    c->current = holder;
+    c->follow = (TokSet){0};
+    if (block) {
+        for (u32 w = 0; w < 2; w++) {
+            c->follow.bits[w] = decl_start.bits[w] | comp_stmt_follow.bits[w];
+        }
+    }
+
+    u32 i = 0;
+    bool done = false;
+    while (ok && !done) {
+        bool at_head = head_dirty;
+        head_dirty = false;
+        if (!at_head) {
+            while (i < len && !old[i].dirty) {
+                old[i].kept = true;
+                APPEND(&children, child_node_create(old[i].node));
+                i++;
+            }
+            if (i == len) {
+                break;
+            }
+        }
+
+        // Parse from the element that has to be parsed again (it is right
+        // after one that was kept, or first) until back in step
+        c->lex.lookahead = (Tok){.t = T_EMPTY};
+        c->panic_mode = false;
+        if (at_head || (block && i == 0)) {
+            c->lex.cursor = list->offset;
+            assert(lex_peek(&c->lex).t == T_LBRC);
+            lex_consume(&c->lex);
+        } else {
+            c->lex.cursor = moved(r, old[i].offset);
+        }
+        for (;;) {
+            Tok tok = skip_comments(&c->lex);
+            u32 cursor = c->lex.cursor;
+            while (i < len && (moved(r, old[i].offset) < cursor ||
+                               (old[i].offset >= r->from &&
+                                old[i].offset <= r->to && cursor > r->from))) {
+                i++;
+            }
+            if (!c->panic_mode && i < len && !old[i].dirty &&
+                moved(r, old[i].offset) == cursor) {
+                break;
+            }
+            if (tok.t == T_EOF) {
+                // A block can't run into the end of the file when it didn't
+                // before, the enclosing element has to be parsed again
+                ok = !block;
+                done = true;
+                break;
+            }
+            if (block && tok.t == T_RBRC) {
+                ok = !c->panic_mode && i == len && cursor == moved(r, end);
+                done = true;
+                break;
+            }
+            if (block && cursor > moved(r, end)) {
+                ok = false;
+                break;
+            }
+            AstNode *node = parse_list_element(c, parse_fn);
+            APPEND(&children, child_node_create(node));
+        }
+    }
+
+    if (!ok) {
+        // Recovery doesn't lex what it already scanned over again, which
+        // would leave out the lexical errors taken back here
+        memset(c->next_tok, 0, sizeof(c->next_tok));
+        // Only the new elements, the old ones stay where they were. The new
+        // ones were made after `holder`.
+        for (size_t i = 0; i < children.len; i++) {
+            if (children.items[i].node->id > holder->id) {
+                ast_subtree_detach(ast, children.items[i].node);
+            }
+        }
+        ast_node_children_set(ast, holder, NULL, 0);
+        ast_subtree_detach(ast, holder);
+        free(children.items);
+        r->diags.errors.len = errors;
+        free(old);
+        return false;
+    }
+
+    // The elements that aren't kept are left in the arena, see
+    // too_much_garbage
+    for (u32 i = 0; i < len; i++) {
+        if (old[i].kept) {
+            ast_node_shift(ast, old[i].node,
+                           moved(r, old[i].offset) - old[i].offset);
+        } else {
+            ast_subtree_detach(ast, old[i].node);
+        }
+    }
+    for (size_t i = 0; i < children.len; i++) {
+        ast_node_parent_set(children.items[i].node, list);
+    }
+    ast_node_children_set(ast, holder, NULL, 0);
+    ast_subtree_detach(ast, holder);
+    ast_node_children_set(ast, list, children.items, children.len);
+    free(children.items);
+    free(old);
+    return true;
+}
+
+SourceFile *reparse_source_file(ParseCtx *c, SourceFile *root, TextEdit edit) {
+    assert(edit.start <= edit.old_end && edit.start <= edit.new_end);
+    if (too_much_garbage(c->ast)) {
+        return NULL;
+    }
+    TRACE_BEGIN("reparse_source_file");
+    Reparse r = {
+        .c = c,
+        .from = edit.start != 0 ? edit.start - 1 : 0,
+        .to = edit.old_end,
+        .delta = (s32)edit.new_end - (s32)edit.old_end,
+        .diags = new_diag_buffer(),
+    };
+    c->ast->source = c->lex.source;
+
+    // Anything before the first declaration is parsed from scratch
+    Children decls = ast_node_children(c->ast, &root->decls->head);
+    Children imports = ast_node_children(c->ast, &root->imports->head);
+    bool ok =
+        decls.len != 0 && old_offset(&r, decls.items[0].node) < edit.start;
+    for (size_t i = 0; ok && i < imports.len; i++) {
+        ok = imports.items[i].node->reusable;
+    }
+    if (ok) {
+        u32 old_len = c->lex.source->text.len - r.delta;
+        diag_buffer_attach(&r.diags);
+        ok = reparse_list(&r, &root->decls->head, old_len, false);
+        diag_buffer_attach(NULL);
+        diag_buffer_replay(c->lex.source, &r.diags);
+    }
+    diag_buffer_free(&r.diags);
+
+    if (ok) {
+        ast_node_shift(c->ast, &root->imports->head, 0);
+    } else {
+        ast_subtree_detach(c->ast, &root->head);
+        c->ast->root = NULL;
+        c->lex = new_lexer(c->lex.source);
+        c->current = NULL;
+        c->panic_mode = false;
+        c->follow = (TokSet){0};
+        root = parse_source_file(c);
+    }
+    TRACE_END("reparse_source_file");
+    return root;
+}
@@ -3,9 +3,11 @@
 // TODO: add delimiter tokens as part of the parsing context
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../ast/ast.h"
+#include "../common/trace.h"
 #include "../lex/lex.h"
 #include "../mod/mod.h"
 
@@ -21,40 +23,85 @@ static NodeCtx begin_node(ParseCtx *c, AstNode *node);
 static NodeCtx start_node(ParseCtx *c, NodeKind kind);
 static void set_current_node(ParseCtx *c, AstNode *node);
 static void *end_node(ParseCtx *c, NodeCtx ctx);
+static void reparent(ParseCtx *c, AstNode *node, AstNode *new_parent);
+static bool builds_tree(ParseCtx *c);
 static Tok tnext(ParseCtx *c);
 static void next(ParseCtx *c);
 static Tok consume(ParseCtx *c);
 static Tok at(ParseCtx *c);
 static bool looking_at(ParseCtx *c, TokKind t);
-static bool one_of(TokKind t, Toks toks);
-static void advance(ParseCtx *c, Toks toks);
+static bool one_of(TokKind t, TokSet toks);
+static TokSet push_follow(ParseCtx *c, TokSet follow);
+static bool sync_to(ParseCtx *c, TokSet toks);
 static void expected(ParseCtx *c, AstNode *in, const char *msg);
-static bool expect_one_of(ParseCtx *c, AstNode *in, Toks toks,
+static bool expect_one_of(ParseCtx *c, AstNode *in, TokSet toks,
                           const char *message);
 static bool skip_if(ParseCtx *c, AstNode *in, TokKind t);
-// static void sync_if_none_of(ParseCtx *c, Toks toks);
 static bool expect(ParseCtx *c, AstNode *in, TokKind t);
-static ParseState set_marker(ParseCtx *c);
-static void backtrack(ParseCtx *c, ParseState marker);
+static Tok peek2(ParseCtx *c);
 
-typedef AstNode *(*ParseFn)(ParseCtx *);
 static void ensure_progress(ParseCtx *c, ParseFn parse_fn);
 
+static CompStmt *parse_comp_stmt_into(ParseCtx *c, NodeCtx nc);
+static CompStmt *skip_comp_stmt(ParseCtx *c);
+static void parse_deferred_body(SourceCode *code, Ast *ast, CompStmt *body);
+
+const TokSet decl_start = TOKSET(T_LET, T_VAR, T_FUN, T_TYPE);
+const TokSet comp_stmt_follow = TOKSET(T_RBRC);
+
 ParseCtx parse_ctx_create(Ast *ast, SourceCode *code) {
     return (ParseCtx){
         .lex = new_lexer(code),
         .ast = ast,
         .current = NULL,
         .panic_mode = false,
+        .jobs = 1,
+        .lazy_bodies = false,
+        .syntax_only = false,
+        .events = NULL,
+        .syntax_errors = 0,
+        .expr_depth = 0,
+        .max_expr_depth = DEFAULT_MAX_EXPR_DEPTH,
     };
 }
 
 SourceFile *parse_source_file(ParseCtx *c) {
+    TRACE_BEGIN("parse_source_file");
+    c->ast->source = c->lex.source;
+    if (c->lazy_bodies) {
+        c->ast->parse_deferred = parse_deferred_body;
+        c->ast->deferred_max_expr_depth = c->max_expr_depth;
+    }
     NodeCtx nc = start_node(c, NODE_SOURCE_FILE);
     SourceFile *n = (SourceFile *)nc.node;
+    if (c->events != NULL) {
+        parse_events_open(c->events, &n->head);
+    }
     n->imports = parse_imports(c);
+    if (c->events != NULL) {
+        parse_events_flush(c->events, &n->head);
+    }
     n->decls = parse_decls(c);
-    return end_node(c, nc);
+    SourceFile *res = end_node(c, nc);
+    if (c->events != NULL) {
+        parse_events_close(c->events, &n->head);
+    }
+    TRACE_END("parse_source_file");
+    return res;
+}
+
+bool check_syntax(SourceCode *code) {
+    TRACE_BEGIN("check_syntax");
+    u32 errors = code->error_count;
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx c = parse_ctx_create(&ast, code);
+    c.syntax_only = true;
+    (void)parse_source_file(&c);
+    ast_delete(ast);
+    arena_free(&arena);
+    TRACE_END("check_syntax");
+    return code->error_count == errors;
 }
 
 Imports *parse_imports(ParseCtx *c) {
@@ -76,8 +123,49 @@ Import *parse_import(ParseCtx *c) {
     return end_node(c, nc);
 }
 
+// Nothing points into a declaration once it is parsed in syntax only or
+// event mode, so each one gets parsed into a scratch arena that is reset for
+// the next (unless the event consumer wants to keep the nodes)
+static void parse_decls_unlinked(ParseCtx *c, Decls *decls) {
+    bool keep_nodes = c->events != NULL && c->events->sink.keep_nodes;
+    Arena *arena = c->ast->arena;
+    Arena scratch = new_arena();
+    if (!keep_nodes) {
+        c->ast->arena = &scratch;
+    }
+    u32 node_count = c->ast->node_count;
+    while (!looking_at(c, T_EOF)) {
+        ensure_progress(c, (ParseFn)parse_decl);
+        if (c->events != NULL) {
+            parse_events_flush(c->events, &decls->head);
+        }
+        arena_reset(&scratch);
+        // The ids can go again too, or the tables indexed by them would keep
+        // growing
+        if (!keep_nodes) {
+            ast_node_ids_truncate(c->ast, node_count);
+        }
+    }
+    c->ast->arena = arena;
+    arena_free(&scratch);
+}
+
 Decls *parse_decls(ParseCtx *c) {
     NodeCtx nc = start_node(c, NODE_DECLS);
+    if (!builds_tree(c)) {
+        if (c->events != NULL) {
+            parse_events_open(c->events, nc.node);
+        }
+        parse_decls_unlinked(c, (Decls *)nc.node);
+        Decls *res = end_node(c, nc);
+        if (c->events != NULL) {
+            parse_events_close(c->events, &res->head);
+        }
+        return res;
+    }
+    if (c->jobs > 1 && parse_decls_parallel(c, (Decls *)nc.node)) {
+        return end_node(c, nc);
+    }
     while (!looking_at(c, T_EOF)) {
         ensure_progress(c, (ParseFn)parse_decl);
     }
@@ -87,6 +175,7 @@ Decls *parse_decls(ParseCtx *c) {
 Decl *parse_decl(ParseCtx *c) {
     NodeCtx nc = start_node(c, NODE_DECL);
     Decl *n = (Decl *)nc.node;
+    TokSet follow = push_follow(c, decl_start);
 again:
     switch (at(c).t) {
         case T_LET:
@@ -103,12 +192,13 @@ again:
             n->type_decl = parse_type_decl(c, true);
             break;
         default:
-            if (expect_one_of(c, &n->head, TOKS(T_LET, T_VAR, T_FUN, T_TYPE),
+            if (expect_one_of(c, &n->head, decl_start,
                               "start of declaration")) {
                 goto again;
             }
             break;
     }
+    c->follow = follow;
     return end_node(c, nc);
 }
 
@@ -196,7 +286,11 @@ FnDecl *parse_fn_decl(ParseCtx *c) {
         next(c);
         n->return_type.ptr = parse_type(c);
     }
-    n->body = parse_comp_stmt(c);
+    if (c->lazy_bodies && builds_tree(c) && looking_at(c, T_LBRC)) {
+        n->body = skip_comp_stmt(c);
+    } else {
+        n->body = parse_comp_stmt(c);
+    }
     return end_node(c, nc);
 }
 
@@ -291,15 +385,84 @@ Stmt *parse_stmt(ParseCtx *c) {
 }
 
 CompStmt *parse_comp_stmt(ParseCtx *c) {
+    return parse_comp_stmt_into(c, start_node(c, NODE_COMP_STMT));
+}
+
+// Only matches up the braces, the body is parsed later by
+// parse_deferred_body. If the braces don't match up it is parsed right away
+// so the errors come out as usual.
+static CompStmt *skip_comp_stmt(ParseCtx *c) {
+    Lexer lex = c->lex;
+    u32 depth = 0;
+    u32 end = 0;
+    do {
+        Tok tok = lex_peek(&lex);
+        switch (tok.t) {
+            case T_EOF:
+                return parse_comp_stmt(c);
+            case T_LBRC:
+                depth++;
+                break;
+            case T_RBRC:
+                depth--;
+                end = tok.offset + tok.text.len;
+                break;
+            default:
+                break;
+        }
+        lex_consume(&lex);
+    } while (depth != 0);
+
     NodeCtx nc = start_node(c, NODE_COMP_STMT);
+    CompStmt *n = (CompStmt *)nc.node;
+    n->end = end;
+    n->deferred_end = end;
+    c->lex = lex;
+    return end_node(c, nc);
+}
+
+static void parse_deferred_body(SourceCode *code, Ast *ast, CompStmt *body) {
+    // Hide everything after the closing brace so error recovery can't run
+    // into the declarations that follow
+    usize len = code->text.len;
+    code->text.len = body->deferred_end;
+    body->deferred_end = 0;
+
+    ParseCtx c = parse_ctx_create(ast, code);
+    c.lex.cursor = body->head.offset;
+    c.max_expr_depth = ast->deferred_max_expr_depth;
+    // Same as when parsed as part of the declaration
+    c.follow = decl_start;
+    u32 errors = errors_raised(code);
+    (void)parse_comp_stmt_into(&c, begin_node(&c, &body->head));
+    // The declaration was only checked up to the braces when it was parsed
+    if (c.syntax_errors != 0 || errors_raised(code) != errors) {
+        for (AstNode *it = &body->head; it != NULL;
+             it = ast_node_parent(ast, it)) {
+            it->reusable = false;
+        }
+    }
+
+    code->text.len = len;
+}
+
+static CompStmt *parse_comp_stmt_into(ParseCtx *c, NodeCtx nc) {
     CompStmt *n = (CompStmt *)nc.node;
     if (!skip_if(c, &n->head, T_LBRC)) {
         return end_node(c, nc);
     }
+    TokSet follow = push_follow(c, comp_stmt_follow);
     while (!looking_at(c, T_RBRC)) {
+        if (looking_at(c, T_EOF)) {
+            expected(c, &n->head, tok_to_string[T_RBRC].data);
+            goto done;
+        }
         ensure_progress(c, (ParseFn)parse_stmt);
     }
+    n->end = at(c).offset + 1;
     next(c);
+done:
+    c->follow = follow;
     return end_node(c, nc);
 }
 
@@ -388,7 +551,7 @@ CaseBranches *parse_case_branches(ParseCtx *c) {
             expected(c, &n->head, "a case branch");
             break;
         }
-        (void)parse_case_branch(c);
+        ensure_progress(c, (ParseFn)parse_case_branch);
     }
     next(c);
     return end_node(c, nc);
@@ -483,7 +646,7 @@ static Types *parse_tuple_types(ParseCtx *c, Type *first_type) {
     NodeCtx nc = start_node(c, NODE_TYPES);
     Types *n = (Types *)nc.node;
 
-    ast_node_reparent(&first_type->head, &n->head);
+    reparent(c, &first_type->head, &n->head);
 
     while (consume(c).t == T_COMMA && !looking_at(c, T_RPAR)) {
         (void)parse_type(c);
@@ -504,7 +667,7 @@ static UnionAlt *parse_union_alt(ParseCtx *c, Type *first_type) {
     NodeCtx nc = start_node(c, NODE_UNION_ALT);
     UnionAlt *n = (UnionAlt *)nc.node;
     if (first_type) {
-        ast_node_reparent(&first_type->head, &n->head);
+        reparent(c, &first_type->head, &n->head);
         n->t = UNION_ALT_TYPE;
         n->type = first_type;
         return end_node(c, nc);
@@ -859,16 +1022,10 @@ CallArgs *parse_call_args(ParseCtx *c) {
 CallArg *parse_call_arg(ParseCtx *c) {
     NodeCtx nc = start_node(c, NODE_CALL_ARG);
     CallArg *n = (CallArg *)nc.node;
-    ParseState start = set_marker(c);
-    if (looking_at(c, T_IDENT)) {
-        next(c);
-        if (looking_at(c, T_EQ)) {
-            backtrack(c, start);
-            n->name.ptr = parse_ident(c);
-            n->assign_token = consume(c);
-        } else {
-            backtrack(c, start);
-        }
+    // e.g. f(x = 1)
+    if (looking_at(c, T_IDENT) && peek2(c).t == T_EQ) {
+        n->name.ptr = parse_ident(c);
+        n->assign_token = consume(c);
     }
     n->value = parse_expr(c);
     return end_node(c, nc);
@@ -877,98 +1034,112 @@ CallArg *parse_call_arg(ParseCtx *c) {
 // Helpful resource for pratt parser:
 // https://matklad.github.io/2020/04/13/simple-but-powerful-pratt-parsing.html#Pratt-parsing-the-general-shape
 
-static bool is_prefix_op(TokKind t) {
-    switch (t) {
-        case T_AMP:
-        case T_INC:
-        case T_DEC:
-        case T_STAR:
-        case T_MINUS:
-            return true;
-        default:
-            return false;
-    }
-}
-
-static bool is_infix_op(TokKind t) {
-    switch (t) {
-        case T_PLUS:
-        case T_MINUS:
-        case T_PERC:
-        case T_STAR:
-        case T_SLASH:
-        case T_AND:
-        case T_OR:
-        case T_AMP:
-        case T_PIPE:
-        case T_NEQ:
-        case T_EQEQ:
-        case T_LT:
-        case T_GT:
-        case T_LTEQ:
-        case T_GTEQ:
-            return true;
-        default:
-            return false;
-    }
-}
-
-static bool is_postfix_op(TokKind t) {
-    switch (t) {
-        case T_DOT:
-        case T_LPAR:
-        case T_LBRK:
-        case T_INC:
-        case T_DEC:
-        case T_BANG:
-        case T_QUEST:
-            return true;
-        default:
-            return false;
-    }
-}
-
-static bool is_op(TokKind t) {
-    return is_prefix_op(t) || is_infix_op(t) || is_postfix_op(t);
-}
-
 typedef struct {
     u32 left;
     u32 right;
 } Power;
 
-typedef enum {
-    PREC_POSTFIX,
-    PREC_UNARY,
-    PREC_MULTIPLICATIVE,
-    PREC_ADDITIVE,
-    PREC_SHIFT,
-    PREC_RELATIONAL,
-    PREC_EQUALITY,
-    PREC_BAND,
-    PREC_BXOR,
-    PREC_BOR,
-    PREC_AND,
-    PREC_OR,
-    // PREC_ASSIGNMENT,
-    PREC_COUNT,
-} Precendence_Group;
-
-static const Power binding_power_of[PREC_COUNT] = {
-    [PREC_POSTFIX] = {23, 24},
-    [PREC_UNARY] = {22, 21},
-    [PREC_MULTIPLICATIVE] = {19, 20},
-    [PREC_ADDITIVE] = {17, 18},
-    [PREC_SHIFT] = {15, 16},
-    [PREC_RELATIONAL] = {13, 14},
-    [PREC_EQUALITY] = {11, 12},
-    [PREC_BAND] = {9, 10},
-    [PREC_BOR] = {7, 8},
-    [PREC_AND] = {5, 6},
-    [PREC_OR] = {3, 4},
-    // [PREC_ASSIGNMENT] = {2, 1},
+// Binding power of each precedence group, from tightest to loosest
+#define EACH_PRECEDENCE                \
+    PRECEDENCE(POSTFIX, 25, 26)        \
+    PRECEDENCE(UNARY, 24, 23)          \
+    PRECEDENCE(MULTIPLICATIVE, 21, 22) \
+    PRECEDENCE(ADDITIVE, 19, 20)       \
+    PRECEDENCE(SHIFT, 17, 18)          \
+    PRECEDENCE(RELATIONAL, 15, 16)     \
+    PRECEDENCE(EQUALITY, 13, 14)       \
+    PRECEDENCE(BAND, 11, 12)           \
+    PRECEDENCE(BXOR, 9, 10)            \
+    PRECEDENCE(BOR, 7, 8)              \
+    PRECEDENCE(AND, 5, 6)              \
+    PRECEDENCE(OR, 3, 4)
+// PRECEDENCE(ASSIGNMENT, 2, 1)
+
+enum {
+#define PRECEDENCE(NAME, LEFT, RIGHT) \
+    LPOW_##NAME = LEFT,               \
+    RPOW_##NAME = RIGHT,
+    EACH_PRECEDENCE
+#undef PRECEDENCE
+};
+
+// Every operator with its precedence group, adding an operator only takes a
+// line here (and in the lexer)
+#define EACH_OPERATOR            \
+    PREFIX(AMP, UNARY)           \
+    PREFIX(INC, UNARY)           \
+    PREFIX(DEC, UNARY)           \
+    PREFIX(STAR, UNARY)          \
+    PREFIX(MINUS, UNARY)         \
+    INFIX(STAR, MULTIPLICATIVE)  \
+    INFIX(SLASH, MULTIPLICATIVE) \
+    INFIX(PERC, MULTIPLICATIVE)  \
+    INFIX(PLUS, ADDITIVE)        \
+    INFIX(MINUS, ADDITIVE)       \
+    INFIX(SHL, SHIFT)            \
+    INFIX(SHR, SHIFT)            \
+    INFIX(LT, RELATIONAL)        \
+    INFIX(GT, RELATIONAL)        \
+    INFIX(LTEQ, RELATIONAL)      \
+    INFIX(GTEQ, RELATIONAL)      \
+    INFIX(EQEQ, EQUALITY)        \
+    INFIX(NEQ, EQUALITY)         \
+    INFIX(AMP, BAND)             \
+    INFIX(CARET, BXOR)           \
+    INFIX(PIPE, BOR)             \
+    INFIX(AND, AND)              \
+    INFIX(OR, OR)                \
+    POSTFIX(DOT, POSTFIX)        \
+    POSTFIX(LPAR, POSTFIX)       \
+    POSTFIX(LBRK, POSTFIX)       \
+    POSTFIX(INC, POSTFIX)        \
+    POSTFIX(DEC, POSTFIX)        \
+    POSTFIX(BANG, POSTFIX)       \
+    POSTFIX(QUEST, POSTFIX)
+
+#define OPERATOR_POWER(TOK, PREC) [T_##TOK] = {LPOW_##PREC, RPOW_##PREC},
+
+// Indexed by token kind, a left power of zero means the token is not an
+// operator of that kind
+static const Power prefix_bpow[TOK_KIND_COUNT] = {
+#define PREFIX OPERATOR_POWER
+#define INFIX(...)
+#define POSTFIX(...)
+    EACH_OPERATOR
+#undef POSTFIX
+#undef INFIX
+#undef PREFIX
+};
+
+static const Power infix_bpow[TOK_KIND_COUNT] = {
+#define PREFIX(...)
+#define INFIX OPERATOR_POWER
+#define POSTFIX(...)
+    EACH_OPERATOR
+#undef POSTFIX
+#undef INFIX
+#undef PREFIX
 };
 
+static const Power postfix_bpow[TOK_KIND_COUNT] = {
+#define PREFIX(...)
+#define INFIX(...)
+#define POSTFIX OPERATOR_POWER
+    EACH_OPERATOR
+#undef POSTFIX
+#undef INFIX
+#undef PREFIX
+};
+
+#undef OPERATOR_POWER
+
+static bool is_prefix_op(TokKind t) { return prefix_bpow[t].left != 0; }
+
+static bool is_op(TokKind t) {
+    return (prefix_bpow[t].left | infix_bpow[t].left | postfix_bpow[t].left) !=
+           0;
+}
+
 static Index *parse_index(ParseCtx *c) {
     NodeCtx nc = start_node(c, NODE_INDEX);
     Index *n = (Index *)nc.node;
@@ -1064,108 +1235,129 @@ static NodeCtx parse_postfix(ParseCtx *c, Expr *lhs) {
     return expr_ctx;
 }
 
+typedef enum {
+    EXPR_FRAME_PAREN,
+    EXPR_FRAME_PREFIX,
+    EXPR_FRAME_INFIX,
+} ExprFrameKind;
+
+// An operand is being parsed for what is here, this is what would be a
+// recursive call to expr_with_bpow
 typedef struct {
-    Power pow;
-    bool ok;
-} Maybe_Power;
-
-static Maybe_Power infix_bpow(TokKind op) {
-    switch (op) {
-        case T_PLUS:
-        case T_MINUS:
-            return (Maybe_Power){binding_power_of[PREC_ADDITIVE], true};
-        case T_PERC:
-        case T_STAR:
-        case T_SLASH:
-            return (Maybe_Power){binding_power_of[PREC_MULTIPLICATIVE], true};
-        case T_AND:
-            return (Maybe_Power){binding_power_of[PREC_AND], true};
-        case T_OR:
-            return (Maybe_Power){binding_power_of[PREC_OR], true};
-        case T_AMP:
-            return (Maybe_Power){binding_power_of[PREC_BAND], true};
-        case T_PIPE:
-            return (Maybe_Power){binding_power_of[PREC_BOR], true};
-        case T_NEQ:
-        case T_EQEQ:
-            return (Maybe_Power){binding_power_of[PREC_EQUALITY], true};
-        case T_LT:
-        case T_GT:
-        case T_LTEQ:
-        case T_GTEQ:
-            return (Maybe_Power){binding_power_of[PREC_RELATIONAL], true};
-        default:
-            return (Maybe_Power){.ok = false};
-    }
-}
+    ExprFrameKind t;
+    // Of the expression the operand is a part of
+    u32 min_pow;
+    NodeCtx expr_ctx;
+    // The unary or binary expression the operand goes in
+    NodeCtx op_ctx;
+} ExprFrame;
 
-static Maybe_Power prefix_bpow(TokKind op) {
-    switch (op) {
-        case T_AMP:
-        case T_INC:
-        case T_DEC:
-        case T_STAR:
-        case T_MINUS:
-            return (Maybe_Power){binding_power_of[PREC_UNARY], true};
-        default:
-            return (Maybe_Power){.ok = false};
+// Enough for most expressions without going to the heap
+#define INLINE_EXPR_FRAMES 8
+
+typedef struct {
+    ExprFrame *items;
+    u32 len;
+    u32 cap;
+    ExprFrame inline_items[INLINE_EXPR_FRAMES];
+} ExprStack;
+
+static void expr_stack_push(ExprStack *s, ExprFrame frame) {
+    if (s->len == s->cap) {
+        s->cap *= 2;
+        ExprFrame *items;
+        if (s->items == s->inline_items) {
+            items = malloc(s->cap * sizeof(ExprFrame));
+            if (items != NULL) {
+                memcpy(items, s->inline_items, s->len * sizeof(ExprFrame));
+            }
+        } else {
+            items = realloc(s->items, s->cap * sizeof(ExprFrame));
+        }
+        if (items == NULL) {
+            panic("out of memory");
+        }
+        s->items = items;
     }
+    s->items[s->len++] = frame;
 }
 
-static Maybe_Power postfix_bpow(TokKind op) {
-    switch (op) {
-        case T_DOT:
-        case T_LPAR:
-        case T_LBRK:
-        case T_INC:
-        case T_DEC:
-        case T_BANG:
-        case T_QUEST:
-            return (Maybe_Power){binding_power_of[PREC_POSTFIX], true};
-        default:
-            return (Maybe_Power){.ok = false};
-            assert(false && "TODO");
+// Skips an operand nested too deeply, up to where the expression around it
+// carries on. Its place is taken by an atom with an error, same as when an
+// atom is missing.
+static NodeCtx skip_nested_expr(ParseCtx *c) {
+    NodeCtx expr_ctx = start_node(c, NODE_EXPR);
+    Expr *expr = (Expr *)expr_ctx.node;
+    NodeCtx atom_ctx = start_node(c, NODE_ATOM);
+    if (!c->panic_mode) {
+        expected(c, atom_ctx.node, "a less deeply nested expression");
+    }
+    atom_ctx.node->has_error = true;
+
+    u32 depth = 0;
+    for (Tok tok = at(c); tok.t != T_EOF; tok = at(c)) {
+        if (tok.t == T_LPAR || tok.t == T_LBRK ||
+            (tok.t == T_LBRC && depth != 0)) {
+            depth++;
+        } else if (tok.t == T_RPAR || tok.t == T_RBRK || tok.t == T_RBRC) {
+            if (depth == 0) {
+                break;
+            }
+            depth--;
+        } else if (depth == 0 &&
+                   one_of(tok.t, TOKS(T_LBRC, T_COMMA, T_SCLN))) {
+            break;
+        }
+        next(c);
     }
+
+    expr->t = EXPR_ATOM;
+    expr->atom = end_node(c, atom_ctx);
+    return expr_ctx;
 }
 
+// Operands that would be parsed with a recursive call (in parentheses, after
+// a prefix operator and right of an infix operator) get a frame on an
+// explicit stack instead, so nesting doesn't use up the C stack. Nesting past
+// `max_expr_depth` is a syntax error.
 static NodeCtx expr_with_bpow(ParseCtx *c, u32 min_pow) {
+    // Not zeroed, the inline frames are only read once pushed
+    ExprStack stack;
+    stack.items = stack.inline_items;
+    stack.len = 0;
+    stack.cap = INLINE_EXPR_FRAMES;
+
     NodeCtx lhs_ctx;
     Expr *lhs = BAD_PTR;
 
+operand:
+    c->expr_depth++;
     Tok tok = at(c);
-
-    if (tok.t == T_LPAR) {
+    if (c->max_expr_depth != 0 && c->expr_depth > c->max_expr_depth) {
+        lhs_ctx = skip_nested_expr(c);
+        lhs = (Expr *)lhs_ctx.node;
+    } else if (tok.t == T_LPAR) {
         next(c);
-        lhs_ctx = expr_with_bpow(c, 0);
-        lhs = REIFY_AS(lhs_ctx.node, Expr);
-
-        if (!skip_if(c, &lhs->head, T_RPAR)) {
-            return lhs_ctx;
-        }
-        if (!is_op(at(c).t)) {
-            return lhs_ctx;
-        }
+        expr_stack_push(&stack, (ExprFrame){
+                                    .t = EXPR_FRAME_PAREN,
+                                    .min_pow = min_pow,
+                                });
+        min_pow = 0;
+        goto operand;
     } else if (is_prefix_op(tok.t)) {
         lhs_ctx = start_node(c, NODE_EXPR);
-        lhs = REIFY_AS(lhs_ctx.node, Expr);
-
         NodeCtx unary_ctx = start_node(c, NODE_UNARY_EXPR);
         UnaryExpr *unary_expr = (UnaryExpr *)unary_ctx.node;
-
-        Power pow;
-        Maybe_Power maybe_pow = prefix_bpow(tok.t);
-        if (!maybe_pow.ok) {
-            expected(c, &unary_expr->head, "valid prefix operator");
-            pow = (Power){0, 0};
-        } else {
-            pow = maybe_pow.pow;
-        }
-
         unary_expr->op = token_attr(c, "op", consume(c));
-        unary_expr->sub_expr = end_node(c, expr_with_bpow(c, pow.right));
 
-        lhs->t = EXPR_UNARY;
-        lhs->unary_expr = end_node(c, unary_ctx);
+        expr_stack_push(&stack, (ExprFrame){
+                                    .t = EXPR_FRAME_PREFIX,
+                                    .min_pow = min_pow,
+                                    .expr_ctx = lhs_ctx,
+                                    .op_ctx = unary_ctx,
+                                });
+        min_pow = prefix_bpow[tok.t].right;
+        goto operand;
     } else {
         lhs_ctx = start_node(c, NODE_EXPR);
         lhs = REIFY_AS(lhs_ctx.node, Expr);
@@ -1174,15 +1366,11 @@ static NodeCtx expr_with_bpow(ParseCtx *c, u32 min_pow) {
         lhs->atom = parse_atom(c);
     }
 
+operators:
     while (true) {
         Tok op = at(c);
-        if (!is_infix_op(op.t) && !is_postfix_op(op.t)) {
-            break;
-        }
-
-        Maybe_Power maybe_pow = postfix_bpow(op.t);
-        if (maybe_pow.ok) {
-            Power pow = maybe_pow.pow;
+        Power pow = postfix_bpow[op.t];
+        if (pow.left != 0) {
             if (pow.left < min_pow) {
                 break;
             }
@@ -1194,12 +1382,9 @@ static NodeCtx expr_with_bpow(ParseCtx *c, u32 min_pow) {
             continue;
         }
 
-        maybe_pow = infix_bpow(op.t);
-        if (!maybe_pow.ok) {
-            break;
-        }
-        Power pow = maybe_pow.pow;
-        if (pow.left < min_pow) {
+        // Zero for anything that isn't an infix operator
+        pow = infix_bpow[op.t];
+        if (pow.left == 0 || pow.left < min_pow) {
             break;
         }
 
@@ -1215,8 +1400,6 @@ static NodeCtx expr_with_bpow(ParseCtx *c, u32 min_pow) {
         set_current_node(c, lhs_ctx.parent);
 
         NodeCtx new_expr_ctx = start_node(c, NODE_EXPR);
-        Expr *new_expr = (Expr *)new_expr_ctx.node;
-
         NodeCtx bin_ctx = start_node(c, NODE_BIN_EXPR);
         BinExpr *bin_expr = (BinExpr *)bin_ctx.node;
 
@@ -1224,17 +1407,58 @@ static NodeCtx expr_with_bpow(ParseCtx *c, u32 min_pow) {
         NodeCtx old_lhs_ctx = begin_node(c, &lhs->head);
         bin_expr->left = attr(c, "left", end_node(c, old_lhs_ctx));
         next(c);
-        bin_expr->right =
-            attr(c, "right", end_node(c, expr_with_bpow(c, pow.right)));
-
-        new_expr->t = EXPR_BIN;
-        new_expr->bin_expr = end_node(c, bin_ctx);
 
-        lhs = new_expr;
-        lhs_ctx = new_expr_ctx;
+        expr_stack_push(&stack, (ExprFrame){
+                                    .t = EXPR_FRAME_INFIX,
+                                    .min_pow = min_pow,
+                                    .expr_ctx = new_expr_ctx,
+                                    .op_ctx = bin_ctx,
+                                });
+        min_pow = pow.right;
+        goto operand;
+    }
+
+    // The operand in `lhs_ctx` is done, it goes in the expression of the frame
+    // on top of the stack
+operand_done:
+    c->expr_depth--;
+    if (stack.len == 0) {
+        if (stack.items != stack.inline_items) {
+            free(stack.items);
+        }
+        return lhs_ctx;
     }
-
-    return lhs_ctx;
+    ExprFrame frame = stack.items[--stack.len];
+    min_pow = frame.min_pow;
+    switch (frame.t) {
+        case EXPR_FRAME_PAREN:
+            lhs = REIFY_AS(lhs_ctx.node, Expr);
+            if (!skip_if(c, &lhs->head, T_RPAR) || !is_op(at(c).t)) {
+                goto operand_done;
+            }
+            break;
+        case EXPR_FRAME_PREFIX: {
+            UnaryExpr *unary_expr = (UnaryExpr *)frame.op_ctx.node;
+            unary_expr->sub_expr = end_node(c, lhs_ctx);
+
+            lhs_ctx = frame.expr_ctx;
+            lhs = (Expr *)lhs_ctx.node;
+            lhs->t = EXPR_UNARY;
+            lhs->unary_expr = end_node(c, frame.op_ctx);
+            break;
+        }
+        case EXPR_FRAME_INFIX: {
+            BinExpr *bin_expr = (BinExpr *)frame.op_ctx.node;
+            bin_expr->right = attr(c, "right", end_node(c, lhs_ctx));
+
+            lhs_ctx = frame.expr_ctx;
+            lhs = (Expr *)lhs_ctx.node;
+            lhs->t = EXPR_BIN;
+            lhs->bin_expr = end_node(c, frame.op_ctx);
+            break;
+        }
+    }
+    goto operators;
 }
 
 Expr *parse_expr(ParseCtx *c) {
@@ -1331,20 +1555,34 @@ again:
 }
 
 static void *attr(ParseCtx *c, const char *name, void *node) {
-    assert(da_length(c->current->children) != 0);
-    Child *ch =
-        children_at(c->current->children, da_length(c->current->children) - 1);
+    if (!builds_tree(c)) {
+        if (c->events != NULL) {
+            parse_events_name_last(c->events, c->current, name);
+        }
+        return node;
+    }
+    Children children = ast_node_children(c->ast, c->current);
+    assert(children.len != 0);
+    Child *ch = &children.items[children.len - 1];
     ch->name.ptr = name;
     return node;
 }
 
+static void add_child(ParseCtx *c, AstNode *parent, Child child) {
+    if (builds_tree(c)) {
+        ast_node_child_add(c->ast, parent, child);
+    } else if (c->events != NULL) {
+        parse_events_child(c->events, parent, child);
+    }
+}
+
 static Tok token_attr(ParseCtx *c, const char *name, Tok tok) {
-    ast_node_child_add(c->current, child_token_named_create(name, tok));
+    add_child(c, c->current, child_token_named_create(name, tok));
     return tok;
 }
 
 static Tok token_attr_anon(ParseCtx *c, Tok tok) {
-    ast_node_child_add(c->current, child_token_create(tok));
+    add_child(c, c->current, child_token_create(tok));
     return tok;
 }
 
@@ -1371,24 +1609,36 @@ static void set_current_node(ParseCtx *c, AstNode *node) { c->current = node; }
 
 static void *end_node(ParseCtx *c, NodeCtx ctx) {
     assert(ctx.node == c->current);
+    if (builds_tree(c)) {
+        ast_node_close(c->ast, ctx.node);
+    }
     bool root = ctx.parent == c->current;
     if (!root) {
         // Make sure we can't accidentally add a cycle
         assert(ctx.parent != c->current);
         if (ctx.parent != NULL) {
-            if (c->current->children) {
-                children_shrink(&c->current->children);
-            }
-            ast_node_child_add(ctx.parent, child_node_create(c->current));
-            c->current->parent.ptr = ctx.parent;
+            add_child(c, ctx.parent, child_node_create(c->current));
+            ast_node_parent_set(c->current, ctx.parent);
             set_current_node(c, ctx.parent);
         }
     }
     return ctx.node;
 }
 
-static ParseState set_marker(ParseCtx *c) { return (ParseState){c->lex}; }
-static void backtrack(ParseCtx *c, ParseState marker) { c->lex = marker.lex; }
+static void reparent(ParseCtx *c, AstNode *node, AstNode *new_parent) {
+    if (builds_tree(c)) {
+        ast_node_reparent(c->ast, node, new_parent);
+        return;
+    }
+    if (c->events != NULL) {
+        parse_events_reparent(c->events, node, new_parent);
+    }
+    ast_node_parent_set(node, new_parent);
+}
+
+static bool builds_tree(ParseCtx *c) {
+    return !c->syntax_only && c->events == NULL;
+}
 
 static Tok tnext(ParseCtx *c) {
     Tok tok;
@@ -1409,6 +1659,19 @@ static Tok consume(ParseCtx *c) {
 
 static Tok at(ParseCtx *c) { return lex_peek(&c->lex); }
 
+// The token after the current one, the grammar needs no more lookahead than
+// this so the parser never has to backtrack
+static Tok peek2(ParseCtx *c) {
+    Lexer lex = c->lex;
+    (void)lex_peek(&lex);
+    Tok tok;
+    do {
+        lex_consume(&lex);
+        tok = lex_peek(&lex);
+    } while (tok.t == T_CMNT);
+    return tok;
+}
+
 static bool looking_at(ParseCtx *c, TokKind t) {
     TokKind it = at(c).t;
     while (it == T_CMNT) {
@@ -1418,29 +1681,98 @@ static bool looking_at(ParseCtx *c, TokKind t) {
     return it == t;
 }
 
-static bool one_of(TokKind t, Toks toks) {
-    for (u32 i = 0; i < toks.len; i++) {
-        if (t == toks.items[i]) {
-            return true;
+static bool one_of(TokKind t, TokSet toks) {
+    return (toks.bits[t / 64] >> (t % 64)) & 1;
+}
+
+static TokSet push_follow(ParseCtx *c, TokSet follow) {
+    TokSet old = c->follow;
+    c->follow.bits[0] |= follow.bits[0];
+    c->follow.bits[1] |= follow.bits[1];
+    return old;
+}
+
+static void next_tok_set(ParseCtx *c, TokKind t, u32 from, u32 at,
+                         bool found) {
+    NextTok *it = &c->next_tok[t];
+    // Carries on from what was known before the scan
+    if (it->known && it->from <= from && from <= it->at) {
+        if (it->found && !found) {
+            return;
         }
+        from = it->from;
     }
-    return false;
+    *it = (NextTok){.from = from, .at = at, .known = true, .found = found};
 }
 
-static void advance(ParseCtx *c, Toks toks) {
-    for (Tok tok = lex_peek(&c->lex); tok.t != T_EOF; tok = tnext(c)) {
+// Offset of the next token in `toks` from the current position, or of EOF if
+// there is none. What is learned about every kind of token on the way gets
+// cached, so asking again from anywhere before the token doesn't lex at all,
+// and a scan for kinds not known yet starts where the last one stopped.
+static u32 find_next(ParseCtx *c, TokSet toks) {
+    u32 cursor = c->lex.cursor;
+    u32 next = UINT32_MAX;
+    u32 from = UINT32_MAX;
+    for (TokKind t = 0; t < TOK_KIND_COUNT; t++) {
+        if (!one_of(t, toks)) {
+            continue;
+        }
+        NextTok *it = &c->next_tok[t];
+        if (!it->known || it->from > cursor || cursor > it->at) {
+            from = cursor;
+        } else if (it->found) {
+            next = it->at < next ? it->at : next;
+        } else {
+            from = it->at < from ? it->at : from;
+        }
+    }
+    if (from >= next) {
+        return next;
+    }
+
+    TokSet seen = {0};
+    Lexer lex = c->lex;
+    if (from != cursor) {
+        lex.cursor = from;
+        lex.lookahead = (Tok){.t = T_EMPTY};
+    }
+    Tok tok = lex_peek(&lex);
+    for (; tok.offset < next && tok.t != T_EOF; tok = lex_peek(&lex)) {
+        if (!one_of(tok.t, seen)) {
+            seen.bits[tok.t / 64] |= (u64)1 << (tok.t % 64);
+            next_tok_set(c, tok.t, from, tok.offset, true);
+        }
         if (one_of(tok.t, toks)) {
-            return;
+            next = tok.offset;
+            break;
+        }
+        lex_consume(&lex);
+    }
+    // At EOF none of the kinds not seen are left, otherwise there are none of
+    // them up to where the scan stopped
+    bool eof = tok.t == T_EOF && tok.offset < next;
+    u32 end = eof ? tok.offset : (tok.offset < next ? tok.offset : next);
+    for (TokKind t = 0; t < TOK_KIND_COUNT; t++) {
+        if (!one_of(t, seen)) {
+            next_tok_set(c, t, from, end, eof);
         }
     }
+    return eof ? end : next;
 }
 
-static void advance1(ParseCtx *c, TokKind t) {
-    for (Tok tok = lex_peek(&c->lex); tok.t != T_EOF; tok = tnext(c)) {
-        if (tok.t == t) {
-            return;
-        }
+// Skips ahead to the next token in `toks` unless a token in the follow set
+// (or EOF) comes first, in which case nothing is skipped.
+static bool sync_to(ParseCtx *c, TokSet toks) {
+    TokSet stop = c->follow;
+    stop.bits[0] |= toks.bits[0];
+    stop.bits[1] |= toks.bits[1];
+    Lexer lex = c->lex;
+    lex.cursor = find_next(c, stop);
+    if (!one_of(lex_peek(&lex).t, toks)) {
+        return false;
     }
+    c->lex = lex;
+    return true;
 }
 
 static void expected(ParseCtx *c, AstNode *in, const char *msg) {
@@ -1451,6 +1783,11 @@ static void expected(ParseCtx *c, AstNode *in, const char *msg) {
                                           .got = tok_to_string[tok.t].data,
                                       });
     in->has_error = true;
+    c->syntax_errors++;
+    // Nothing more will be reported, so don't bother trying to recover
+    if (error_budget_exhausted(c->lex.source)) {
+        c->lex.cursor = c->lex.source->text.len;
+    }
 }
 
 static bool expect(ParseCtx *c, AstNode *in, TokKind t) {
@@ -1459,16 +1796,13 @@ static bool expect(ParseCtx *c, AstNode *in, TokKind t) {
     if (!match) {
         // If we are in a panic state already, don't report an error.
         // Try to synchronise on the currently expected token:
-        // * if we can't - just backtrack and stay in a panic state.
+        // * if we run into the follow set first - stay in a panic state.
         // * if we can - leave panic state and return true.
         if (c->panic_mode) {
-            ParseState m = set_marker(c);
-            advance1(c, t);
-            if (looking_at(c, t)) {
+            if (sync_to(c, TOKS(t))) {
                 c->panic_mode = false;
                 return true;
             }
-            backtrack(c, m);
             return false;
         }
         c->panic_mode = true;
@@ -1487,32 +1821,21 @@ static bool skip_if(ParseCtx *c, AstNode *in, TokKind t) {
     return false;
 }
 
-// static void sync_if_none_of(ParseCtx *c, Toks toks) {
-//     ParseState m = set_marker(c);
-//     advance(c, toks);
-//     if (!one_of(at(c).t, toks)) {
-//         backtrack(c, m);
-//     }
-// }
-
-static bool expect_one_of(ParseCtx *c, AstNode *in, Toks toks,
+static bool expect_one_of(ParseCtx *c, AstNode *in, TokSet toks,
                           const char *message) {
     Tok tok = lex_peek(&c->lex);
     bool match = one_of(tok.t, toks);
     if (!match) {
         // If we are in a panic state already, don't report an error.
         // Try to synchronise on the currently expected token:
-        // * if we can't - just backtrack and stay in a panic state.
+        // * if we run into the follow set first - stay in a panic state.
         // * if we can - leave panic state and return true.
         if (c->panic_mode) {
-            ParseState m = set_marker(c);
-            advance(c, toks);
-            if (one_of(at(c).t, toks)) {
+            if (sync_to(c, toks)) {
                 c->panic_mode = false;
                 return true;
             }
             in->has_error = true;
-            backtrack(c, m);
             return false;
         }
         c->panic_mode = true;
@@ -1523,11 +1846,22 @@ static bool expect_one_of(ParseCtx *c, AstNode *in, Toks toks,
     return match;
 }
 
-static void ensure_progress(ParseCtx *c, ParseFn parse_fn) {
+AstNode *parse_list_element(ParseCtx *c, ParseFn parse_fn) {
     u32 cursor = c->lex.cursor;
-    (void)parse_fn(c);
+    bool panic_mode = c->panic_mode;
+    u32 syntax_errors = c->syntax_errors;
+    u32 errors = errors_raised(c->lex.source);
+    AstNode *n = parse_fn(c);
     bool no_progress_made = cursor == c->lex.cursor;
     if (no_progress_made) {
         next(c);
     }
+    n->reusable = !panic_mode && !c->panic_mode && !no_progress_made &&
+                  c->syntax_errors == syntax_errors &&
+                  errors_raised(c->lex.source) == errors;
+    return n;
+}
+
+static void ensure_progress(ParseCtx *c, ParseFn parse_fn) {
+    (void)parse_list_element(c, parse_fn);
 }
@@ -4,35 +4,245 @@
 #include "../ast/ast.h"
 #include "../lex/lex.h"
 
+// Set of token kinds as a bitset, checking membership is a single AND
 typedef struct {
-    TokKind *items;
-    u32 len;
-} Toks;
-
-// I know this is smelly but C is very limited for variadic args and not storing
-// size with array is really limiting for building abstractions
-#define TOKS(...)                                                 \
-    (Toks) {                                                      \
-        .items = (TokKind[]){__VA_ARGS__},                        \
-        .len = sizeof((TokKind[]){__VA_ARGS__}) / sizeof(TokKind) \
-    }
+    u64 bits[2];
+} TokSet;
+
+_Static_assert(TOK_KIND_COUNT <= 128, "TokSet can only hold 128 token kinds");
+
+#define TOK_BIT(t, w) ((t) / 64 == (w) ? (u64)1 << ((t) % 64) : 0)
+
+// C can't loop in a macro, so the tokens are padded out to a fixed count with
+// a kind that is never in a set. More than 32 tokens is a negative array size
+// error.
+#define TOKS_PAD                                                               \
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, \
+    128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, 128, \
+    128, 128, 128
+#define TOKS_APPLY(m, args) m args
+#define TOKS_WORD(w, ...) TOKS_APPLY(TOKS_WORD_, (w, __VA_ARGS__, TOKS_PAD))
+#define TOKS_WORD_(w,                                                          \
+    a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, a16, \
+    a17, a18, a19, a20, a21, a22, a23, a24, a25, a26, a27, a28, a29, a30, a31, \
+    overflow, ...)                                                             \
+    (TOK_BIT(a0, w) | TOK_BIT(a1, w) | TOK_BIT(a2, w) | TOK_BIT(a3, w) |       \
+    TOK_BIT(a4, w) | TOK_BIT(a5, w) | TOK_BIT(a6, w) | TOK_BIT(a7, w) |        \
+    TOK_BIT(a8, w) | TOK_BIT(a9, w) | TOK_BIT(a10, w) | TOK_BIT(a11, w) |      \
+    TOK_BIT(a12, w) | TOK_BIT(a13, w) | TOK_BIT(a14, w) | TOK_BIT(a15, w) |    \
+    TOK_BIT(a16, w) | TOK_BIT(a17, w) | TOK_BIT(a18, w) | TOK_BIT(a19, w) |    \
+    TOK_BIT(a20, w) | TOK_BIT(a21, w) | TOK_BIT(a22, w) | TOK_BIT(a23, w) |    \
+    TOK_BIT(a24, w) | TOK_BIT(a25, w) | TOK_BIT(a26, w) | TOK_BIT(a27, w) |    \
+    TOK_BIT(a28, w) | TOK_BIT(a29, w) | TOK_BIT(a30, w) | TOK_BIT(a31, w) |    \
+    0 * sizeof(char[(overflow) == 128 ? 1 : -1]))
+
+// Initialiser for a constant set, e.g.
+//   static const TokSet decl_start = TOKSET(T_LET, T_VAR);
+#define TOKSET(...) {{TOKS_WORD(0, __VA_ARGS__), TOKS_WORD(1, __VA_ARGS__)}}
+// The same as a compound literal, to pass a set inline
+#define TOKS(...) ((TokSet)TOKSET(__VA_ARGS__))
+
+typedef enum {
+    PARSE_EVENT_OPEN,
+    PARSE_EVENT_TOKEN,
+    PARSE_EVENT_CLOSE,
+} ParseEventKind;
+
+typedef struct {
+    ParseEventKind t;
+    const char *name;  // Attribute name of an OPEN or TOKEN, can be NULL
+    AstNode *node;     // For OPEN and CLOSE
+    Tok token;         // For TOKEN
+} ParseEvent;
+
+typedef struct {
+    void (*emit)(void *ctx, const ParseEvent *event);
+    void *ctx;
+    // Nodes are freed once the events for their top-level declaration have
+    // been emitted unless this is set
+    bool keep_nodes;
+} ParseEventSink;
+
+typedef struct {
+    AstNode *parent;
+    Child child;
+} PendingChild;
+
+typedef struct {
+    uptr parent;
+    u32 index;
+} PendingOrder;
+
+// State of the parser in event mode (see events.c)
+typedef struct {
+    ParseEventSink sink;
+    struct {
+        PendingChild *items;
+        u32 len;
+        u32 cap;
+    } pending;
+    struct {
+        PendingOrder *items;
+        u32 len;
+        u32 cap;
+    } order;
+} ParseEvents;
+
+// There is no token of a kind from `from` up to `at`. If `found` the next one
+// is at `at` (or there is none if that's EOF), otherwise the scan that looked
+// stopped there.
+typedef struct {
+    u32 from;
+    u32 at;
+    bool known;
+    bool found;
+} NextTok;
+
+// Deep enough for any expression written by hand, shallow enough for the
+// expressions in call arguments (which do recurse) to not run out of stack
+#define DEFAULT_MAX_EXPR_DEPTH 1024
 
 typedef struct {
     Lexer lex;
     Ast *ast;
     AstNode *current;
     bool panic_mode;
+    // Number of threads used to parse top-level declarations (see
+    // parallel.c), 1 parses everything serially
+    u32 jobs;
+    // Skip over function bodies, only recording where they are. They get
+    // parsed when needed with ast_materialize
+    bool lazy_bodies;
+    // Only check the syntax, nodes are still created so the grammar can stay
+    // as is but they aren't linked into a tree and each top-level declaration
+    // is thrown away once parsed. Errors are the same as a full parse.
+    bool syntax_only;
+    // Set by parse_source_file_events, nodes aren't linked into a tree like
+    // with `syntax_only` but reported as events instead
+    ParseEvents *events;
+    // Panic mode recovery won't skip past these tokens, it is the union of
+    // the follow sets of the rules being parsed
+    TokSet follow;
+    // Filled in as recovery scans ahead, so nested rules trying to recover
+    // from the same place don't rescan the input
+    NextTok next_tok[TOK_KIND_COUNT];
+    // Syntax errors raised, including the ones raise_error drops
+    u32 syntax_errors;
+    // How deeply the expression being parsed is nested, and how deep it is
+    // allowed to go (0 means no limit)
+    u32 expr_depth;
+    u32 max_expr_depth;
 } ParseCtx;
 
-typedef struct {
-    Lexer lex;
-} ParseState;
+typedef AstNode *(*ParseFn)(ParseCtx *);
+
+// Follow sets of the rules that recovery is bounded by (see sync_to)
+extern const TokSet decl_start;
+extern const TokSet comp_stmt_follow;
 
 void check_allocs(void);
 
 ParseCtx parse_ctx_create(Ast *ast, SourceCode *code);
 
+// Parses the declarations from the current position to EOF on `c->jobs`
+// threads and adds them to `decls`. Returns false without changing `c` or
+// `decls` if this is not possible (or there were errors) in which case the
+// caller should parse serially.
+bool parse_decls_parallel(ParseCtx *c, Decls *decls);
+// Number of online CPUs
+u32 parse_default_jobs(void);
+
+// Parses a whole file reporting the tree as a stream of open/token/close
+// events instead of building it. The events for each top-level declaration
+// are emitted once it has been parsed.
+void parse_source_file_events(ParseCtx *c, ParseEventSink sink);
+// Used by the parser in event mode
+void parse_events_open(ParseEvents *events, AstNode *node);
+void parse_events_close(ParseEvents *events, AstNode *node);
+void parse_events_child(ParseEvents *events, AstNode *parent, Child child);
+void parse_events_name_last(ParseEvents *events, AstNode *parent,
+                            const char *name);
+void parse_events_reparent(ParseEvents *events, AstNode *node,
+                           AstNode *new_parent);
+void parse_events_flush(ParseEvents *events, AstNode *root);
+
+// Builds the normal tree out of the events (needs `keep_nodes`)
+typedef struct {
+    Ast *ast;
+    struct {
+        AstNode **items;
+        u32 len;
+        u32 cap;
+    } open;
+} AstBuilder;
+
+ParseEventSink ast_builder_sink(AstBuilder *b);
+void ast_builder_free(AstBuilder *b);
+
+// Writes the same output as dump_tree from the events
+typedef struct {
+    FILE *fs;
+    u8 indent_width;
+    struct {
+        u32 *items;
+        u32 len;
+        u32 cap;
+    } levels;
+    // The last line ends in a '{' which is closed on the same line if the
+    // node has no children
+    bool open_brace;
+} EventDumper;
+
+ParseEventSink event_dumper_sink(EventDumper *d);
+void event_dumper_free(EventDumper *d);
+
 SourceFile *parse_source_file(ParseCtx *c);
+
+// A directory of parsed trees keyed by the source text (see cache.c)
+typedef struct {
+    const char *dir;
+    u64 max_size;  // In bytes, 0 means no limit
+    // Identifies the build of the compiler, entries from others are ignored
+    u64 compiler_id;
+    // Of the entries when the directory was last read (once `size_known`),
+    // plus what was stored since. Entries stored by other compilers aren't
+    // counted until it is read again, when the limit looks exceeded.
+    u64 size;
+    bool size_known;
+    u32 hits;
+    u32 misses;
+    u32 scans;  // Times the directory was read to evict entries
+} ParseCache;
+
+ParseCache parse_cache_create(const char *dir, u64 max_size);
+// Same as parse_source_file, but the tree and errors come from `cache` if the
+// same source was parsed with the same options before. With `syntax_only` a
+// hit only raises the errors and returns NULL. Trees with deferred bodies
+// aren't cached, with `lazy_bodies` this just parses.
+SourceFile *parse_source_file_cached(ParseCtx *c, ParseCache *cache);
+
+// The text from `start` up to `old_end` was replaced with what is now between
+// `start` and `new_end`
+typedef struct {
+    u32 start;
+    u32 old_end;
+    u32 new_end;
+} TextEdit;
+
+// Updates `root`, parsed from the text before `edit`, to match the source `c`
+// was created with, reparsing as little as possible (see reparse.c). The
+// result is the same as parsing the new source from scratch.
+//
+// What gets replaced is never freed. Once that is over half of `c->ast` this
+// returns NULL without touching the tree, and the caller must parse the new
+// source into a fresh Ast (dropping this one and its arena) to keep going.
+SourceFile *reparse_source_file(ParseCtx *c, SourceFile *root, TextEdit edit);
+// Parses a list element with `parse_fn`, skipping a token if that didn't
+// get anywhere so the list can't loop forever
+AstNode *parse_list_element(ParseCtx *c, ParseFn parse_fn);
+// Parses a whole file with `syntax_only` set, returns true if there were no
+// errors
+bool check_syntax(SourceCode *code);
 Imports *parse_imports(ParseCtx *c);
 Import *parse_import(ParseCtx *c);
 Decls *parse_decls(ParseCtx *c);
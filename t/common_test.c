@@ -2,6 +2,7 @@
 #include "../common/common.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "../common/map.h"
@@ -42,6 +43,27 @@ void test_arena(void) {
     arena_free(&a);
 }
 
+void test_arena_accounting(void) {
+    Arena a = new_arena();
+    ASSERT(arena_bytes_used(&a) == 0);
+    (void)arena_alloc(&a, 16, 1);
+    ASSERT(arena_bytes_used(&a) == 16);
+
+    // Too big for a block, ends up owned by the arena
+    usize big = a.block_size * 2;
+    u8 *p = arena_alloc_any(&a, big, 1);
+    p[big - 1] = 1;
+    ASSERT(arena_bytes_used(&a) == 16 + big);
+
+    // Everything moves over to the adopting arena
+    Arena b = new_arena();
+    arena_adopt(&b, &a);
+    ASSERT(arena_bytes_used(&a) == 0);
+    ASSERT(arena_bytes_used(&b) == 16 + big);
+    arena_free(&a);
+    arena_free(&b);
+}
+
 typedef struct Point {
     u32 x;
     u32 y;
@@ -126,8 +148,22 @@ void test_stack(void) {
     ASSERT(stack.top == NULL);
 }
 
+// Reference values of MurmurHash3_x64_128
+void test_hash_bytes(void) {
+    u64 hash[2];
+    hash_bytes("", 0, 0, hash);
+    ASSERT(hash[0] == 0 && hash[1] == 0);
+    hash_bytes("hello", 5, 0, hash);
+    ASSERT(hash[0] == 0xcbd8a7b341bd9b02 && hash[1] == 0x5b1e906a48ae1d19);
+    const char *fox = "The quick brown fox jumps over the lazy dog";
+    hash_bytes(fox, strlen(fox), 0, hash);
+    ASSERT(hash[0] == 0xe34bbc7bbc071b6c && hash[1] == 0x7a433ca9c49a9347);
+}
+
 int main(void) {
     test_arena();
+    test_arena_accounting();
     test_hashmap();
     test_stack();
+    test_hash_bytes();
 }
@@ -125,6 +125,18 @@ void test_single_token(void) {
     source_code_free(&code);
 }
 
+void test_operators(void) {
+    string source = ztos("< << <= > >> >= & ^ |");
+    SourceCode code = new_source_code(ztos("<string>"), source);
+    Lexer l = new_lexer(&code);
+    TokKind expect[] = {T_LT, T_SHL,  T_LTEQ,  T_GT,   T_SHR,
+                        T_GTEQ, T_AMP, T_CARET, T_PIPE, T_EOF};
+    for (size_t i = 0; i < sizeof(expect) / sizeof(TokKind); i++) {
+        ASSERT(peek_and_consume(&l).t == expect[i]);
+    }
+    source_code_free(&code);
+}
+
 void test_keywords(void) {
     string source = ztos("funbar fun if ifdo struct structx");
     SourceCode code = new_source_code(ztos("<string>"), source);
@@ -224,6 +236,7 @@ int main(void) {
     test_empty_file();
     test_just_whitespace();
     test_single_token();
+    test_operators();
     test_keywords();
     test_number();
     test_error();
@@ -0,0 +1,163 @@
+// For open_memstream
+#define _POSIX_C_SOURCE 200809L
+
+#include "../mod/mod.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test.h"
+
+// Errors should be reported in source order regardless of the order they
+// were raised in.
+void test_report_sorted(void) {
+    string source = ztos(
+        "let x = 10;\n"
+        "let y = z;\n"
+        "let w = x;\n");
+    SourceCode code = new_source_code(ztos("<string>"), source);
+
+    char *buf = NULL;
+    size_t len = 0;
+    code.error_stream = open_memstream(&buf, &len);
+
+    raise_semantic_error(&code, (SemanticError){.at = 20, .message = "b"});
+    raise_semantic_error(&code, (SemanticError){.at = 4, .message = "a"});
+    raise_semantic_error(&code, (SemanticError){.at = 26, .message = "c"});
+    report_all_errors(code);
+    fclose(code.error_stream);
+
+    ASSERT_STREQL(ztos(buf), S("<string>:1:5: a\n"
+                               " 1 | let x = 10;\n"
+                               "   |     ^\n"
+                               "<string>:2:9: b\n"
+                               " 2 | let y = z;\n"
+                               "   |         ^\n"
+                               "<string>:3:4: c\n"
+                               " 3 | let w = x;\n"
+                               "   |    ^\n"));
+
+    free(buf);
+    source_code_free(&code);
+}
+
+void test_line_and_column(void) {
+    string source = ztos("a\nbc\n\nd");
+    SourceCode code = new_source_code(ztos("<string>"), source);
+
+    Position pos = line_and_column(code.lines, 0);
+    ASSERT(pos.line == 1 && pos.column == 1);
+    pos = line_and_column(code.lines, 3);
+    ASSERT(pos.line == 2 && pos.column == 2);
+    pos = line_and_column(code.lines, 5);
+    ASSERT(pos.line == 3 && pos.column == 1);
+    pos = line_and_column(code.lines, 6);
+    ASSERT(pos.line == 4 && pos.column == 1);
+
+    source_code_free(&code);
+}
+
+// Only the first error at an offset, and with `max_line_errors` set the first
+// syntax error on a line are kept, until the errors are flushed.
+void test_dedup(void) {
+    string source = ztos("let x = ;\nlet y = z;\n");
+    SourceCode code = new_source_code(ztos("<string>"), source);
+    code.error_stream = fopen("/dev/null", "w");
+
+    raise_semantic_error(&code, (SemanticError){.at = 18, .message = "a"});
+    raise_semantic_error(&code, (SemanticError){.at = 18, .message = "b"});
+    raise_syntax_error(&code, (SyntaxError){.at = 8, .expected = "expression"});
+    raise_syntax_error(&code, (SyntaxError){.at = 9, .expected = "';'"});
+    ASSERT(code.errors.len == 3);
+
+    flush_errors(&code);
+    code.max_line_errors = 1;
+    raise_semantic_error(&code, (SemanticError){.at = 18, .message = "a"});
+    raise_syntax_error(&code, (SyntaxError){.at = 8, .expected = "expression"});
+    raise_syntax_error(&code, (SyntaxError){.at = 9, .expected = "';'"});
+    ASSERT(code.errors.len == 2);
+    ASSERT(code.error_count == 5);
+
+    fclose(code.error_stream);
+    source_code_free(&code);
+}
+
+void test_error_budget(void) {
+    string source = ztos("let x = y;\n");
+    SourceCode code = new_source_code(ztos("<string>"), source);
+    code.max_errors = 2;
+
+    char *buf = NULL;
+    size_t len = 0;
+    code.error_stream = open_memstream(&buf, &len);
+
+    for (u32 i = 0; i < 5; i++) {
+        ASSERT(!error_budget_exhausted(&code) || i >= 2);
+        raise_semantic_error(&code, (SemanticError){.at = i, .message = "e"});
+    }
+    ASSERT(error_budget_exhausted(&code));
+    ASSERT(code.errors.len == 2);
+    flush_errors(&code);
+    fclose(code.error_stream);
+
+    ASSERT_STREQL(ztos(buf), S("<string>:1:1: e\n"
+                               " 1 | let x = y;\n"
+                               "   | ^\n"
+                               "<string>:1:2: e\n"
+                               " 1 | let x = y;\n"
+                               "   |  ^\n"
+                               "<string>: too many errors (limit is 2), 3 "
+                               "more not shown\n"));
+
+    free(buf);
+    source_code_free(&code);
+}
+
+// Errors from several buffers are merged in offset order, with the
+// deduplication applied as if they were raised on one thread.
+void test_diag_buffers_merge(void) {
+    string source = ztos("let x = y;\n");
+    SourceCode code = new_source_code(ztos("<string>"), source);
+
+    char *buf = NULL;
+    size_t len = 0;
+    code.error_stream = open_memstream(&buf, &len);
+
+    DiagBuffer bufs[2] = {new_diag_buffer(), new_diag_buffer()};
+
+    diag_buffer_attach(&bufs[1]);
+    char *msg = allocf(diag_arena(&code), "%s", "b");
+    raise_semantic_error(&code, (SemanticError){.at = 8, .message = msg});
+    raise_semantic_error(&code, (SemanticError){.at = 4, .message = "x"});
+
+    diag_buffer_attach(&bufs[0]);
+    raise_semantic_error(&code, (SemanticError){.at = 4, .message = "a"});
+    diag_buffer_attach(NULL);
+
+    ASSERT(code.errors.len == 0);
+    diag_buffers_merge(&code, bufs, 2);
+    ASSERT(code.errors.len == 2);
+    diag_buffer_free(&bufs[0]);
+    diag_buffer_free(&bufs[1]);
+
+    flush_errors(&code);
+    fclose(code.error_stream);
+
+    ASSERT_STREQL(ztos(buf), S("<string>:1:5: a\n"
+                               " 1 | let x = y;\n"
+                               "   |     ^\n"
+                               "<string>:1:9: b\n"
+                               " 1 | let x = y;\n"
+                               "   |         ^\n"));
+
+    free(buf);
+    source_code_free(&code);
+}
+
+int main(void) {
+    test_report_sorted();
+    test_line_and_column();
+    test_dedup();
+    test_error_budget();
+    test_diag_buffers_merge();
+}
@@ -124,6 +124,12 @@ def test_cmd(args):
                     return iota.parse_as(Node.SOURCE_FILE, src)
                 name = f"test_{ie.stem}"
                 snapshot_test(name, ie.read_text(), dump_ast, output.read_text())
+                # Anything that parses should pass the syntax only check too
+                snapshot_test(f"{name}_syntax_only", ie.read_text(),
+                              iota.check_syntax, True)
+                # Same dump but from the parser's event stream
+                snapshot_test(f"{name}_events", ie.read_text(),
+                              iota.dump_events, output.read_text())
             else:
                 assert false, "TODO"
 
@@ -0,0 +1,1254 @@
+// For open_memstream and mkdtemp
+#define _POSIX_C_SOURCE 200809L
+
+#include "../syn/syn.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../ast/ast.h"
+#include "test.h"
+
+typedef struct {
+    char *dump;
+    char *errors;
+} ParseResult;
+
+static DfsCtrl materialize_enter(void *ctx, AstNode *node) {
+    if (ast_is_deferred(node)) {
+        ast_materialize(ctx, (CompStmt *)node);
+    }
+    return DFS_CTRL_KEEP_GOING;
+}
+
+static void mark_ids(Ast *ast, AstNode *n, bool *seen) {
+    ASSERT(n->id < ast->node_count);
+    ASSERT(!seen[n->id]);
+    ASSERT(ast->nodes[n->id] == n);
+    seen[n->id] = true;
+    Children children = ast_node_children(ast, n);
+    for (size_t i = 0; i < children.len; i++) {
+        if (children.items[i].t == CHILD_NODE) {
+            ASSERT(ast_node_parent(ast, children.items[i].node) == n);
+            mark_ids(ast, children.items[i].node, seen);
+        }
+    }
+}
+
+// Side tables are indexed by node id, so no two nodes can share one. The
+// nodes that aren't in the tree have to be detached.
+static void assert_unique_ids(Ast *ast) {
+    bool *seen = calloc(ast->node_count, sizeof(bool));
+    mark_ids(ast, ast->root, seen);
+    for (u32 id = 0; id < ast->node_count; id++) {
+        ASSERT(seen[id] == !ast->nodes[id]->detached);
+    }
+    free(seen);
+}
+
+// Every id not detached is listed once, under the kind of its node
+static void assert_kind_lists(Ast *ast) {
+    u32 total = 0;
+    for (NodeKind k = 0; k < NODE_KIND_COUNT; k++) {
+        NodeIds ids = ast_nodes_of_kind(ast, k);
+        for (u32 i = 0; i < ids.len; i++) {
+            ASSERT(ids.items[i] < ast->node_count);
+            ASSERT(i == 0 || ids.items[i - 1] < ids.items[i]);
+            ASSERT(ast_node_of_kind_at(ast, k, i)->kind == k);
+            ASSERT(!ast_node_of_kind_at(ast, k, i)->detached);
+        }
+        total += ids.len;
+    }
+    u32 attached = 0;
+    for (u32 id = 0; id < ast->node_count; id++) {
+        attached += !ast->nodes[id]->detached;
+    }
+    ASSERT(total == attached);
+}
+
+static ParseResult parse_with(string source, u32 jobs, bool lazy_bodies) {
+    SourceCode code = new_source_code(ztos("<string>"), source);
+    char *errors = NULL;
+    size_t errors_len = 0;
+    code.error_stream = open_memstream(&errors, &errors_len);
+
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    ctx.jobs = jobs;
+    ctx.lazy_bodies = lazy_bodies;
+    SourceFile *root = parse_source_file(&ctx);
+    if (lazy_bodies) {
+        ast_traverse_dfs(&ast, &ast,
+                         (EnterExitVTable){.enter = materialize_enter});
+    }
+    flush_errors(&code);
+    fclose(code.error_stream);
+    assert_unique_ids(&ast);
+    assert_kind_lists(&ast);
+
+    char *dump = NULL;
+    size_t dump_len = 0;
+    FILE *fs = open_memstream(&dump, &dump_len);
+    TreeDumpCtx dump_ctx = {
+        .fs = fs, .indent_level = 0, .indent_width = 2, .ast = &ast};
+    dump_tree(&dump_ctx, &root->head);
+    fclose(fs);
+
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+    return (ParseResult){.dump = dump, .errors = errors};
+}
+
+static void assert_same_as_serial(string source) {
+    ParseResult serial = parse_with(source, 1, false);
+    ParseResult parallel = parse_with(source, 4, false);
+    ASSERT_STREQL(ztos(parallel.dump), ztos(serial.dump));
+    ASSERT_STREQL(ztos(parallel.errors), ztos(serial.errors));
+    free(serial.dump);
+    free(serial.errors);
+    free(parallel.dump);
+    free(parallel.errors);
+}
+
+void test_parallel_decls(void) {
+    assert_same_as_serial(
+        ztos("let _ = foo[10];\n"
+             "\n"
+             "// a comment between declarations\n"
+             "fun main() {\n"
+             "    let y = unit(30);\n"
+             "    let x = 10 + y;\n"
+             "}\n"
+             "type Point = struct {\n"
+             "    x: f32,\n"
+             "    y: f32,\n"
+             "};\n"
+             "type U = (u32 | type I = u32);\n"
+             "fun f() { if x { return 1; } }\n"
+             "var z: u32;\n"));
+}
+
+// Errors make the parser fall back to parsing serially
+void test_parallel_decls_fallback(void) {
+    assert_same_as_serial(
+        ztos("fun main() {\n"
+             "    let y = ;\n"
+             "}\n"
+             "let x = 10;\n"
+             "fun f( {}\n"
+             "let z = 1\n"));
+    assert_same_as_serial(ztos("let x = 1;\n) let y = 2;\n"));
+}
+
+static bool parses_in_parallel(string source) {
+    SourceCode code = new_source_code(ztos("<string>"), source);
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    ctx.jobs = 4;
+    Decls *decls = (Decls *)ast_node_create(&ast, NODE_DECLS);
+    DiagBuffer outer = new_diag_buffer();
+    diag_buffer_attach(&outer);
+    bool ok = parse_decls_parallel(&ctx, decls);
+    // The caller's buffer is put back
+    ASSERT(diag_buffer_attach(NULL) == &outer);
+    diag_buffer_free(&outer);
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+    return ok;
+}
+
+// The `fun` of a function type doesn't start a declaration
+void test_parallel_decls_fun_type(void) {
+    const char *sources[] = {
+        "type F = fun(u32) -> u32;\nlet x = 1;\n",
+        "let g: fun(u32) -> u32 = h;\nfun h(x: u32) -> u32 { return x; }\n",
+    };
+    for (u32 i = 0; i < 2; i++) {
+        ASSERT(parses_in_parallel(ztos((char *)sources[i])));
+        assert_same_as_serial(ztos((char *)sources[i]));
+    }
+}
+
+static void assert_same_as_eager(string source, u32 jobs) {
+    ParseResult eager = parse_with(source, 1, false);
+    ParseResult lazy = parse_with(source, jobs, true);
+    ASSERT_STREQL(ztos(lazy.dump), ztos(eager.dump));
+    ASSERT_STREQL(ztos(lazy.errors), ztos(eager.errors));
+    free(eager.dump);
+    free(eager.errors);
+    free(lazy.dump);
+    free(lazy.errors);
+}
+
+void test_lazy_bodies(void) {
+    string source =
+        ztos("fun main() {\n"
+             "    let y = unit(30);\n"
+             "    if y { while x { f(); } } else { return; }\n"
+             "}\n"
+             "let z = 1;\n"
+             "fun g(x: u32) -> u32 { return x * 2; }\n"
+             "fun h() {}\n");
+    assert_same_as_eager(source, 1);
+    assert_same_as_eager(source, 4);
+
+    // Errors in a body only show up once it is parsed, and recovery stops at
+    // the closing brace
+    assert_same_as_eager(ztos("fun f() {\n"
+                              "    let y = ;\n"
+                              "    x = (1 + ;\n"
+                              "}\n"
+                              "let z = 1;\n"),
+                         1);
+    // Unbalanced braces are parsed straight away
+    assert_same_as_eager(ztos("fun f() {\n"
+                              "    if x {\n"
+                              "}\n"),
+                         1);
+}
+
+void test_lazy_bodies_deferred(void) {
+    SourceCode code =
+        new_source_code(ztos("<string>"), ztos("fun f() { let x = 1; }\n"));
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    ctx.lazy_bodies = true;
+    SourceFile *root = parse_source_file(&ctx);
+
+    Decl *decl = child_decl_at(&ast, &root->decls->head, 0);
+    CompStmt *body = decl->fn_decl->body;
+    ASSERT(ast_is_deferred(&body->head));
+    ASSERT(ast_node_children(&ast, &body->head).len == 0);
+
+    ast_materialize(&ast, body);
+    ASSERT(!ast_is_deferred(&body->head));
+    ASSERT(ast_node_children(&ast, &body->head).len == 1);
+    ASSERT(code.errors.len == 0);
+
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+}
+
+static void assert_same_errors_syntax_only(string source) {
+    ParseResult full = parse_with(source, 1, false);
+
+    SourceCode code = new_source_code(ztos("<string>"), source);
+    char *errors = NULL;
+    size_t errors_len = 0;
+    code.error_stream = open_memstream(&errors, &errors_len);
+    bool ok = check_syntax(&code);
+    flush_errors(&code);
+    fclose(code.error_stream);
+
+    ASSERT(ok == (full.errors[0] == '\0'));
+    ASSERT_STREQL(ztos(errors), ztos(full.errors));
+    source_code_free(&code);
+    free(errors);
+    free(full.dump);
+    free(full.errors);
+}
+
+void test_syntax_only(void) {
+    assert_same_errors_syntax_only(
+        ztos("fun main() {\n"
+             "    let y = unit(30);\n"
+             "    if y { while x { f(a, b = 2); } } else { return; }\n"
+             "}\n"
+             "type U = (u32 | type I = u32);\n"
+             "type T = (u32, s32);\n"
+             "let z = x.y[1:2] * -3 + 4;\n"));
+    assert_same_errors_syntax_only(ztos("fun main() {\n"
+                                        "    let y = ;\n"
+                                        "}\n"
+                                        "let x = 10;\n"
+                                        "fun f( {}\n"
+                                        "let z = 1\n"));
+    assert_same_errors_syntax_only(ztos("let x = 1;\n) let y = (2 + ;\n"));
+}
+
+static ParseResult dump_with_events(string source, bool build_tree) {
+    SourceCode code = new_source_code(ztos("<string>"), source);
+    char *errors = NULL;
+    size_t errors_len = 0;
+    code.error_stream = open_memstream(&errors, &errors_len);
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+
+    char *dump = NULL;
+    size_t dump_len = 0;
+    FILE *fs = open_memstream(&dump, &dump_len);
+    if (build_tree) {
+        AstBuilder builder = {.ast = &ast};
+        parse_source_file_events(&ctx, ast_builder_sink(&builder));
+        ast_builder_free(&builder);
+        TreeDumpCtx dump_ctx = {
+            .fs = fs, .indent_level = 0, .indent_width = 2, .ast = &ast};
+        dump_tree(&dump_ctx, ast.root);
+    } else {
+        EventDumper dumper = {.fs = fs, .indent_width = 2};
+        parse_source_file_events(&ctx, event_dumper_sink(&dumper));
+        event_dumper_free(&dumper);
+    }
+    // Even with the ids of each declaration given out again
+    assert_kind_lists(&ast);
+    fclose(fs);
+
+    flush_errors(&code);
+    fclose(code.error_stream);
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+    return (ParseResult){.dump = dump, .errors = errors};
+}
+
+static void assert_events_match_tree(string source) {
+    ParseResult tree = parse_with(source, 1, false);
+    for (u32 build_tree = 0; build_tree < 2; build_tree++) {
+        ParseResult events = dump_with_events(source, build_tree);
+        ASSERT_STREQL(ztos(events.dump), ztos(tree.dump));
+        ASSERT_STREQL(ztos(events.errors), ztos(tree.errors));
+        free(events.dump);
+        free(events.errors);
+    }
+    free(tree.dump);
+    free(tree.errors);
+}
+
+void test_events(void) {
+    assert_events_match_tree(
+        ztos("fun main() {\n"
+             "    let y = unit(30);\n"
+             "    if y { while x { f(a, b = 2); } } else { return; }\n"
+             "}\n"
+             "type U = (u32 | type I = u32);\n"
+             "type T = (u32, s32);\n"
+             "let z = x.y[1:2] * -3 + 4 - a++;\n"));
+    assert_events_match_tree(ztos("fun main() {\n"
+                                  "    let y = ;\n"
+                                  "}\n"
+                                  "let x = 10;\n"
+                                  "fun f( {}\n"
+                                  "let z = 1\n"));
+}
+
+void test_token_sets(void) {
+    // Spans both words of the set
+    TokKind in[] = {T_EMPTY, T_LPAR, T_IDENT, T_NOT, T_U8, T_ANY};
+    TokSet set = TOKS(T_EMPTY, T_LPAR, T_IDENT, T_NOT, T_U8, T_ANY);
+    for (TokKind t = 0; t < TOK_KIND_COUNT; t++) {
+        bool expected = false;
+        for (usize i = 0; i < sizeof(in) / sizeof(*in); i++) {
+            expected = expected || in[i] == t;
+        }
+        bool got = (set.bits[t / 64] >> (t % 64)) & 1;
+        ASSERT(got == expected);
+    }
+    ASSERT(TOKS(T_EOF).bits[0] == 1ull << T_EOF);
+    ASSERT(TOKS(T_EOF).bits[1] == 0);
+}
+
+void test_recovery_follow_set(void) {
+    // Recovering from the first error must not skip past the end of the
+    // block looking for ')', that would hide the second error
+    ParseResult res = parse_with(ztos("fun f() {\n"
+                                      "    let x = g((1;\n"
+                                      "    h(x;\n"
+                                      "}\n"
+                                      "fun g() {}\n"),
+                                 1, false);
+    ASSERT(strstr(res.errors, "<string>:2:17: syntax error: expected ')'") !=
+           NULL);
+    ASSERT(strstr(res.errors, "<string>:3:8: syntax error: expected ')'") !=
+           NULL);
+    ASSERT(strstr(res.errors, "found '{'") == NULL);
+    free(res.dump);
+    free(res.errors);
+
+    // Used to loop forever as recovery stops at the follow set
+    res = parse_with(ztos("fun f() { case x { \""), 1, false);
+    ASSERT(strstr(res.errors, "unmatched quote") != NULL);
+    free(res.dump);
+    free(res.errors);
+}
+
+// Seconds to parse `lines` copies of `line` in a function body, with every
+// error reported
+static double recovery_time(const char *line, u32 lines) {
+    StrBuf text = {0};
+    strbuf_append(&text, S("fun f() {\n"));
+    for (u32 i = 0; i < lines; i++) {
+        strbuf_append(&text, ztos((char *)line));
+    }
+    SourceCode code =
+        new_source_code(ztos("<string>"), (string){text.items, text.len});
+    code.max_errors = 0;
+    code.error_stream = fopen("/dev/null", "w");
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    (void)parse_source_file(&ctx);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT(ctx.syntax_errors >= lines);
+    flush_errors(&code);
+    fclose(code.error_stream);
+
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+    strbuf_free(&text);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// When nothing in the follow set is left recovery used to scan to the end of
+// the file after every error
+void test_recovery_scaling(void) {
+    const char *lines[] = {"  x = g(1\n", "  x = g([1, (2\n"};
+    for (u32 i = 0; i < 2; i++) {
+        double small = recovery_time(lines[i], 2000);
+        double big = recovery_time(lines[i], 8000);
+        // 4 times the input, that would be 16 times the time if quadratic
+        ASSERT(big < 8 * small + 0.05);
+    }
+}
+
+static char *errors_with_depth(string source, u32 max_expr_depth,
+                               bool lazy_bodies) {
+    SourceCode code = new_source_code(ztos("<string>"), source);
+    char *errors = NULL;
+    size_t errors_len = 0;
+    code.error_stream = open_memstream(&errors, &errors_len);
+
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    ctx.max_expr_depth = max_expr_depth;
+    ctx.lazy_bodies = lazy_bodies;
+    (void)parse_source_file(&ctx);
+    ASSERT(ctx.expr_depth == 0);
+    if (lazy_bodies) {
+        ast_traverse_dfs(&ast, &ast,
+                         (EnterExitVTable){.enter = materialize_enter});
+    }
+    flush_errors(&code);
+    fclose(code.error_stream);
+
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+    return errors;
+}
+
+// `let x = ` then `open` `n` times, `1`, `close` `n` times and `;`
+static string deeply_nested(const char *open, const char *close, u32 n) {
+    size_t open_len = strlen(open);
+    size_t close_len = strlen(close);
+    char *buf = malloc(n * (open_len + close_len) + 16);
+    char *it = buf + sprintf(buf, "let x = ");
+    for (u32 i = 0; i < n; i++, it += open_len) {
+        memcpy(it, open, open_len);
+    }
+    *it++ = '1';
+    for (u32 i = 0; i < n; i++, it += close_len) {
+        memcpy(it, close, close_len);
+    }
+    strcpy(it, ";");
+    return ztos(buf);
+}
+
+static u32 count_of(const char *s, const char *needle) {
+    u32 n = 0;
+    for (const char *it = strstr(s, needle); it != NULL;
+         it = strstr(it + 1, needle)) {
+        n++;
+    }
+    return n;
+}
+
+void test_expr_depth(void) {
+    char *errors = errors_with_depth(ztos("let x = ((1)) + -2;"), 3, false);
+    ASSERT(strcmp(errors, "") == 0);
+    free(errors);
+
+    // One error for the part that is too deep, the parentheses around it
+    // still match up
+    errors = errors_with_depth(ztos("let x = (((1))) + 2;\nlet y = ((1;"), 3,
+                               false);
+    ASSERT(strstr(errors, "<string>:1:12: syntax error: expected a less "
+                          "deeply nested expression") != NULL);
+    ASSERT(strstr(errors, "<string>:2:12: syntax error: expected ')'") !=
+           NULL);
+    ASSERT(count_of(errors, "syntax error") == 2);
+    free(errors);
+
+    // Bodies parsed later get the same limit
+    string body = ztos("fun f() {\n    let x = (((1))) + 2;\n}\n");
+    errors = errors_with_depth(body, 3, false);
+    char *lazy_errors = errors_with_depth(body, 3, true);
+    ASSERT(count_of(errors, "less deeply nested") == 1);
+    ASSERT_STREQL(ztos(lazy_errors), ztos(errors));
+    free(errors);
+    free(lazy_errors);
+
+    // None of these run out of stack
+    const char *nestings[][2] = {
+        {"(", ")"},
+        {"-", ""},
+        {"1 + (", ")"},
+        {"f(", ")"},
+    };
+    for (size_t i = 0; i < sizeof(nestings) / sizeof(*nestings); i++) {
+        string source = deeply_nested(nestings[i][0], nestings[i][1], 100000);
+        errors = errors_with_depth(source, DEFAULT_MAX_EXPR_DEPTH, false);
+        ASSERT(strstr(errors, "less deeply nested expression") != NULL);
+        ASSERT(count_of(errors, "syntax error") == 1);
+        free(errors);
+        free(source.data);
+    }
+}
+
+// Unlike dump_tree this shows where every node and token is
+static void dump_offsets(FILE *fs, Ast *ast, AstNode *n) {
+    fprintf(fs, "%s@%u\n", node_kind_to_string(n->kind), n->offset);
+    if (n->kind == NODE_COMP_STMT) {
+        fprintf(fs, "end@%u\n", ((CompStmt *)n)->end);
+    }
+    Children children = ast_node_children(ast, n);
+    for (u32 i = 0; i < children.len; i++) {
+        Child child = children.items[i];
+        if (child.t == CHILD_NODE) {
+            dump_offsets(fs, ast, child.node);
+        } else {
+            fprintf(fs, "'%.*s'@%u\n", child.token.text.len,
+                    child.token.text.data, child.token.offset);
+        }
+    }
+}
+
+static char *dump_parsed(Ast *ast, SourceFile *root, bool lazy_bodies) {
+    if (lazy_bodies) {
+        ast_traverse_dfs(ast, ast,
+                         (EnterExitVTable){.enter = materialize_enter});
+    }
+    char *dump = NULL;
+    size_t dump_len = 0;
+    FILE *fs = open_memstream(&dump, &dump_len);
+    TreeDumpCtx dump_ctx = {
+        .fs = fs, .indent_level = 0, .indent_width = 2, .ast = ast};
+    dump_tree(&dump_ctx, &root->head);
+    dump_offsets(fs, ast, &root->head);
+    fclose(fs);
+    return dump;
+}
+
+static TextEdit edit_between(string before, string after) {
+    u32 start = 0;
+    while (start < before.len && start < after.len &&
+           before.data[start] == after.data[start]) {
+        start++;
+    }
+    u32 same = 0;
+    while (same < before.len - start && same < after.len - start &&
+           before.data[before.len - same - 1] ==
+               after.data[after.len - same - 1]) {
+        same++;
+    }
+    return (TextEdit){
+        .start = start,
+        .old_end = before.len - same,
+        .new_end = after.len - same,
+    };
+}
+
+// Parses `texts[0]` and reparses each edit after it in turn, the result has to
+// be the same as parsing the last text from scratch. Returns the declaration
+// at `decl` before and after so callers can check it was kept.
+static void assert_reparse(const char **texts, u32 len, bool lazy_bodies,
+                           u32 decl, AstNode **kept) {
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    // The tree keeps a pointer to the source it was parsed from
+    SourceCode codes[2];
+    SourceCode *code = NULL;
+    SourceFile *root = NULL;
+    for (u32 i = 0; i < len; i++) {
+        // A copy so using the old text after it is gone shows up with ASan
+        SourceCode *next = &codes[i % 2];
+        *next = new_source_code(ztos("<string>"), ztos(strdup(texts[i])));
+        ParseCtx ctx = parse_ctx_create(&ast, next);
+        ctx.lazy_bodies = lazy_bodies;
+        if (i == 0) {
+            root = parse_source_file(&ctx);
+            Children decls = ast_node_children(&ast, &root->decls->head);
+            if (decls.len > decl) {
+                kept[0] = decls.items[decl].node;
+            }
+        } else {
+            root = reparse_source_file(&ctx, root,
+                                       edit_between(code->text, next->text));
+            free((char *)code->text.data);
+            source_code_free(code);
+        }
+        code = next;
+    }
+    Children decls = ast_node_children(&ast, &root->decls->head);
+    if (decls.len > decl) {
+        kept[1] = decls.items[decl].node;
+    }
+    char *dump = dump_parsed(&ast, root, lazy_bodies);
+    // What the reparses replaced is out of the kind lists
+    ast.root = &root->head;
+    assert_unique_ids(&ast);
+    assert_kind_lists(&ast);
+    char *errors = NULL;
+    size_t errors_len = 0;
+    code->error_stream = open_memstream(&errors, &errors_len);
+    flush_errors(code);
+    fclose(code->error_stream);
+
+    SourceCode fresh_code =
+        new_source_code(ztos("<string>"), ztos((char *)texts[len - 1]));
+    char *fresh_errors = NULL;
+    size_t fresh_errors_len = 0;
+    fresh_code.error_stream = open_memstream(&fresh_errors, &fresh_errors_len);
+    Arena fresh_arena = new_arena();
+    Ast fresh = ast_create(&fresh_arena);
+    ParseCtx ctx = parse_ctx_create(&fresh, &fresh_code);
+    ctx.lazy_bodies = lazy_bodies;
+    char *fresh_dump =
+        dump_parsed(&fresh, parse_source_file(&ctx), lazy_bodies);
+    flush_errors(&fresh_code);
+    fclose(fresh_code.error_stream);
+
+    ASSERT_STREQL(ztos(dump), ztos(fresh_dump));
+    ASSERT_STREQL(ztos(errors), ztos(fresh_errors));
+
+    free(dump);
+    free(errors);
+    free(fresh_dump);
+    free(fresh_errors);
+    free((char *)code->text.data);
+    source_code_free(code);
+    source_code_free(&fresh_code);
+    ast_delete(ast);
+    ast_delete(fresh);
+    arena_free(&arena);
+    arena_free(&fresh_arena);
+}
+
+#define REPARSE(lazy_bodies, ...)                                        \
+    do {                                                                 \
+        const char *texts[] = {__VA_ARGS__};                             \
+        AstNode *kept[2] = {0};                                          \
+        assert_reparse(texts, sizeof(texts) / sizeof(*texts), lazy_bodies, \
+                       0, kept);                                         \
+    } while (0)
+
+void test_reparse(void) {
+    const char *before = "fun f() {\n"
+                         "    let x = 1;\n"
+                         "    if x { g(x); }\n"
+                         "    let y = 2;\n"
+                         "}\n"
+                         "// trailing comment\n"
+                         "fun g(x: u32) { return x; }\n"
+                         "let z = 3;\n";
+    // A statement, inside a nested block, and across statements
+    REPARSE(false, before,
+            "fun f() {\n"
+            "    let x = 10 + 2;\n"
+            "    if x { g(x); }\n"
+            "    let y = 2;\n"
+            "}\n"
+            "// trailing comment\n"
+            "fun g(x: u32) { return x; }\n"
+            "let z = 3;\n");
+    REPARSE(false, before,
+            "fun f() {\n"
+            "    let x = 1;\n"
+            "    if x { g(x, 2); }\n"
+            "    let y = 2;\n"
+            "}\n"
+            "// trailing comment\n"
+            "fun g(x: u32) { return x; }\n"
+            "let z = 3;\n");
+    REPARSE(false, before,
+            "fun f() {\n"
+            "    let x = 1;\n"
+            "    let y = 2;\n"
+            "}\n"
+            "// trailing comment\n"
+            "fun g(x: u32) { return x; }\n"
+            "let z = 3;\n");
+    // Adding and removing declarations
+    REPARSE(false, before,
+            "fun f() {\n"
+            "    let x = 1;\n"
+            "    if x { g(x); }\n"
+            "    let y = 2;\n"
+            "}\n"
+            "type T = u32;\n"
+            "// trailing comment\n"
+            "fun g(x: u32) { return x; }\n"
+            "let z = 3;\n");
+    REPARSE(false, before, "fun f() {\n}\nlet z = 3;\n");
+    // Edits that change how the rest of the file parses
+    REPARSE(false, before,
+            "fun f() {\n"
+            "    let x = 1;\n"
+            "    if x { g(x); \n"
+            "    let y = 2;\n"
+            "}\n"
+            "// trailing comment\n"
+            "fun g(x: u32) { return x; }\n"
+            "let z = 3;\n");
+    REPARSE(false, before,
+            "fun f() {\n"
+            "    let x = 1;\n"
+            "    if x { g(x); }\n"
+            "    let y = 2;\n"
+            "}\n"
+            "/* trailing comment\n"
+            "fun g(x: u32) { return x; }\n"
+            "let z = 3;\n");
+    // Introducing an error then fixing it, with the same tree throughout
+    REPARSE(false, before,
+            "fun f() {\n"
+            "    let x = ;\n"
+            "    if x { g(x); }\n"
+            "    let y = 2;\n"
+            "}\n"
+            "// trailing comment\n"
+            "fun g(x: u32) { return x; }\n"
+            "let z = 3;\n",
+            "fun f() {\n"
+            "    let x = ;\n"
+            "    if x { g(x); }\n"
+            "    let y = 2;\n"
+            "}\n"
+            "// trailing comment\n"
+            "fun g(x: u32) { return x + 1; }\n"
+            "let z = 3;\n",
+            before);
+    // Imports and the start of the first declaration are parsed from scratch
+    REPARSE(false, "import a;\nfun f() {}\n", "import b;\nfun f() {}\n");
+    REPARSE(false, "fun f() {}\n", "let f = 1;\n");
+    // Deferred bodies are parsed again as a whole
+    REPARSE(true, before,
+            "fun f() {\n"
+            "    let x = 1;\n"
+            "    if x { g(x); }\n"
+            "    let y = ;\n"
+            "}\n"
+            "// trailing comment\n"
+            "fun g(x: u32) { return x; }\n"
+            "let z = 3;\n");
+
+    // Declarations away from the edit are kept
+    const char *texts[] = {
+        "let a = 1;\nfun f() { g(); }\nlet b = 2;\n",
+        "let a = 1;\nfun f() { g(1, 2); }\nlet b = 2;\n",
+        "let a = 1;\nfun f() { g(1, 2); }\nlet b = 2 + 2;\n",
+    };
+    AstNode *kept[2] = {0};
+    assert_reparse(texts, 2, false, 2, kept);
+    ASSERT(kept[0] != NULL && kept[0] == kept[1]);
+    assert_reparse(texts, 3, false, 1, kept);
+    ASSERT(kept[0] != NULL && kept[0] == kept[1]);
+}
+
+// Reparsing back and forth until there's too much garbage in the tree
+void test_reparse_garbage(void) {
+    const char *texts[] = {
+        "let a = 1;\nfun f() { g(); }\nlet b = 2;\n",
+        "let a = 1;\nfun f() { g(1, 2); }\nlet b = 2;\n",
+    };
+    SourceCode codes[2];
+    for (u32 i = 0; i < 2; i++) {
+        codes[i] = new_source_code(ztos("<string>"), ztos((char *)texts[i]));
+    }
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &codes[0]);
+    SourceFile *root = parse_source_file(&ctx);
+    u32 fresh_count = ast.node_count;
+    u32 reparses = 0;
+    for (;; reparses++) {
+        ASSERT(reparses < 100000);
+        SourceCode *code = &codes[(reparses + 1) % 2];
+        SourceCode *prev = &codes[reparses % 2];
+        u32 node_count = ast.node_count;
+        ctx = parse_ctx_create(&ast, code);
+        SourceFile *next = reparse_source_file(
+            &ctx, root, edit_between(prev->text, code->text));
+        if (next == NULL) {
+            // The tree is left alone
+            ASSERT(ast.node_count == node_count);
+            break;
+        }
+        root = next;
+    }
+    // Not every few edits, and not after the tree has grown without bound
+    ASSERT(reparses > 100);
+    ASSERT(ast.node_count - ast.detached_count == fresh_count);
+    ASSERT(ast.detached_count < 2 * fresh_count + 2 * 4096);
+
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&codes[0]);
+    source_code_free(&codes[1]);
+}
+
+typedef struct {
+    FILE *fs;
+    Ast *ast;
+    char tag;  // Lines start with it if set, to tell visitors apart
+} TraceLog;
+
+static void trace_tag(TraceLog *log) {
+    if (log->tag != 0) {
+        fputc(log->tag, log->fs);
+    }
+}
+
+static DfsCtrl trace_enter(void *ctx, AstNode *node) {
+    TraceLog *log = ctx;
+    trace_tag(log);
+    fprintf(log->fs, "+%s\n", node_kind_to_string(node->kind));
+    // Something with children on both sides of it
+    return node->kind == NODE_CALL_ARGS ? DFS_CTRL_SKIP_SUBTREE
+                                        : DFS_CTRL_KEEP_GOING;
+}
+
+static DfsCtrl trace_exit(void *ctx, AstNode *node) {
+    TraceLog *log = ctx;
+    trace_tag(log);
+    fprintf(log->fs, "-%s\n", node_kind_to_string(node->kind));
+    return DFS_CTRL_KEEP_GOING;
+}
+
+// What ast_traverse_dfs has to do
+static void trace_recursive(TraceLog *log, AstNode *node) {
+    DfsCtrl ctrl = DFS_CTRL_KEEP_GOING;
+    if (!node->has_error) {
+        ctrl = trace_enter(log, node);
+    }
+    Children children = ast_node_children(log->ast, node);
+    for (u32 i = 0; ctrl == DFS_CTRL_KEEP_GOING && i < children.len; i++) {
+        if (children.items[i].t == CHILD_NODE) {
+            trace_recursive(log, children.items[i].node);
+        }
+    }
+    if (!node->has_error) {
+        trace_exit(log, node);
+    }
+}
+
+void test_traverse(void) {
+    SourceCode code = new_source_code(
+        ztos("<string>"), ztos("fun f(x: u32) {\n"
+                               "    g(x, (1 + 2) * 3);\n"
+                               "    let y = ;\n"
+                               "    if x { return h(y); }\n"
+                               "}\n"));
+    char *errors = NULL;
+    size_t errors_len = 0;
+    code.error_stream = open_memstream(&errors, &errors_len);
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    (void)parse_source_file(&ctx);
+
+    char *dumps[2];
+    size_t lens[2];
+    for (u32 i = 0; i < 2; i++) {
+        TraceLog log = {.fs = open_memstream(&dumps[i], &lens[i]), .ast = &ast};
+        if (i == 0) {
+            trace_recursive(&log, ast.root);
+        } else {
+            ast_traverse_dfs(&log, &ast,
+                             (EnterExitVTable){
+                                 .enter = trace_enter,
+                                 .exit = trace_exit,
+                             });
+        }
+        fclose(log.fs);
+    }
+    ASSERT(strcmp(dumps[0], dumps[1]) == 0);
+    ASSERT(strstr(dumps[1], "+call_args\n-call_args\n") != NULL);
+    ASSERT(ast.dfs_stack.len == 0);
+    free(dumps[0]);
+    free(dumps[1]);
+
+    flush_errors(&code);
+    fclose(code.error_stream);
+    // The error node is what the walks have to agree on skipping
+    ASSERT(strstr(errors, "expected an atom") != NULL);
+    free(errors);
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+}
+
+// The lines of `dump` starting with `tag`, without it
+static char *trace_lines_of(const char *dump, char tag) {
+    char *out = malloc(strlen(dump) + 1);
+    char *end = out;
+    for (const char *line = dump; *line != '\0';) {
+        const char *next = strchr(line, '\n') + 1;
+        if (*line == tag) {
+            memcpy(end, line + 1, next - line - 1);
+            end += next - line - 1;
+        }
+        line = next;
+    }
+    *end = '\0';
+    return out;
+}
+
+void test_traverse_fused(void) {
+    SourceCode code = new_source_code(
+        ztos("<string>"), ztos("fun f(x: u32) {\n"
+                               "    g(x, (1 + 2) * 3);\n"
+                               "    if x { return h(x); }\n"
+                               "}\n"));
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    (void)parse_source_file(&ctx);
+
+    // Each visitor on its own
+    EnterExitVTable vtables[3] = {
+        {.enter = trace_enter, .exit = trace_exit},
+        {.exit = trace_exit},
+        {.enter = trace_enter, .exit = trace_exit},
+    };
+    char *alone[3];
+    size_t len;
+    for (u32 i = 0; i < 3; i++) {
+        TraceLog log = {.fs = open_memstream(&alone[i], &len), .ast = &ast};
+        ast_traverse_dfs(&log, &ast, vtables[i]);
+        fclose(log.fs);
+    }
+
+    // The last one has to wait for the first, so two walks
+    char *fused;
+    FILE *fs = open_memstream(&fused, &len);
+    TraceLog logs[3] = {
+        {.fs = fs, .ast = &ast, .tag = 'a'},
+        {.fs = fs, .ast = &ast, .tag = 'b'},
+        {.fs = fs, .ast = &ast, .tag = 'c'},
+    };
+    AstVisitor visitors[3];
+    for (u32 i = 0; i < 3; i++) {
+        visitors[i] = (AstVisitor){.ctx = &logs[i], .vtable = vtables[i]};
+    }
+    visitors[2].after = 1 << 0;
+    ast_traverse_fused(&ast, visitors, 3);
+    fclose(fs);
+
+    // Skipping a subtree in one doesn't change what the others see
+    for (u32 i = 0; i < 3; i++) {
+        char *lines = trace_lines_of(fused, logs[i].tag);
+        ASSERT(strcmp(lines, alone[i]) == 0);
+        free(lines);
+    }
+    // In list order at each node, the second walk after the first
+    ASSERT(strstr(fused, "a+call_args\nb-ident\n") != NULL);
+    ASSERT(strstr(fused, "a-call_args\nb-call_args\n") != NULL);
+    ASSERT(strstr(fused, "a-source_file\nb-source_file\nc+source_file\n") !=
+           NULL);
+    ASSERT(ast.dfs_stack.len == 0);
+
+    free(fused);
+    for (u32 i = 0; i < 3; i++) {
+        free(alone[i]);
+    }
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+}
+
+void test_nodes_of_kind(void) {
+    SourceCode code = new_source_code(
+        ztos("<string>"), ztos("type A = u32;\n"
+                               "fun f(x: A) { let y: A = x; }\n"
+                               "type B = A;\n"
+                               "type C = struct { a: A, b: B };\n"));
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    ctx.jobs = 4;
+    (void)parse_source_file(&ctx);
+
+    const char *names[] = {"A", "B", "C"};
+    NodeIds decls = ast_nodes_of_kind(&ast, NODE_TYPE_DECL);
+    ASSERT(decls.len == 3);
+    for (u32 i = 0; i < decls.len; i++) {
+        TypeDecl *td =
+            (TypeDecl *)ast_node_of_kind_at(&ast, NODE_TYPE_DECL, i);
+        ASSERT_STREQL(td->name->token.text, ztos((char *)names[i]));
+    }
+    ASSERT(ast_nodes_of_kind(&ast, NODE_FN_DECL).len == 1);
+    ASSERT(ast_nodes_of_kind(&ast, NODE_SCOPED_IDENT).len == 6);
+    assert_kind_lists(&ast);
+
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+}
+
+// Writes the tree out and loads it into a fresh Ast, which has to dump the
+// same
+static void assert_image_round_trip(Ast *ast, SourceFile *root,
+                                    SourceCode *code) {
+    char *image = NULL;
+    size_t image_len = 0;
+    FILE *fs = open_memstream(&image, &image_len);
+    ASSERT(ast_image_write(ast, &root->head, fs));
+    fclose(fs);
+
+    AstImage img;
+    ASSERT(ast_image_open(&img, image, image_len));
+    // Cut short or from another version it is turned down
+    ASSERT(!ast_image_open(&img, image, image_len - 8));
+    ((AstImageHeader *)image)->version++;
+    ASSERT(!ast_image_open(&img, image, image_len));
+    ((AstImageHeader *)image)->version--;
+    ASSERT(ast_image_open(&img, image, image_len));
+
+    Arena arena = new_arena();
+    Ast loaded = ast_create(&arena);
+    SourceFile *loaded_root =
+        (SourceFile *)ast_image_load(&loaded, &img, code);
+    ASSERT(loaded_root != NULL);
+    loaded.root = &loaded_root->head;
+    assert_unique_ids(&loaded);
+    assert_kind_lists(&loaded);
+
+    char *dump = dump_parsed(ast, root, false);
+    char *loaded_dump = dump_parsed(&loaded, loaded_root, false);
+    ASSERT_STREQL(ztos(loaded_dump), ztos(dump));
+
+    // The typed fields point into the loaded tree
+    NodeIds decls = ast_nodes_of_kind(&loaded, NODE_TYPE_DECL);
+    for (u32 i = 0; i < decls.len; i++) {
+        TypeDecl *td =
+            (TypeDecl *)ast_node_of_kind_at(&loaded, NODE_TYPE_DECL, i);
+        ASSERT(loaded.nodes[td->name->head.id] == &td->name->head);
+        ASSERT(ast_node_parent(&loaded, &td->name->head) == &td->head);
+        ASSERT(td->name->token.text.data ==
+               code->text.data + td->name->token.offset);
+    }
+
+    // A type declaration's name pointing at the root fails the load part way
+    // through, which leaves the Ast as it was
+    u32 node_count = loaded.node_count;
+    u32 pool_len = loaded.child_pool.len;
+    for (u32 i = 0; i < img.header->node_count; i++) {
+        if (img.nodes[i].kind == NODE_TYPE_DECL) {
+            u64 root_slot = 1;
+            memcpy((u8 *)img.payload + img.nodes[i].payload +
+                       offsetof(TypeDecl, name) - sizeof(AstNode),
+                   &root_slot, sizeof(root_slot));
+            break;
+        }
+    }
+    ASSERT(ast_image_load(&loaded, &img, code) == NULL);
+    ASSERT(loaded.node_count == node_count);
+    ASSERT(loaded.child_pool.len == pool_len);
+    assert_kind_lists(&loaded);
+
+    free(dump);
+    free(loaded_dump);
+    free(image);
+    ast_delete(loaded);
+    arena_free(&arena);
+}
+
+void test_image(void) {
+    const char *before = "type A = u32;\n"
+                         "type E = enum { x, y };\n"
+                         "fun f(x: A, ..rest: u32) -> u32 {\n"
+                         "    let s = \"\";\n"
+                         "    if x < 2 { return x; } else { f(x - 1); }\n"
+                         "    case x { 1 -> g(a = 2); else -> {} }\n"
+                         "}\n"
+                         "let z: *ro A = 3 +;\n";
+    const char *after = "type A = u32;\n"
+                        "type B = struct { a: A, b: [4]A };\n"
+                        "type E = enum { x, y };\n"
+                        "fun f(x: A, ..rest: u32) -> u32 {\n"
+                        "    let s = \"\";\n"
+                        "    if x < 2 { return x; } else { f(x - 1); }\n"
+                        "    case x { 1 -> g(a = 2); else -> {} }\n"
+                        "}\n"
+                        "let z: *ro A = 3 +;\n";
+    SourceCode code = new_source_code(ztos("<string>"), ztos((char *)before));
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    SourceFile *root = parse_source_file(&ctx);
+    assert_image_round_trip(&ast, root, &code);
+
+    // After a reparse the kept declarations are still unsettled
+    SourceCode edited = new_source_code(ztos("<string>"), ztos((char *)after));
+    ctx = parse_ctx_create(&ast, &edited);
+    root =
+        reparse_source_file(&ctx, root, edit_between(code.text, edited.text));
+    assert_image_round_trip(&ast, root, &edited);
+
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+    source_code_free(&edited);
+}
+
+// Parses `text` through `cache` (or not if it is NULL), returning the dump
+// and errors
+static ParseResult parse_cached(ParseCache *cache, const char *text,
+                                bool lazy_bodies) {
+    SourceCode code = new_source_code(ztos("<string>"), ztos((char *)text));
+    char *errors = NULL;
+    size_t errors_len = 0;
+    code.error_stream = open_memstream(&errors, &errors_len);
+    Arena arena = new_arena();
+    Ast ast = ast_create(&arena);
+    ParseCtx ctx = parse_ctx_create(&ast, &code);
+    ctx.lazy_bodies = lazy_bodies;
+    SourceFile *root = cache != NULL ? parse_source_file_cached(&ctx, cache)
+                                     : parse_source_file(&ctx);
+    flush_errors(&code);
+    fclose(code.error_stream);
+    assert_unique_ids(&ast);
+    char *dump = dump_parsed(&ast, root, lazy_bodies);
+    ast_delete(ast);
+    arena_free(&arena);
+    source_code_free(&code);
+    return (ParseResult){.dump = dump, .errors = errors};
+}
+
+static void assert_cached_same(ParseCache *cache, const char *text) {
+    ParseResult fresh = parse_cached(NULL, text, false);
+    ParseResult cached = parse_cached(cache, text, false);
+    ASSERT_STREQL(ztos(cached.dump), ztos(fresh.dump));
+    ASSERT_STREQL(ztos(cached.errors), ztos(fresh.errors));
+    free(fresh.dump);
+    free(fresh.errors);
+    free(cached.dump);
+    free(cached.errors);
+}
+
+// Number of entries and their total size, removing them if `clear` is set
+static u32 cache_entries(const char *dir, u64 *size, bool clear) {
+    u32 count = 0;
+    *size = 0;
+    DIR *d = opendir(dir);
+    for (struct dirent *it = readdir(d); it != NULL; it = readdir(d)) {
+        if (it->d_name[0] == '.') {
+            continue;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, it->d_name);
+        struct stat st;
+        ASSERT(stat(path, &st) == 0);
+        *size += st.st_size;
+        count++;
+        if (clear) {
+            unlink(path);
+        }
+    }
+    closedir(d);
+    return count;
+}
+
+void test_parse_cache(void) {
+    const char *texts[] = {
+        "type A = u32;\n"
+        "fun f(x: A) -> A { let y = x +; return y; }\n"
+        "let s = \"\";\n",
+        "type A = u32;\n"
+        "fun f(x: A) -> A { let y = x + 1; return y; }\n"
+        "let s = \"\" ?;\n",
+        "let z = 1;\n",
+        "let w = 2;\n",
+    };
+    char dir[] = "/tmp/iota_cache_XXXXXX";
+    ASSERT(mkdtemp(dir) != NULL);
+    ParseCache cache = parse_cache_create(dir, 0);
+
+    // A miss and then hits, all the same as parsing
+    for (u32 i = 0; i < 2; i++) {
+        for (u32 run = 0; run < 3; run++) {
+            assert_cached_same(&cache, texts[i]);
+        }
+        ASSERT(cache.misses == i + 1);
+        ASSERT(cache.hits == 2 * (i + 1));
+    }
+    u64 size;
+    ASSERT(cache_entries(dir, &size, false) == 2);
+
+    // Trees with deferred bodies aren't stored
+    ParseResult lazy = parse_cached(&cache, texts[0], true);
+    ASSERT(cache.misses == 2 && cache.hits == 4);
+    free(lazy.dump);
+    free(lazy.errors);
+
+    // Only room for two, the second was used least recently so it goes
+    cache.max_size = size;
+    assert_cached_same(&cache, texts[0]);
+    assert_cached_same(&cache, texts[2]);
+    ASSERT(cache.misses == 3 && cache.hits == 5);
+    ASSERT(cache_entries(dir, &size, false) == 2);
+    assert_cached_same(&cache, texts[0]);
+    ASSERT(cache.hits == 6);
+
+    // The directory is read on the first store with a limit, then only once
+    // the stores since take the cache over it
+    ASSERT(cache.scans == 1);
+    u64 limit = size;
+    cache.max_size = 4 * limit;
+    assert_cached_same(&cache, texts[1]);
+    ASSERT(cache.scans == 1 && cache_entries(dir, &size, false) == 3);
+    cache.max_size = limit;
+    assert_cached_same(&cache, texts[3]);
+    ASSERT(cache.misses == 5 && cache.scans == 2);
+    ASSERT(cache_entries(dir, &size, false) != 0 && size <= limit);
+
+    (void)cache_entries(dir, &size, true);
+    ASSERT(rmdir(dir) == 0);
+}
+
+int main(void) {
+    test_parallel_decls();
+    test_parallel_decls_fallback();
+    test_parallel_decls_fun_type();
+    test_lazy_bodies();
+    test_lazy_bodies_deferred();
+    test_syntax_only();
+    test_events();
+    test_token_sets();
+    test_recovery_follow_set();
+    test_recovery_scaling();
+    test_expr_depth();
+    test_reparse();
+    test_reparse_garbage();
+    test_traverse();
+    test_traverse_fused();
+    test_nodes_of_kind();
+    test_image();
+    test_parse_cache();
+}